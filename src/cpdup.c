@@ -76,7 +76,33 @@
 #define GETBUFSIZE	8192
 #define GETPATHSIZE	2048
 #define GETLINKSIZE	1024
-#define GETIOSIZE	65536
+#define GETIOSIZE	(HC_MAXBUFSIZE / 2)	/* largest data payload */
+
+#define PIPE_MEM	(16 * 1024 * 1024)	/* PipeCopy() ring */
+#define PIPE_MINBUF	(64 * 1024)
+#define PIPE_MAXBUF	GETIOSIZE
+#define PIPE_SLOTS	(PIPE_MEM / PIPE_MINBUF)
+#define PIPE_FAST	5		/* ms per buffer */
+#define PIPE_SLOW	50
+
+#define PAR_MIN		(64 * 1024 * 1024)	/* smallest file split (-p) */
+#define PAR_CHUNK	(16 * 1024 * 1024)
+
+#define SORT_FANIN	64		/* runs merged at once (-B) */
+
+#define JOURNAL_MIN	(16 * 1024 * 1024)	/* smallest file resumed (-J) */
+#define JOURNAL_STEP	(16 * 1024 * 1024)	/* progress noted this often */
+
+#define CLONE_MIN	(16 * 1024 * 1024)	/* smallest file cloned (-c) */
+#define CLONE_BLOCK	(1024 * 1024)		/* compared and rewritten */
+
+#define APPEND_MIN	(64 * 1024)		/* smallest file appended to (-a) */
+#define APPEND_WINDOW	(1024 * 1024)		/* compared at each end */
+
+#define FAN_MAX		8		/* targets */
+#define FAN_BLOCK	(1024 * 1024)	/* read once, written to all */
+#define FAN_SLOTS	8
+#define FAN_SCANS	64		/* source listings kept */
 
 #ifndef _ST_FLAGS_PRESENT_
 #define st_flags	st_mode
@@ -90,9 +116,20 @@ typedef struct Node {
     char no_Name[4];
 } Node;
 
+typedef struct SortRun {
+    FILE	*sr_File;
+    struct stat	*sr_Stat;	/* NULL or &sr_StatBuf */
+    struct stat	sr_StatBuf;
+    char	sr_Name[NAME_MAX + 1];
+} SortRun;
+
 typedef struct List {
     Node	li_Node;
     Node	*li_Hash[HSIZE];
+    int		li_Count;	/* scanned entries held in memory */
+    int		li_NRuns;	/* entries spilled to sorted runs (-B) */
+    int		li_Taken;	/* li_Runs[0] was returned by SortNext() */
+    SortRun	**li_Runs;
 } List;
 
 struct hlink {
@@ -110,17 +147,180 @@ typedef struct copy_info {
 	char *dpath;
 	dev_t sdevNo;
 	dev_t ddevNo;
+	struct stat *dstat;	/* destination stat from the parent's scan */
+	int dabsent;		/* parent's scan found no destination entry */
+	struct stat *hstat;	/* same for the -H reference */
+	int habsent;
 } *copy_info_t;
 
-static struct hlink *hltable[HLSIZE];
+/*
+ * Change plan (-w, -e).  A plan starts with PLAN_MAGIC and a PLAN_ROOT
+ * record naming the source and the target, followed by one record per
+ * change in the order DoCopy() would have made it.  Each record is
+ * followed by its path, relative to the roots, and for PLAN_LINK by the
+ * path of the link target.  PLAN_HLINK links to the file of the -H
+ * reference, whose full path follows.
+ */
+#define PLAN_MAGIC	"CPDUPPL1"
+
+enum { PLAN_ROOT, PLAN_MKDIR, PLAN_COPY, PLAN_LINK, PLAN_OTHER, PLAN_ATTR,
+       PLAN_REMOVE, PLAN_HLINK, PLAN_NOPS };
+
+typedef struct PlanRec {
+    int64_t	pr_Size;	/* PLAN_COPY */
+    uint32_t	pr_Mode;	/* source type and mode */
+    uint16_t	pr_PathLen;
+    uint16_t	pr_LinkLen;
+    uint8_t	pr_Op;
+    uint8_t	pr_Unused[7];
+} PlanRec;
+
+/*
+ * Journal (-J).  Records are appended as a copy progresses, each one
+ * followed by its path and, for JOURNAL_FILE, by the path the file is
+ * written to.  The journal starts with a JOURNAL_RUN record naming the
+ * source and, in place of the file written to, the target.
+ */
+enum { JOURNAL_DIR, JOURNAL_FILE, JOURNAL_PROGRESS, JOURNAL_DONE,
+       JOURNAL_USED, JOURNAL_RUN };
+
+typedef struct JournalRec {
+    int64_t	jr_Size;	/* source size */
+    int64_t	jr_Mtime;	/* source mtime */
+    int64_t	jr_Offset;	/* JOURNAL_PROGRESS: bytes written */
+    int32_t	jr_Nsec;
+    uint16_t	jr_PathLen;
+    uint16_t	jr_TmpLen;
+    uint8_t	jr_Type;
+    uint8_t	jr_Unused[7];
+} JournalRec;
+
+typedef struct JournalEnt {
+    struct JournalEnt *je_Next;
+    JournalRec	je_Rec;
+    char	*je_Tmp;
+    char	je_Path[];
+} JournalEnt;
+
+/*
+ * Rename detection (-r).  The manifest holds one record per regular file
+ * the last run left on the target, each one followed by its path relative
+ * to the roots.
+ */
+typedef struct RenameRec {
+    int64_t	rr_Ino;		/* source inode */
+    int64_t	rr_Dev;		/* ... and its device */
+    int64_t	rr_Size;
+    int64_t	rr_Mtime;
+    int32_t	rr_Nsec;
+    uint16_t	rr_PathLen;
+    uint8_t	rr_Unused[2];
+} RenameRec;
+
+typedef struct RenameEnt {
+    struct RenameEnt *re_INext;	/* same inode hash */
+    struct RenameEnt *re_PNext;	/* same path hash */
+    RenameRec	re_Rec;
+    char	*re_Stash;	/* the target file was moved here */
+    int		re_Moved;	/* ... or to a new name */
+    char	re_Path[];
+} RenameEnt;
+
+/*
+ * Store index (-D).  One record per source inode, giving the digest of
+ * its contents at the size, mtime and ctime noted.
+ */
+typedef struct StoreRec {
+    int64_t	so_Ino;
+    int64_t	so_Dev;
+    int64_t	so_Size;
+    int64_t	so_Mtime;
+    int64_t	so_Ctime;
+    int32_t	so_MtimeNsec;
+    int32_t	so_CtimeNsec;
+    char	so_Digest[HC_DIGESTLEN];
+} StoreRec;
+
+typedef struct StoreEnt {
+    struct StoreEnt *se_Next;
+    StoreRec	se_Rec;
+} StoreEnt;
+
+/*
+ * Fan-out to several targets.  Each target is worked on by its own
+ * thread, the threads take turns (see FanYield()) so that they walk the
+ * source tree in lockstep and can share its listings and reads.  The
+ * per-target state of the globals is switched on every turn.
+ */
+typedef struct FanDest {
+    struct HostConf host;
+    char	*path;
+    int		baselen;
+    int		rootprivs;
+    int		groupcount;
+    gid_t	*grouplist;
+    struct hlink *hltable[HLSIZE];
+    pthread_t	thread;
+    int		result;
+    int		done;
+    int64_t	sourcebytes;	/* CountSourceBytes of this target's walk */
+    int64_t	sourceitems;	/* ... and CountSourceItems */
+} FanDest;
+
+static FanDest FanDests[FAN_MAX];
+static FanDest *CurFan = &FanDests[0];
+static struct HostConf *CurDst = &FanDests[0].host;
+static struct hlink **hltable = FanDests[0].hltable;
+
+#define DstHost	(*CurDst)
 
 static void RemoveRecur(const char *dpath, dev_t devNo, struct stat *dstat);
+static void RemoveReport(const char *dpath, mode_t mode, int error);
 static void InitList(List *list);
 static void ResetList(List *list);
 static Node *IterateList(List *list, Node *node, int n);
 static int AddList(List *list, const char *name, int n, struct stat *st);
+static Node *MatchList(List *list, const char *name, int n);
 static int CheckList(List *list, const char *path, const char *name);
+static void ScanAdd(List *list, const char *name, int n, struct stat *st);
+static void SpillList(List *list, int n);
+static void SortList(List *list, int n);
+static SortRun *SortNext(List *list);
+static int MergeDir(copy_info_t info, List *list, List *dlist, int depth);
+static void PlanCreate(const char *file, const char *src, const char *dst);
+static void PlanAdd(int op, const char *dpath, struct stat *st,
+	const char *link);
+static void PlanClose(void);
+static FILE *PlanOpen(const char *file, char **srcp, char **dstp);
+static int PlanRun(FILE *fp, const char *src, const char *dst);
+static void JournalOpen(const char *file, const char *src, const char *dst);
+static void JournalClose(const char *file);
+static int JournalDone(const char *dpath, struct stat *stat1);
+static void JournalDir(const char *dpath, struct stat *stat1);
+static off_t JournalResume(const char *dpath, struct stat *stat1,
+	char **pathp);
+static void JournalStart(const char *dpath, struct stat *stat1,
+	const char *path, off_t offset);
+static void JournalProgress(int bytes);
+static void JournalEnd(void);
+static int JournalUsed(const char *dpath);
+static void RenameOpen(const char *file, const char *src, const char *dst);
+static void RenameClose(const char *file);
+static void RenameNote(const char *dpath, struct stat *stat1);
+static int RenameFind(const char *spath, const char *dpath,
+	struct stat *stat1);
+static int RenameStash(const char *dpath, struct stat *dstat);
+static void StoreOpen(const char *store, const char *host, const char *src);
+static void StoreClose(void);
+static int StoreLink(const char *spath, const char *dpath, struct stat *stat1,
+	int st2Valid, u_long st2_flags, char *digest);
+static void StoreAdd(const char *spath, const char *dpath, struct stat *stat1,
+	const char *digest);
+static int TreeCompare(const char *src, const char *dst);
+static int TreeDiff(const char *spath, const char *dpath, int failed);
 static int getbool(const char *str);
+static int getcount(const char *str, int max);
+static void gettransport(const char *str);
 static char *SplitRemote(char **pathp);
 static int ChgrpAllowed(gid_t g);
 static int OwnerMatch(struct stat *st1, struct stat *st2);
@@ -131,7 +331,8 @@ static int FlagsMatch(struct stat *st1, struct stat *st2);
 #endif
 static struct hlink *hltlookup(struct stat *);
 static struct hlink *hltadd(struct stat *, const char *);
-static char *checkHLPath(struct stat *st, const char *spath, const char *dpath);
+static char *checkHLPath(struct stat *st, const char *spath, const char *dpath,
+	struct stat *hstat, int habsent);
 static int validate_check(const char *spath, const char *dpath);
 static int shash(const char *s);
 static void hltdelete(struct hlink *);
@@ -142,8 +343,37 @@ static int xlink(const char *src, const char *dst, u_long flags);
 static int xremove(struct HostConf *host, const char *path);
 static int xrmdir(struct HostConf *host, const char *path);
 static int DoCopy(copy_info_t info, struct stat *stat1, int depth);
+static int PutFile(struct stat *stat1, const char *spath, const char *path,
+	const char *rpath);
+static void PutFileReport(const char *path, int bytes, int error);
+static int PipeCopy(int fd1, int fd2, off_t offset, const char **opp);
+static int ParallelLanes(void);
+static int ParallelCopy(const char *spath, const char *path, int fd2,
+	struct stat *stat1, const char **opp);
+static int CloneFrom(const char *dpath, const char *path, struct stat *stat1,
+	struct stat *hstat, int habsent);
+static int ClonePatch(const char *spath, const char *path, int fd2,
+	struct stat *stat1, const char **opp, off_t *writtenp);
+static int CopyRange(const char *spath, int fd2, off_t offset, off_t length,
+	char *iobuf, const char **opp);
+static int AppendMatch(const char *spath, const char *dpath, off_t offset,
+	off_t length, unsigned char *ssums, unsigned char *dsums);
+static int AppendCheck(const char *spath, const char *dpath,
+	struct stat *stat1, struct stat *st2, u_long st2_flags);
+static void PrefetchList(List *list, List *dlist, const char *spath,
+	const char *dpath);
+static void FanSelect(int n);
+static void FanYield(void);
+static int FanRun(char *src);
+static int FanCopy(const char *spath, struct stat *stat1, int fd2,
+	const char **opp);
+static void FanRecord(const char *path);
+static void FanNote(const char *name, struct stat *st);
+static int FanReplay(List *list, const char *path);
 static int ScanDir(List *list, struct HostConf *host, const char *path,
 	int64_t *CountReadBytes, int n);
+static void ScanLayout(List *list, struct HostConf *host, DIR *dir,
+	const char *path);
 static int mtimecmp(struct stat *st1, struct stat *st2);
 static int symlink_mfo_test(struct HostConf *hc, struct stat *st1,
 	struct stat *st2);
@@ -163,6 +393,17 @@ int CompressOpt;
 int SlaveOpt;
 int ReadOnlyOpt;
 int ValidateOpt;
+int ScanTreeOpt;
+int InlineOpt;
+int PrefetchOpt;
+int ParallelOpt;
+int LayoutOpt;
+int BigDirOpt;
+int CloneOpt;
+int AppendOpt;
+int TreeOpt;
+int TransportOpt = TRANSPORT_SSH;
+const char *TransportPort = HC_TCP_PORT;
 int ssh_argc;
 const char *ssh_argv[16];
 int DstRootPrivs;
@@ -186,7 +427,42 @@ int64_t CountRemovedItems;
 int64_t CountLinkedItems;
 
 static struct HostConf SrcHost;
-static struct HostConf DstHost;
+
+static FILE *PlanFile;		/* -w */
+static FILE *JournalFp;		/* -J */
+static JournalEnt *JournalHash[HSIZE];
+static char *JournalCur;	/* the file being copied */
+static off_t JournalCurOffset;
+static off_t JournalCurNoted;
+static FILE *RenameFp;		/* -r, the new manifest */
+static char *RenameNew;
+static RenameEnt *RenameIHash[HSIZE];
+static RenameEnt *RenamePHash[HSIZE];
+static const char *RenameSrc;
+static const char *RenameDst;
+static char *RenameDir;		/* files moved aside, until claimed */
+static int RenameCount;
+static const char *StoreDir;	/* -D */
+static char *StoreIndex;
+static StoreEnt *StoreHash[HSIZE];
+static int StoreDirty;
+
+static const char *TreeSrc;	/* -t */
+static const char *TreeDst;
+static dev_t TreeSrcDev;
+static dev_t TreeDstDev;
+static int TreeFlags;
+
+static int FanCount = 1;	/* targets */
+static int FanTurn;		/* the target whose thread may run */
+static pthread_mutex_t FanLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t FanCond = PTHREAD_COND_INITIALIZER;
+static char *FanSrc;
+static struct FanJob *FanJobs;	/* copies other targets may join */
+static struct FanScan *FanScans; /* source listings, most recent first */
+static struct FanScan *FanRec;	/* the listing being recorded */
+static int64_t PlanCount[PLAN_NOPS];
+static int64_t PlanBytes;
 
 int
 main(int ac, char **av)
@@ -196,6 +472,12 @@ main(int ac, char **av)
     char *src = NULL;
     char *dst = NULL;
     char *ptr;
+    const char *planout = NULL;
+    const char *planin = NULL;
+    const char *journal = NULL;
+    const char *manifest = NULL;
+    const char *store = NULL;
+    FILE *plan = NULL;
     struct timeval start;
     struct copy_info info;
 
@@ -203,14 +485,32 @@ main(int ac, char **av)
 
     gettimeofday(&start, NULL);
     opterr = 0;
-    while ((opt = getopt(ac, av, ":CdF:fH:hIi:j:lM:mnoqRSs:uVvX:x")) != -1) {
+    while ((opt = getopt(ac, av, ":aA:B:CcD:de:F:fH:hIi:J:j:lM:mnOoPp:qRr:Ss:T:tuVvw:X:xZ:")) != -1) {
 	switch (opt) {
+	case 'a':
+	    AppendOpt = 1;
+	    break;
+	case 'A':
+	    PrefetchOpt = getcount(optarg, HC_MAXPREFETCH);
+	    break;
+	case 'B':
+	    BigDirOpt = getcount(optarg, INT_MAX);
+	    break;
 	case 'C':
 	    CompressOpt = 1;
 	    break;
+	case 'c':
+	    CloneOpt = 1;
+	    break;
+	case 'D':
+	    store = optarg;
+	    break;
 	case 'd':
 	    DirShowOpt = 1;
 	    break;
+	case 'e':
+	    planin = optarg;
+	    break;
 	case 'F':
 	    if (ssh_argc >= 16)
 		fatal("too many -F options");
@@ -232,6 +532,9 @@ main(int ac, char **av)
 	case 'i':
 	    AskConfirmation = getbool(optarg);
 	    break;
+	case 'J':
+	    journal = optarg;
+	    break;
 	case 'j':
 	    DeviceOpt = getbool(optarg);
 	    break;
@@ -250,21 +553,41 @@ main(int ac, char **av)
 	case 'n':
 	    NotForRealOpt = 1;
 	    break;
+	case 'O':
+	    LayoutOpt = 1;
+	    break;
 	case 'o':
 	    NoRemoveOpt = 1;
 	    break;
+	case 'P':
+	    ScanTreeOpt = 1;
+	    break;
+	case 'p':
+	    ParallelOpt = getcount(optarg, HC_MAXLANES);
+	    if (ParallelOpt < 2)
+		ParallelOpt = 0;
+	    break;
 	case 'q':
 	    QuietOpt = 1;
 	    break;
 	case 'R':
 	    ReadOnlyOpt = 1;
 	    break;
+	case 'r':
+	    manifest = optarg;
+	    break;
 	case 'S':
 	    SlaveOpt = 1;
 	    break;
 	case 's':
 	    SafetyOpt = getbool(optarg);
 	    break;
+	case 'T':
+	    gettransport(optarg);
+	    break;
+	case 't':
+	    TreeOpt = 1;
+	    break;
 	case 'u':
 	    setvbuf(stdout, NULL, _IOLBF, 0);
 	    break;
@@ -274,12 +597,19 @@ main(int ac, char **av)
 	case 'v':
 	    ++VerboseOpt;
 	    break;
+	case 'w':
+	    planout = optarg;
+	    NotForRealOpt = 1;
+	    break;
 	case 'X':
 	    UseCpFile = optarg;
 	    break;
 	case 'x':
 	    UseCpFile = ".cpignore";
 	    break;
+	case 'Z':
+	    InlineOpt = getcount(optarg, HC_MAXBUFSIZE / 4);
+	    break;
 	case ':':
 	    fatal("missing argument for option: -%c\n", optopt);
 	    /* not reached */
@@ -300,15 +630,52 @@ main(int ac, char **av)
 	src = av[0];
     if (ac > 1)
 	dst = av[1];
+    if (ac > 1 + FAN_MAX)
+	fatal("too many targets, at most %d", FAN_MAX);
     if (ac > 2)
-	fatal("too many arguments");
+	FanCount = ac - 1;
+    if (planin && planout)
+	fatal("the -e and -w options are mutually exclusive");
+    if (journal && NotForRealOpt)
+	fatal("the -J option cannot be used with -n or -w");
+    if (manifest && NotForRealOpt)
+	fatal("the -r option cannot be used with -n or -w");
+    if (store && NotForRealOpt)
+	fatal("the -D option cannot be used with -n or -w");
+    if (ScanTreeOpt && BigDirOpt)
+	fatal("the -P option cannot be used with -B");
+    if (CloneOpt && UseHLPath == NULL)
+	fatal("the -c option requires -H");
+    if (TreeOpt && (planin || planout || journal || manifest || store ||
+		    ScanTreeOpt))
+	fatal("the -t option cannot be used with -e, -w, -J, -r, -D or -P");
+    if (FanCount > 1 && (planin || planout || journal || manifest || store ||
+			 CloneOpt || AppendOpt || TreeOpt || ParallelOpt ||
+			 ScanTreeOpt || PrefetchOpt || UseMD5Opt))
+	fatal("several targets cannot be used with -e, -w, -J, -r, -D, -c, "
+	      "-a, -t, -p, -P, -A or -m");
+
+    /*
+     * A plan names the source and target it was made for, either can
+     * be overridden on the command line.
+     */
+    if (planin)
+	plan = PlanOpen(planin, (src ? NULL : &src), (dst ? NULL : &dst));
+    if (planout) {
+	if (src == NULL || dst == NULL)
+	    fatal("-w requires a source and a target");
+	PlanCreate(planout, src, dst);
+    }
 
     /*
      * If we are told to go into slave mode, run the HC protocol
      */
     if (SlaveOpt) {
 	DstRootPrivs = (geteuid() == 0);
-	hc_slave(0, 1);
+	if (TransportOpt == TRANSPORT_TCP)
+	    hc_listen(TransportPort);
+	else
+	    hc_slave(0, 1);
 	exit(0);
     }
 
@@ -323,21 +690,22 @@ main(int ac, char **av)
 	    fatal("The MD5 options are not currently supported for remote sources");
 	if (hc_connect(&SrcHost, ReadOnlyOpt) < 0)
 	    exit(1);
+	SrcHost.inlinemax = InlineOpt;
+	if (ScanTreeOpt && hc_scantree(&SrcHost) < 0 && QuietOpt == 0) {
+	    fprintf(stderr, "WARNING: Unable to stream the source tree "
+		    "from %s, listing it per directory\n", SrcHost.host);
+	}
+	if (PrefetchOpt && hc_prefetch_start(&SrcHost, PrefetchOpt) < 0 &&
+	    QuietOpt == 0) {
+	    fprintf(stderr, "WARNING: Unable to read ahead "
+		    "from %s\n", SrcHost.host);
+	}
     } else {
 	SrcHost.version = HCPROTO_VERSION;
 	if (ReadOnlyOpt)
 	    fatal("The -R option is only supported for remote sources");
     }
 
-    if (dst && (ptr = SplitRemote(&dst)) != NULL) {
-	DstHost.host = dst;
-	dst = ptr;
-	if (hc_connect(&DstHost, 0) < 0)
-	    exit(1);
-    } else {
-	DstHost.version = HCPROTO_VERSION;
-    }
-
     /*
      * dst may be NULL only if -m option is specified,
      * which forces an update of the MD5 checksums
@@ -347,14 +715,37 @@ main(int ac, char **av)
 	/* not reached */
     }
 
-    if (dst) {
-	DstRootPrivs = (hc_geteuid(&DstHost) == 0);
-	if (!DstRootPrivs) {
-	    GroupCount = hc_getgroups(&DstHost, &GroupList);
-	    if (GroupCount < 0)
-		fatal("Unable to get user's groups");
+    /*
+     * Each target has its own connection and privileges.
+     */
+    for (i = 0; i < FanCount; ++i) {
+	FanSelect(i);
+	if (i > 0)
+	    dst = av[1 + i];
+	if (dst && (ptr = SplitRemote(&dst)) != NULL) {
+	    DstHost.host = dst;
+	    dst = ptr;
+	    if (hc_connect(&DstHost, 0) < 0)
+		exit(1);
+	} else {
+	    DstHost.version = HCPROTO_VERSION;
+	}
+	if (dst) {
+	    DstRootPrivs = (hc_geteuid(&DstHost) == 0);
+	    if (!DstRootPrivs) {
+		GroupCount = hc_getgroups(&DstHost, &GroupList);
+		if (GroupCount < 0)
+		    fatal("Unable to get user's groups");
+	    }
+	    FanDests[i].path = dst;
+	    FanDests[i].baselen = strlen(dst);
+	    FanDests[i].rootprivs = DstRootPrivs;
+	    FanDests[i].groupcount = GroupCount;
+	    FanDests[i].grouplist = GroupList;
 	}
     }
+    FanSelect(0);
+    dst = FanDests[0].path;
 #if 0
     /* XXXX DEBUG */
     fprintf(stderr, "DstRootPrivs == %s\n", DstRootPrivs ? "true" : "false");
@@ -364,13 +755,32 @@ main(int ac, char **av)
 #endif
 
     memset(&info, 0, sizeof(info));
+    if (dst && journal)
+	JournalOpen(journal, src, dst);
+    if (dst && manifest)
+	RenameOpen(manifest, src, dst);
+    if (dst && store)
+	StoreOpen(store, SrcHost.host, src);
     if (dst) {
-	DstBaseLen = strlen(dst);
 	info.spath = src;
 	info.dpath = dst;
 	info.sdevNo = (dev_t)-1;
 	info.ddevNo = (dev_t)-1;
-	i = DoCopy(&info, NULL, -1);
+	if (plan)
+	    i = PlanRun(plan, src, dst);
+	else if (TreeOpt)
+	    i = TreeCompare(src, dst);
+	else if (FanCount > 1)
+	    i = FanRun(src);
+	else
+	    i = DoCopy(&info, NULL, -1);
+	i += hc_putfiles_flush(&DstHost, PutFileReport);
+	if (PlanFile)
+	    PlanClose();
+	if (RenameFp)
+	    RenameClose(manifest);
+	if (StoreDir)
+	    StoreClose();
     } else {
 	info.spath = src;
 	info.dpath = NULL;
@@ -381,6 +791,8 @@ main(int ac, char **av)
 #ifndef NOMD5
     md5_flush();
 #endif
+    if (JournalFp)
+	JournalClose(journal);
 
     if (SummaryOpt && i == 0) {
 	double duration;
@@ -433,6 +845,40 @@ getbool(const char *str)
     return (0);
 }
 
+static int
+getcount(const char *str, int max)
+{
+    char *ptr;
+    long n;
+
+    n = strtol(str, &ptr, 10);
+    if (ptr == str || *ptr != '\0' || n < 0 || n > max)
+	fatal("option requires a number from 0 to %d: -%c\n", max, optopt);
+    return ((int)n);
+}
+
+/*
+ * -T ssh | local | shm | tcp[:port]
+ */
+static void
+gettransport(const char *str)
+{
+    if (strcmp(str, "ssh") == 0) {
+	TransportOpt = TRANSPORT_SSH;
+    } else if (strcmp(str, "local") == 0) {
+	TransportOpt = TRANSPORT_LOCAL;
+    } else if (strcmp(str, "shm") == 0) {
+	TransportOpt = TRANSPORT_SHM;
+    } else if (strncmp(str, "tcp", 3) == 0 &&
+	       (str[3] == '\0' || (str[3] == ':' && str[4] != '\0'))) {
+	TransportOpt = TRANSPORT_TCP;
+	if (str[3] == ':')
+	    TransportPort = str + 4;
+    } else {
+	fatal("unknown transport: %s (use ssh, local, shm or tcp[:port])", str);
+    }
+}
+
 /*
  * Check if path specifies a remote path, using the same syntax as scp(1),
  * i.e. a path is considered remote if the first colon is not preceded by
@@ -612,21 +1058,31 @@ hltrels(struct hlink *hl)
  * If UseHLPath is defined check to see if the file in question is
  * the same as the source file, and if it is return a pointer to the
  * -H path based file for hardlinking.  Else return NULL.
+ *
+ * <hstat> and <habsent> come from the parent's scan of the reference
+ * directory, if any, and save looking the file up.
  */
 static char *
-checkHLPath(struct stat *st1, const char *spath, const char *dpath)
+checkHLPath(struct stat *st1, const char *spath, const char *dpath,
+	    struct stat *hstat, int habsent)
 {
     struct stat sthl;
     char *hpath;
     int error;
 
+    if (habsent)
+	return(NULL);
     if (asprintf(&hpath, "%s%s", UseHLPath, dpath + DstBaseLen) < 0)
 	fatal("out of memory");
 
     /*
-     * stat info matches ?
+     * stat info matches ?  A symlink in the scan has to be followed.
      */
-    if (hc_stat(&DstHost, hpath, &sthl) < 0 ||
+    if (hstat != NULL && !S_ISLNK(hstat->st_mode))
+	sthl = *hstat;
+    else if (hc_stat(&DstHost, hpath, &sthl) < 0)
+	sthl.st_mode = 0;
+    if (sthl.st_mode == 0 ||
 	st1->st_size != sthl.st_size ||
 	mtimecmp(st1, &sthl) != 0 ||
 	!OwnerMatch(st1, &sthl) ||
@@ -699,6 +1155,8 @@ DoCopy(copy_info_t info, struct stat *stat1, int depth)
     const char *dpath = info->dpath;
     dev_t sdevNo = info->sdevNo;
     dev_t ddevNo = info->ddevNo;
+    struct stat *hstat = info->hstat;
+    int habsent = info->habsent;
     struct stat st1;
     struct stat st2;
     unsigned long st2_flags;
@@ -711,6 +1169,8 @@ DoCopy(copy_info_t info, struct stat *stat1, int depth)
     size = 0;
     hln = NULL;
 
+    FanYield();
+
     if (stat1 == NULL) {
 	if (hc_lstat(&SrcHost, spath, &st1) != 0) {
 	    r = 1;
@@ -725,12 +1185,16 @@ DoCopy(copy_info_t info, struct stat *stat1, int depth)
 #endif
     st2.st_mode = 0;	/* in case lstat fails */
     st2.st_flags = 0;	/* in case lstat fails */
-    if (dpath && hc_lstat(&DstHost, dpath, &st2) == 0) {
+    if (info->dstat != NULL) {
+	st2 = *info->dstat;
+	st2Valid = 1;
+    } else if (dpath && !info->dabsent && hc_lstat(&DstHost, dpath, &st2) == 0) {
 	st2Valid = 1;
+    }
 #ifdef _ST_FLAGS_PRESENT_
+    if (st2Valid)
 	st2_flags = st2.st_flags;
 #endif
-    }
 
     if (S_ISREG(stat1->st_mode))
 	size = stat1->st_size;
@@ -772,6 +1236,7 @@ DoCopy(copy_info_t info, struct stat *stat1, int depth)
                 }
             }
 
+            PlanAdd(PLAN_LINK, dpath, stat1, hln->name);
             if (xlink(hln->name, dpath, stat1->st_flags) < 0) {
 		int tryrelink = (errno == EMLINK);
 		logerr("%-32s hardlink: unable to link to %s: %s\n",
@@ -855,6 +1320,8 @@ relink:
 		    changedflags = 1;
 		}
 #endif
+		if (changedown || changedflags)
+		    PlanAdd(PLAN_ATTR, dpath, stat1, NULL);
 		if (VerboseOpt >= 3) {
 #ifndef NOMD5
 		    if (UseMD5Opt) {
@@ -906,10 +1373,16 @@ relink:
     if (S_ISDIR(stat1->st_mode)) {
 	int skipdir = 0;
 
+	if (dpath && JournalDone(dpath, stat1)) {
+	    if (VerboseOpt >= 2)
+		logstd("%-32s done before (journal)\n", dpath);
+	    goto done;
+	}
 	if (dpath) {
 	    if (!st2Valid || S_ISDIR(st2.st_mode) == 0) {
 		if (st2Valid)
 		    xremove(&DstHost, dpath);
+		PlanAdd(PLAN_MKDIR, dpath, stat1, NULL);
 		if (hc_mkdir(&DstHost, dpath, stat1->st_mode | 0700) != 0) {
 		    logerr("%s: mkdir failed: %s\n",
 			(dpath ? dpath : spath), strerror(errno));
@@ -921,8 +1394,10 @@ relink:
 			logerr("%s: lstat of newly made dir failed: %s\n",
 			       (dpath ? dpath : spath), strerror(errno));
 		    st2Valid = 0;
-		    r = 1;
-		    skipdir = 1;
+		    if (PlanFile == NULL) {
+			r = 1;
+			skipdir = 1;
+		    }
 		}
 		else {
 		    st2Valid = 1;
@@ -946,6 +1421,7 @@ relink:
 		 * st2.st_mode to match what we did ).
 		 */
 		if ((st2.st_mode & 0700) != 0700) {
+		    PlanAdd(PLAN_MKDIR, dpath, stat1, NULL);
 		    hc_chmod(&DstHost, dpath, st2.st_mode | 0700);
 		    st2.st_mode |= 0700;
 		}
@@ -985,12 +1461,70 @@ relink:
 
 	if (!skipdir) {
 	    List *list = malloc(sizeof(List));
+	    List *dlist = NULL;
+	    List *hlist = NULL;
 	    Node *node;
+	    Node *dnode;
 
 	    if (DirShowOpt)
 		logstd("Scanning %s ...\n", spath);
 	    InitList(list);
 	    if (ScanDir(list, &SrcHost, spath, &CountSourceReadBytes, 0) == 0) {
+		/*
+		 * Scan the destination only once.  The stat info it returns
+		 * (remote only) replaces the lstat() of each child, entries
+		 * it did not find need not be looked up at all, and the
+		 * leftovers are what has to be removed afterwards.
+		 */
+		if (dpath) {
+		    dlist = malloc(sizeof(List));
+		    InitList(dlist);
+		    if (ScanDir(dlist, &DstHost, dpath,
+				&CountTargetReadBytes, 3) != 0) {
+			ResetList(dlist);
+			free(dlist);
+			dlist = NULL;
+		    }
+		}
+		/*
+		 * Likewise list the -H reference directory once to find
+		 * the files which may be linked.  If it cannot be read,
+		 * nothing is linked from it.
+		 */
+		if (dpath && UseHLPath && list->li_NRuns == 0 &&
+		    (dlist == NULL || dlist->li_NRuns == 0)) {
+		    char *hpath;
+
+		    hpath = mprintf("%s%s", UseHLPath, dpath + DstBaseLen);
+		    hlist = malloc(sizeof(List));
+		    InitList(hlist);
+		    ScanDir(hlist, &DstHost, hpath, &CountTargetReadBytes, 3);
+		    if (hlist->li_NRuns) {
+			/* too large (-B), look files up one by one */
+			ResetList(hlist);
+			free(hlist);
+			hlist = NULL;
+		    }
+		    free(hpath);
+		}
+		if (list->li_NRuns || (dlist && dlist->li_NRuns)) {
+		    /*
+		     * Too large to hold in memory (-B), merge the sorted
+		     * listings instead.  This leaves nothing for the loops
+		     * below.
+		     */
+		    info->sdevNo = sdevNo;
+		    info->ddevNo = ddevNo;
+		    r += MergeDir(info, list, dlist, depth);
+		    if (dlist) {
+			ResetList(dlist);
+			free(dlist);
+			dlist = NULL;
+		    }
+		} else if (dpath && PrefetchOpt && NotForRealOpt == 0) {
+		    PrefetchList(list, dlist, spath, dpath);
+		}
+
 		node = NULL;
 		while ((node = IterateList(list, node, 0)) != NULL) {
 		    char *nspath;
@@ -1004,6 +1538,24 @@ relink:
 		    info->dpath = ndpath;
 		    info->sdevNo = sdevNo;
 		    info->ddevNo = ddevNo;
+		    info->dstat = NULL;
+		    info->dabsent = 0;
+		    if (dlist) {
+			dnode = MatchList(dlist, node->no_Name, 0);
+			if (dnode != NULL)
+			    info->dstat = dnode->no_Stat;
+			else
+			    info->dabsent = 1;
+		    }
+		    info->hstat = NULL;
+		    info->habsent = 0;
+		    if (hlist) {
+			dnode = MatchList(hlist, node->no_Name, 0);
+			if (dnode != NULL)
+			    info->hstat = dnode->no_Stat;
+			else
+			    info->habsent = 1;
+		    }
 		    if (depth < 0)
 			r += DoCopy(info, node->no_Stat, depth);
 		    else
@@ -1013,32 +1565,54 @@ relink:
 			free(ndpath);
 		    info->spath = NULL;
 		    info->dpath = NULL;
+		    info->dstat = NULL;
+		    info->dabsent = 0;
+		    info->hstat = NULL;
+		    info->habsent = 0;
+		}
+		if (hlist) {
+		    ResetList(hlist);
+		    free(hlist);
 		}
+		if (dpath)
+		    r += hc_putfiles_flush(&DstHost, PutFileReport);
 
 		/*
 		 * Remove files/directories from destination that do not appear
 		 * in the source.
 		 */
-		if (dpath && ScanDir(list, &DstHost, dpath,
-				     &CountTargetReadBytes, 3) == 0) {
-		    node = NULL;
-		    while ((node = IterateList(list, node, 3)) != NULL) {
+		if (dlist) {
+		    dnode = NULL;
+		    while ((dnode = IterateList(dlist, dnode, 3)) != NULL) {
 			/*
 			 * If object does not exist in source or .cpignore
 			 * then recursively remove it.
 			 */
 			char *ndpath;
 
-			ndpath = mprintf("%s/%s", dpath, node->no_Name);
-			RemoveRecur(ndpath, ddevNo, node->no_Stat);
+			if (MatchList(list, dnode->no_Name, 3) != NULL)
+			    continue;
+			if (UseCpFile && UseCpFile[0] == '/' &&
+			    CheckList(list, dpath, dnode->no_Name) == 0)
+			    continue;
+			ndpath = mprintf("%s/%s", dpath, dnode->no_Name);
+			RemoveRecur(ndpath, ddevNo, dnode->no_Stat);
 			free(ndpath);
 		    }
+		    ResetList(dlist);
+		    free(dlist);
 		}
 	    }
 	    ResetList(list);
 	    free(list);
 	}
 
+	if (dpath && PlanFile &&
+	    (!st2Valid || ForceOpt || !OwnerMatch(stat1, &st2) ||
+	     stat1->st_mode != st2.st_mode || !FlagsMatch(stat1, &st2) ||
+	     mtimecmp(stat1, &st2) != 0)) {
+	    PlanAdd(PLAN_ATTR, dpath, stat1, NULL);
+	}
 	if (dpath && st2Valid) {
 	    struct timeval tv[2];
 
@@ -1061,6 +1635,8 @@ relink:
 		hc_utimes(&DstHost, dpath, tv);
 	    }
 	}
+	if (dpath && r == 0)
+	    JournalDir(dpath, stat1);
     } else if (dpath == NULL) {
 	/*
 	 * If dpath is NULL, we are just updating the MD5
@@ -1086,7 +1662,13 @@ relink:
     } else if (S_ISREG(stat1->st_mode)) {
 	char *path;
 	char *hpath;
-	int fd1;
+	char digest[HC_DIGESTLEN + 1];
+	int parallel;
+	int cloned;
+	int appended;
+	int fanned;
+	off_t resume;
+	int fd1 = -1;
 	int fd2;
 
 	if (st2Valid)
@@ -1111,7 +1693,29 @@ relink:
 	 * situations but most typically when the '-f -H' combination is
 	 * used.
 	 */
-	if (UseHLPath && (hpath = checkHLPath(stat1, spath, dpath)) != NULL) {
+	if (UseHLPath &&
+	    (hpath = checkHLPath(stat1, spath, dpath, hstat, habsent)) != NULL) {
+		if (PlanFile != NULL) {
+			PlanAdd(PLAN_HLINK, dpath, stat1, hpath);
+			++CountLinkedItems;
+			free(hpath);
+			goto skip_copy;
+		}
+		/*
+		 * A remote target makes the links in batches, unless
+		 * the inode linked to is needed right away.
+		 */
+		if (hln == NULL &&
+#ifdef _ST_FLAGS_PRESENT_
+		    stat1->st_flags == 0 && st2_flags == 0 &&
+#endif
+		    (fd1 = hc_putlink(&DstHost, path, st2Valid ? dpath : NULL,
+				      hpath, PutFileReport)) >= 0) {
+			r += fd1;
+			fd1 = -1;
+			free(hpath);
+			goto skip_copy;
+		}
 		if (st2Valid)
 			xremove(&DstHost, dpath);
 		if (hc_link(&DstHost, hpath, dpath) == 0) {
@@ -1130,8 +1734,71 @@ relink:
 		free(hpath);
 	}
 
-	if ((fd1 = hc_open(&SrcHost, spath, O_RDONLY, 0)) >= 0) {
-	    if ((fd2 = hc_open(&DstHost, path, O_WRONLY|O_CREAT|O_EXCL, 0600)) < 0) {
+	/*
+	 * A new file may be one the target has under another name (-r).
+	 */
+	if (!st2Valid && RenameFind(spath, dpath, stat1) == 0)
+	    goto skip_copy;
+
+	/*
+	 * In store mode (-D), link to the object with the same contents
+	 * if there is one.  Otherwise the copy becomes that object.
+	 */
+	if (StoreLink(spath, dpath, stat1, st2Valid, st2_flags, digest) == 0)
+	    goto skip_copy;
+
+	/*
+	 * When only making a plan (-w), note the copy and move on.
+	 */
+	if (PlanFile != NULL) {
+	    PlanAdd(PLAN_COPY, dpath, stat1, NULL);
+	    CountSourceBytes += size;
+	    CountSourceItems++;
+	    CountCopiedItems++;
+	    goto skip_copy;
+	}
+
+	/*
+	 * Small files to a remote target are created in batches.
+	 */
+	if (hln == NULL && NotForRealOpt == 0 && digest[0] == 0 &&
+#ifdef _ST_FLAGS_PRESENT_
+	    stat1->st_flags == 0 && st2_flags == 0 &&
+#endif
+	    (fd1 = PutFile(stat1, spath, path, st2Valid ? dpath : NULL)) >= 0) {
+	    r += fd1;
+	    goto skip_copy;
+	}
+
+	/*
+	 * A copy interrupted in an earlier run continues where it stopped
+	 * (-J).  Otherwise a file which only grew gets the new data
+	 * appended (-a), a large file may start out as a clone of the one
+	 * in the -H reference with just the changed blocks rewritten (-c),
+	 * or be copied in chunks by several lanes at once, which read the
+	 * source themselves.  With several targets the source is read once
+	 * for all of them which copy the file at the same time.
+	 */
+	resume = JournalResume(dpath, stat1, &path);
+	appended = (resume == 0 && st2Valid &&
+		    AppendCheck(spath, dpath, stat1, &st2, st2_flags) == 0);
+	if (appended) {
+	    free(path);
+	    path = mprintf("%s", dpath);
+	}
+	cloned = (resume == 0 && !appended &&
+		  CloneFrom(dpath, path, stat1, hstat, habsent) == 0);
+	parallel = (resume == 0 && !appended && !cloned && size >= PAR_MIN &&
+		    NotForRealOpt == 0 && ParallelLanes() > 0);
+	fanned = (FanCount > 1);
+	if (resume)
+	    fd1 = hc_openrange(&SrcHost, spath, resume, size - resume);
+	else if (!parallel && !cloned && !appended && !fanned)
+	    fd1 = hc_open(&SrcHost, spath, O_RDONLY, 0);
+	if (parallel || cloned || appended || fanned || fd1 >= 0) {
+	    if (resume || cloned || appended) {
+		fd2 = hc_open(&DstHost, path, O_WRONLY, 0);
+	    } else if ((fd2 = hc_open(&DstHost, path, O_WRONLY|O_CREAT|O_EXCL, 0600)) < 0) {
 		/*
 		 * There could be a .tmp file from a previously interrupted
 		 * run, delete and retry.  Fail if we still can't get at it.
@@ -1145,17 +1812,36 @@ relink:
 	    if (fd2 >= 0) {
 		const char *op;
 		char *iobuf1 = malloc(GETIOSIZE);
+		off_t written = size;
 		int n;
 
 		/*
 		 * Matt: What about holes?
 		 */
 		op = "read";
-		while ((n = hc_read(&SrcHost, fd1, iobuf1, GETIOSIZE)) > 0) {
-		    op = "write";
-		    if (hc_write(&DstHost, fd2, iobuf1, n) != n)
-			break;
-		    op = "read";
+		if (!parallel && !cloned && !appended)
+		    JournalStart(dpath, stat1, path, resume);
+		if (appended) {
+		    written = size - st2.st_size;
+		    n = CopyRange(spath, fd2, st2.st_size, written, iobuf1, &op);
+		} else if (cloned) {
+		    n = ClonePatch(spath, path, fd2, stat1, &op, &written);
+		} else if (parallel) {
+		    n = ParallelCopy(spath, path, fd2, stat1, &op);
+		} else if (fanned) {
+		    n = FanCopy(spath, stat1, fd2, &op);
+		} else if (resume) {
+		    written = size - resume;
+		    n = PipeCopy(fd1, fd2, resume, &op);
+		} else if (size > 4 * PIPE_MINBUF) {
+		    n = PipeCopy(fd1, fd2, -1, &op);
+		} else {
+		    while ((n = hc_read(&SrcHost, fd1, iobuf1, GETIOSIZE)) > 0) {
+			op = "write";
+			if (hc_write(&DstHost, fd2, iobuf1, n) != n)
+			    break;
+			op = "read";
+		    }
 		}
 		hc_close(&DstHost, fd2);
 		if (n == 0) {
@@ -1178,26 +1864,33 @@ relink:
 #else
 		    hc_utimes(&DstHost, path, tv);
 #endif
-		    if (st2Valid && xrename(path, dpath, st2_flags) != 0) {
+		    if (strcmp(path, dpath) != 0 &&
+			xrename(path, dpath, st2_flags) != 0) {
 			logerr("%-32s rename-after-copy failed: %s\n",
 			    (dpath ? dpath : spath), strerror(errno)
 			);
 			xremove(&DstHost, path);
 			++r;
 		    } else {
-			if (VerboseOpt)
-			    logstd("%-32s copy-ok\n", (dpath ? dpath : spath));
+			if (VerboseOpt) {
+			    logstd("%-32s %s\n", (dpath ? dpath : spath),
+				   (appended ? "appended(-a)" :
+				    cloned ? "cloned(-c)" : "copy-ok"));
+			}
 #ifdef _ST_FLAGS_PRESENT_
 			if (DstRootPrivs ? stat1->st_flags : stat1->st_flags & UF_SETTABLE)
 			    hc_chflags(&DstHost, dpath, stat1->st_flags);
 #endif
+			StoreAdd(spath, dpath, stat1, digest);
 		    }
 #ifdef _ST_FLAGS_PRESENT_
 		    if ((stat1->st_flags & (UF_IMMUTABLE|SF_IMMUTABLE)) == 0)
 			hc_utimes(&DstHost, dpath, tv);
 #endif
-		    CountSourceReadBytes += size;
-		    CountWriteBytes += size;
+		    if (!fanned)	/* FanCopy() counts its reads */
+			CountSourceReadBytes += (appended || resume) ?
+						(uint64_t)written : size;
+		    CountWriteBytes += written;
 		    CountSourceBytes += size;
 		    CountSourceItems++;
 		    CountCopiedItems++;
@@ -1205,9 +1898,11 @@ relink:
 		    logerr("%-32s %s failed: %s\n",
 			(dpath ? dpath : spath), op, strerror(errno)
 		    );
-		    hc_remove(&DstHost, path);
+		    if (!appended)
+			hc_remove(&DstHost, path);
 		    ++r;
 		}
+		JournalEnd();
 		free(iobuf1);
 	    } else {
 		logerr("%-32s create (uid %d, euid %d) failed: %s\n",
@@ -1216,7 +1911,8 @@ relink:
 		);
 		++r;
 	    }
-	    hc_close(&SrcHost, fd1);
+	    if (fd1 >= 0)
+		hc_close(&SrcHost, fd1);
 	} else {
 	    logerr("%-32s copy: open failed: %s\n",
 		(dpath ? dpath : spath),
@@ -1228,7 +1924,9 @@ skip_copy:
 	free(path);
 
         if (hln) {
-            if (!r && hc_stat(&DstHost, dpath, &st2) == 0) {
+            if (!r && PlanFile != NULL) {
+		hltsetdino(hln, 0);	/* link the others to the planned copy */
+	    } else if (!r && hc_stat(&DstHost, dpath, &st2) == 0) {
 		hltsetdino(hln, st2.st_ino);
 	    } else {
                 hltdelete(hln);
@@ -1264,6 +1962,7 @@ skip_copy:
 		tv[1].tv_usec = stat1->st_mtim.tv_nsec / 1000;
 #endif
 
+		PlanAdd(PLAN_OTHER, dpath, stat1, NULL);
 		hc_umask(&DstHost, ~stat1->st_mode);
 		xremove(&DstHost, path);
 		link1[n1] = 0;
@@ -1311,6 +2010,7 @@ skip_copy:
 		if (VerboseOpt >= 3)
 		    logstd("%-32s nochange", (dpath ? dpath : spath));
 		if (!OwnerMatch(stat1, &st2)) {
+		    PlanAdd(PLAN_ATTR, dpath, stat1, NULL);
 		    hc_lchown(&DstHost, dpath, stat1->st_uid, stat1->st_gid);
 		    if (VerboseOpt >= 3)
 			logstd(" (uid/gid differ)");
@@ -1339,6 +2039,7 @@ skip_copy:
 	    stat1->st_rdev != st2.st_rdev ||
 	    !OwnerMatch(stat1, &st2)
 	) {
+	    PlanAdd(PLAN_OTHER, dpath, stat1, NULL);
 	    if (st2Valid) {
 		path = mprintf("%s.tmp%d", dpath, (int)getpid());
 		xremove(&DstHost, path);
@@ -1375,6 +2076,10 @@ skip_copy:
 	CountSourceItems++;
     }
 done:
+    if (r == 0 && dpath && stat1 && S_ISREG(stat1->st_mode))
+	RenameNote(dpath, stat1);
+    if (stat1 && S_ISREG(stat1->st_mode))
+	hc_prefetch_drop(&SrcHost, spath);
     if (hln) {
 	if (hln->dino == (ino_t)-1) {
 	    hltdelete(hln);
@@ -1386,184 +2091,2912 @@ done:
     return (r);
 }
 
-int
-ScanDir(List *list, struct HostConf *host, const char *path,
-	int64_t *CountReadBytes, int n)
+/*
+ * Copy loop for larger files.  A reader thread fills a ring of buffers
+ * from <fd1> while the caller writes them to <fd2>, so a read and a
+ * write are in flight at the same time and the copy runs at the speed
+ * of the slower side instead of the sum of both.
+ *
+ * The buffer size follows the measured time per buffer: it doubles while
+ * the slower side takes less than PIPE_FAST ms to move one and halves
+ * when it takes more than PIPE_SLOW ms.  The ring holds as many buffers
+ * as fit into PIPE_MEM, so fewer of them as they grow.
+ *
+ * <fd2> is written from <offset> on, or at its current position if
+ * <offset> is -1.
+ *
+ * Returns 0 on success, else -1 with errno set and *opp naming the
+ * operation which failed.
+ */
+typedef struct CopyPipe {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int		fd;		/* source */
+    struct {
+	char	*data;
+	int	size;		/* allocated */
+	int	bytes;		/* filled */
+    } ring[PIPE_SLOTS];
+    int		head;		/* buffers filled */
+    int		tail;		/* buffers written */
+    int		inuse;		/* bytes allocated in the ring */
+    int		bufsize;	/* size of the next read */
+    int64_t	rtime;		/* usecs for the last read ... */
+    int64_t	wtime;		/* ... and write */
+    int		done;		/* reader hit EOF or an error */
+    int		error;		/* errno of a failed read */
+    int		stop;		/* writer failed, reader must quit */
+} CopyPipe;
+
+static int64_t
+PipeTime(void)
 {
-    DIR *dir;
-    struct HostConf *cphost;
-    struct HCDirEntry *den;
-    struct stat *statptr;
+    struct timeval tv;
 
-    if (n == 0) {
-	/*
-	 * scan .cpignore file for files/directories to ignore
-	 * (only in the source directory, i.e. if n == 0).
-	 */
-	if (UseCpFile) {
-	    int fd;
-	    int nread;
-	    int bufused;
-	    char *buf = malloc(GETBUFSIZE);
-	    char *nl, *next;
-	    char *fpath;
+    gettimeofday(&tv, NULL);
+    return ((int64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+}
 
-	    if (UseCpFile[0] == '/') {
-		fpath = mprintf("%s", UseCpFile);
-		cphost = NULL;
-	    } else {
-		fpath = mprintf("%s/%s", path, UseCpFile);
-		AddList(list, strrchr(fpath, '/') + 1, 1, NULL);
-		cphost = host;
-	    }
-	    fd = hc_open(cphost, fpath, O_RDONLY, 0);
-	    if (fd >= 0) {
-		bufused = 0;
-		while ((nread = hc_read(cphost, fd, buf + bufused,
-			GETBUFSIZE - bufused - 1)) > 0) {
-		    *CountReadBytes += nread;
-		    bufused += nread;
-		    buf[bufused] = 0;
-		    for (next = buf; (nl = strchr(next, '\n')); next = nl+1) {
-			*nl = 0;
-			AddList(list, next, 1, NULL);
-		    }
-		    bufused = strlen(next);
-		    if (bufused)
-			memcpy(buf, next, bufused);
-		}
-		if (bufused) {
-		    /* last line has no trailing newline */
-		    buf[bufused] = 0;
-		    AddList(list, buf, 1, NULL);
-		}
-		hc_close(cphost, fd);
-	    }
-	    free(fpath);
-	    free(buf);
-	}
+/*
+ * Adjust the buffer size, called by the reader with the lock held.
+ * Only the reader does it, once per buffer, with the last write time
+ * the writer left.
+ */
+static void
+PipeAdapt(CopyPipe *cp)
+{
+    int64_t slow = (cp->rtime > cp->wtime) ? cp->rtime : cp->wtime;
 
-	/*
-	 * Automatically exclude MD5CacheFile that we create on the
-	 * source from the copy to the destination.
-	 */
-	if (UseMD5Opt)
-	    AddList(list, MD5CacheFile, 1, NULL);
-    }
+    if (slow < PIPE_FAST * 1000 && cp->bufsize < PIPE_MAXBUF)
+	cp->bufsize *= 2;
+    else if (slow > PIPE_SLOW * 1000 && cp->bufsize > PIPE_MINBUF)
+	cp->bufsize /= 2;
+}
 
-    if ((dir = hc_opendir(host, path)) == NULL)
-	return (1);
-    while ((den = hc_readdir(host, dir, &statptr)) != NULL) {
-	/*
-	 * ignore . and ..
-	 */
-	if (strcmp(den->d_name, ".") != 0 && strcmp(den->d_name, "..") != 0) {
-	    if (UseCpFile && UseCpFile[0] == '/') {
-		if (CheckList(list, path, den->d_name) == 0)
-		    continue;
-	    }
-	    AddList(list, den->d_name, n, statptr);
+static void *
+PipeReader(void *arg)
+{
+    CopyPipe *cp = arg;
+    int64_t t;
+    char *data;
+    int size;
+    int n;
+
+    pthread_mutex_lock(&cp->lock);
+    for (;;) {
+	while (cp->stop == 0 && (cp->head - cp->tail == PIPE_SLOTS ||
+	       (cp->head != cp->tail && cp->inuse + cp->bufsize > PIPE_MEM))) {
+	    pthread_cond_wait(&cp->cond, &cp->lock);
 	}
+	if (cp->stop)
+	    break;
+	size = cp->bufsize;
+	pthread_mutex_unlock(&cp->lock);
+
+	if ((data = malloc(size)) == NULL)
+	    fatal("out of memory");
+	t = PipeTime();
+	n = hc_read(&SrcHost, cp->fd, data, size);
+	t = PipeTime() - t;
+
+	pthread_mutex_lock(&cp->lock);
+	if (n <= 0) {
+	    cp->error = (n < 0) ? (errno ? errno : EIO) : 0;
+	    free(data);
+	    break;
+	}
+	cp->ring[cp->head % PIPE_SLOTS].data = data;
+	cp->ring[cp->head % PIPE_SLOTS].size = size;
+	cp->ring[cp->head % PIPE_SLOTS].bytes = n;
+	++cp->head;
+	cp->inuse += size;
+	cp->rtime = t;
+	PipeAdapt(cp);
+	pthread_cond_broadcast(&cp->cond);
     }
-    hc_closedir(host, dir);
+    cp->done = 1;
+    pthread_cond_broadcast(&cp->cond);
+    pthread_mutex_unlock(&cp->lock);
+    return (NULL);
+}
+
+static int
+PipeCopy(int fd1, int fd2, off_t offset, const char **opp)
+{
+    CopyPipe *cp;
+    pthread_t thread;
+    int64_t t;
+    char *data;
+    int size;
+    int bytes;
+    int error = 0;
+
+    if ((cp = calloc(1, sizeof(*cp))) == NULL)
+	fatal("out of memory");
+    pthread_mutex_init(&cp->lock, NULL);
+    pthread_cond_init(&cp->cond, NULL);
+    cp->fd = fd1;
+    cp->bufsize = PIPE_MINBUF;
+    if ((errno = pthread_create(&thread, NULL, PipeReader, cp)) != 0)
+	fatal("cannot create copy thread: %s", strerror(errno));
+
+    *opp = "read";
+    pthread_mutex_lock(&cp->lock);
+    for (;;) {
+	while (cp->head == cp->tail && cp->done == 0)
+	    pthread_cond_wait(&cp->cond, &cp->lock);
+	if (cp->head == cp->tail) {
+	    error = cp->error;
+	    break;
+	}
+	data = cp->ring[cp->tail % PIPE_SLOTS].data;
+	size = cp->ring[cp->tail % PIPE_SLOTS].size;
+	bytes = cp->ring[cp->tail % PIPE_SLOTS].bytes;
+	pthread_mutex_unlock(&cp->lock);
+
+	t = PipeTime();
+	if (hc_pwrite(&DstHost, fd2, data, bytes, offset) != bytes) {
+	    error = errno ? errno : EIO;
+	    *opp = "write";
+	} else {
+	    if (offset >= 0)
+		offset += bytes;
+	    JournalProgress(bytes);
+	}
+	t = PipeTime() - t;
+	free(data);
 
+	pthread_mutex_lock(&cp->lock);
+	++cp->tail;
+	cp->inuse -= size;
+	cp->wtime = t;
+	if (error) {
+	    cp->stop = 1;
+	    pthread_cond_broadcast(&cp->cond);
+	    break;
+	}
+	pthread_cond_broadcast(&cp->cond);
+    }
+    pthread_mutex_unlock(&cp->lock);
+    pthread_join(thread, NULL);
+
+    /* buffers read after a failed write */
+    while (cp->tail != cp->head)
+	free(cp->ring[cp->tail++ % PIPE_SLOTS].data);
+    pthread_cond_destroy(&cp->cond);
+    pthread_mutex_destroy(&cp->lock);
+    free(cp);
+    if (error) {
+	errno = error;
+	return (-1);
+    }
     return (0);
 }
 
 /*
- * RemoveRecur()
+ * Parallel copy of large files (-p n).  The file is split into chunks
+ * which n lanes copy concurrently.  Each lane has its own connections to
+ * remote hosts, reads a chunk with hc_openrange() and writes it with
+ * hc_pwrite() at the same offset of the temporary file, which is
+ * extended to its final size first.  A chunk is complete only when all
+ * of its bytes were read and written, and the source must still have
+ * its size and mtime when all chunks are done.
  */
+typedef struct CopyLane {
+    struct HostConf src;
+    struct HostConf dst;
+    pthread_t	thread;
+    char	*buf;
+    struct ParCopy *pc;
+} CopyLane;
+
+typedef struct ParCopy {
+    pthread_mutex_t lock;
+    const char	*spath;
+    const char	*path;
+    off_t	size;
+    off_t	next;		/* first byte not handed out yet */
+    int		error;
+    const char	*op;
+} ParCopy;
+
+static CopyLane *Lanes;
+static int NumLanes;
 
-static void
-RemoveRecur(const char *dpath, dev_t devNo, struct stat *dstat)
-{
-    struct stat st;
+/*
+ * Set up the lanes on first use.  Returns their number, 0 if files are
+ * not to be copied in parallel.
+ */
+static int
+ParallelLanes(void)
+{
+    CopyLane *lane;
+    int i;
+
+    if (Lanes != NULL || ParallelOpt == 0)
+	return (NumLanes);
+    if ((Lanes = calloc(ParallelOpt, sizeof(*Lanes))) == NULL)
+	fatal("out of memory");
+    for (i = 0; i < ParallelOpt; ++i) {
+	lane = &Lanes[i];
+	lane->src.host = SrcHost.host;
+	lane->dst.host = DstHost.host;
+	if ((lane->src.host != NULL &&
+	     (hc_connect(&lane->src, ReadOnlyOpt) < 0 ||
+	      lane->src.version < HCPROTO_VERSION_RANGES)) ||
+	    (lane->dst.host != NULL &&
+	     (hc_connect(&lane->dst, 0) < 0 ||
+	      lane->dst.version < HCPROTO_VERSION_RANGES))) {
+	    if (QuietOpt == 0) {
+		fprintf(stderr, "WARNING: Unable to open connections for "
+			"parallel copies, copying files sequentially\n");
+	    }
+	    for (; i >= 0; --i) {
+		if (Lanes[i].src.version)
+		    hc_disconnect(&Lanes[i].src);
+		if (Lanes[i].dst.version)
+		    hc_disconnect(&Lanes[i].dst);
+		free(Lanes[i].buf);
+	    }
+	    ParallelOpt = 0;
+	    return (0);
+	}
+	if ((lane->buf = malloc(GETIOSIZE)) == NULL)
+	    fatal("out of memory");
+    }
+    NumLanes = ParallelOpt;
+    return (NumLanes);
+}
+
+static void *
+ParallelLane(void *arg)
+{
+    CopyLane *lane = arg;
+    ParCopy *pc = lane->pc;
+    const char *op = NULL;
+    off_t offset;
+    off_t length;
+    off_t done;
+    int fd1;
+    int fd2;
+    int n = 0;
+
+    if ((fd2 = hc_open(&lane->dst, pc->path, O_WRONLY, 0)) < 0)
+	op = "open";
+    while (op == NULL) {
+	pthread_mutex_lock(&pc->lock);
+	if (pc->error || pc->next >= pc->size) {
+	    pthread_mutex_unlock(&pc->lock);
+	    break;
+	}
+	offset = pc->next;
+	length = pc->size - offset;
+	if (length > PAR_CHUNK)
+	    length = PAR_CHUNK;
+	pc->next += length;
+	pthread_mutex_unlock(&pc->lock);
+
+	if ((fd1 = hc_openrange(&lane->src, pc->spath, offset, length)) < 0) {
+	    op = "read";
+	    break;
+	}
+	for (done = 0; done < length; done += n) {
+	    n = (length - done > GETIOSIZE) ? GETIOSIZE : length - done;
+	    if ((n = hc_read(&lane->src, fd1, lane->buf, n)) <= 0) {
+		if (n == 0)
+		    errno = EIO;	/* the file shrank */
+		op = "read";
+		break;
+	    }
+	    if (hc_pwrite(&lane->dst, fd2, lane->buf, n, offset + done) != n) {
+		op = "write";
+		break;
+	    }
+	}
+	hc_close(&lane->src, fd1);
+    }
+    if (op != NULL) {
+	pthread_mutex_lock(&pc->lock);
+	if (pc->error == 0) {
+	    pc->error = errno ? errno : EIO;
+	    pc->op = op;
+	}
+	pthread_mutex_unlock(&pc->lock);
+    }
+    if (fd2 >= 0)
+	hc_close(&lane->dst, fd2);
+    return (NULL);
+}
+
+/*
+ * Copy <spath> into the already created <path>, open as <fd2>.
+ *
+ * Returns 0 on success, else -1 with errno set and *opp naming the
+ * operation which failed.
+ */
+static int
+ParallelCopy(const char *spath, const char *path, int fd2,
+	     struct stat *stat1, const char **opp)
+{
+    ParCopy pc;
+    struct stat st;
+    int i;
+
+    memset(&pc, 0, sizeof(pc));
+    pthread_mutex_init(&pc.lock, NULL);
+    pc.spath = spath;
+    pc.path = path;
+    pc.size = stat1->st_size;
+
+    /* extend the file to its size up front */
+    if (hc_pwrite(&DstHost, fd2, "", 1, pc.size - 1) != 1) {
+	*opp = "write";
+	return (-1);
+    }
+    for (i = 0; i < NumLanes; ++i) {
+	Lanes[i].pc = &pc;
+	if ((errno = pthread_create(&Lanes[i].thread, NULL,
+				    ParallelLane, &Lanes[i])) != 0) {
+	    fatal("cannot create copy thread: %s", strerror(errno));
+	}
+    }
+    for (i = 0; i < NumLanes; ++i)
+	pthread_join(Lanes[i].thread, NULL);
+    pthread_mutex_destroy(&pc.lock);
+
+    if (pc.error == 0 &&
+	(hc_lstat(&SrcHost, spath, &st) < 0 ||
+	 st.st_size != stat1->st_size || mtimecmp(&st, stat1) != 0)) {
+	pc.error = EIO;
+	pc.op = "verify";
+    }
+    if (pc.error) {
+	*opp = pc.op;
+	errno = pc.error;
+	return (-1);
+    }
+    return (0);
+}
+
+/*
+ * Copy <length> bytes of <spath> from <offset> on to the same offset
+ * of the target file open as <fd2>, through <iobuf> of GETIOSIZE bytes.
+ *
+ * Returns 0 on success, else -1 with errno set and *opp naming the
+ * operation which failed.
+ */
+static int
+CopyRange(const char *spath, int fd2, off_t offset, off_t length,
+	  char *iobuf, const char **opp)
+{
+    off_t done;
+    int fd1;
+    int n;
+
+    *opp = "read";
+    if ((fd1 = hc_openrange(&SrcHost, spath, offset, length)) < 0)
+	return (-1);
+    for (done = 0; done < length; done += n) {
+	n = (length - done > GETIOSIZE) ? GETIOSIZE : length - done;
+	if ((n = hc_read(&SrcHost, fd1, iobuf, n)) <= 0) {
+	    if (n == 0)
+		errno = EIO;	/* the file shrank */
+	    break;
+	}
+	if (hc_pwrite(&DstHost, fd2, iobuf, n, offset + done) != n) {
+	    *opp = "write";
+	    n = -1;
+	    break;
+	}
+    }
+    hc_close(&SrcHost, fd1);
+    return (done < length ? -1 : 0);
+}
+
+/*
+ * Changed-block copies from the -H reference (-c).  A large file which
+ * cannot be linked to its counterpart in the reference starts out as a
+ * clone of that file, sharing its blocks where the target filesystem
+ * supports reflinks, and only the blocks whose digests differ from the
+ * source's are rewritten.  Each host digests its own file, only the
+ * digests and the changed blocks travel.
+ *
+ * Create the temporary file <path> from the reference of <dpath>.
+ * Returns 0 on success, else -1 and the file is copied as usual.
+ */
+static int
+CloneFrom(const char *dpath, const char *path, struct stat *stat1,
+	  struct stat *hstat, int habsent)
+{
+    struct stat sthl;
+    char *hpath;
+    int r = -1;
+
+    if (CloneOpt == 0 || NotForRealOpt || habsent ||
+	stat1->st_size < CLONE_MIN)
+	return(-1);
+    if ((SrcHost.host && SrcHost.version < HCPROTO_VERSION_CLONE) ||
+	(DstHost.host && DstHost.version < HCPROTO_VERSION_CLONE))
+	return(-1);
+    if (asprintf(&hpath, "%s%s", UseHLPath, dpath + DstBaseLen) < 0)
+	fatal("out of memory");
+    if (hstat != NULL && !S_ISLNK(hstat->st_mode))
+	sthl = *hstat;
+    else if (hc_stat(&DstHost, hpath, &sthl) < 0)
+	sthl.st_mode = 0;
+    if (S_ISREG(sthl.st_mode) && sthl.st_size > 0) {
+	r = hc_clone(&DstHost, hpath, path, stat1->st_size);
+	if (r < 0 && errno == EEXIST) {
+	    /* left over from an interrupted run */
+#ifdef _ST_FLAGS_PRESENT_
+	    hc_chflags(&DstHost, path, 0);
+#endif
+	    hc_remove(&DstHost, path);
+	    r = hc_clone(&DstHost, hpath, path, stat1->st_size);
+	}
+    }
+    free(hpath);
+    return(r);
+}
+
+/*
+ * Rewrite the blocks of the clone <path>, open as <fd2>, which differ
+ * from <spath>.  Runs of differing blocks are copied in one go, and
+ * *writtenp is set to the number of bytes written.
+ *
+ * Returns 0 on success, else -1 with errno set and *opp naming the
+ * operation which failed.
+ */
+static int
+ClonePatch(const char *spath, const char *path, int fd2,
+	   struct stat *stat1, const char **opp, off_t *writtenp)
+{
+    unsigned char *ssums;
+    unsigned char *dsums;
+    char *iobuf;
+    struct stat st;
+    off_t size = stat1->st_size;
+    off_t base;
+    off_t offset;
+    off_t length;
+    int error = 0;
+    int ns;
+    int nd = 0;
+    int i;
+    int j;
+
+#define CLONE_DIFFERS(k)	((k) >= nd || \
+	memcmp(ssums + (k) * HC_BLOCKSUMLEN, dsums + (k) * HC_BLOCKSUMLEN, \
+	       HC_BLOCKSUMLEN) != 0)
+
+    ssums = malloc(HC_MAXBLOCKSUMS * HC_BLOCKSUMLEN);
+    dsums = malloc(HC_MAXBLOCKSUMS * HC_BLOCKSUMLEN);
+    iobuf = malloc(GETIOSIZE);
+    if (ssums == NULL || dsums == NULL || iobuf == NULL)
+	fatal("out of memory");
+    *writtenp = 0;
+
+    for (base = 0; base < size && error == 0;
+	 base += (off_t)HC_MAXBLOCKSUMS * CLONE_BLOCK) {
+	*opp = "read";
+	if ((ns = hc_blockdigests(&SrcHost, spath, base, CLONE_BLOCK,
+				  HC_MAXBLOCKSUMS, ssums)) < 0 ||
+	    (nd = hc_blockdigests(&DstHost, path, base, CLONE_BLOCK,
+				  HC_MAXBLOCKSUMS, dsums)) < 0) {
+	    error = errno ? errno : EIO;
+	    break;
+	}
+	for (i = 0; i < ns && error == 0; i = j) {
+	    j = i + 1;
+	    if (!CLONE_DIFFERS(i))
+		continue;
+	    while (j < ns && CLONE_DIFFERS(j))
+		++j;
+	    offset = base + (off_t)i * CLONE_BLOCK;
+	    length = (off_t)(j - i) * CLONE_BLOCK;
+	    if (offset >= size)
+		break;
+	    if (length > size - offset)
+		length = size - offset;
+
+	    if (CopyRange(spath, fd2, offset, length, iobuf, opp) < 0) {
+		error = errno ? errno : EIO;
+		break;
+	    }
+	    *writtenp += length;
+	}
+    }
+#undef CLONE_DIFFERS
+    free(ssums);
+    free(dsums);
+    free(iobuf);
+
+    if (error == 0 &&
+	(hc_lstat(&SrcHost, spath, &st) < 0 ||
+	 st.st_size != size || mtimecmp(&st, stat1) != 0)) {
+	error = EIO;
+	*opp = "verify";
+    }
+    if (error) {
+	errno = error;
+	return (-1);
+    }
+    return (0);
+}
+
+/*
+ * Growth by appending (-a).  A file on the target which is shorter than
+ * its source and holds the same data as the start of the source only
+ * gets the rest of the source appended, in place.  The data is compared
+ * by digests of a window at either end of the target's length, or of
+ * all of it with -V, each host digesting its own file.
+ *
+ * Returns 0 if the first <length> bytes from <offset> on are the same.
+ */
+static int
+AppendMatch(const char *spath, const char *dpath, off_t offset,
+	    off_t length, unsigned char *ssums, unsigned char *dsums)
+{
+    int blksize;
+    int count;
+
+    while (length > 0) {
+	if (length >= CLONE_BLOCK) {
+	    blksize = CLONE_BLOCK;
+	    count = (length / CLONE_BLOCK > HC_MAXBLOCKSUMS) ?
+		    HC_MAXBLOCKSUMS : length / CLONE_BLOCK;
+	} else {
+	    blksize = length;
+	    count = 1;
+	}
+	if (hc_blockdigests(&SrcHost, spath, offset, blksize, count,
+			    ssums) != count ||
+	    hc_blockdigests(&DstHost, dpath, offset, blksize, count,
+			    dsums) != count ||
+	    memcmp(ssums, dsums, count * HC_BLOCKSUMLEN) != 0)
+	    return(-1);
+	offset += (off_t)count * blksize;
+	length -= (off_t)count * blksize;
+    }
+    return(0);
+}
+
+/*
+ * Returns 0 if the source <spath> only grew at the end since it was
+ * copied to <dpath>, which may then be appended to.
+ */
+static int
+AppendCheck(const char *spath, const char *dpath, struct stat *stat1,
+	    struct stat *st2, u_long st2_flags)
+{
+    unsigned char *ssums;
+    unsigned char *dsums;
+    off_t len = st2->st_size;
+    off_t win;
+    int r;
+
+    /*
+     * The file is written in place, so it must not be linked elsewhere
+     * or protected against writing.
+     */
+    if (AppendOpt == 0 || NotForRealOpt || !S_ISREG(st2->st_mode) ||
+	st2->st_nlink != 1 || (st2->st_mode & S_IWUSR) == 0 ||
+	len < APPEND_MIN || len >= stat1->st_size)
+	return(-1);
+#ifdef _ST_FLAGS_PRESENT_
+    if (st2_flags != 0)
+	return(-1);
+#else
+    (void)st2_flags;
+#endif
+
+    ssums = malloc(HC_MAXBLOCKSUMS * HC_BLOCKSUMLEN);
+    dsums = malloc(HC_MAXBLOCKSUMS * HC_BLOCKSUMLEN);
+    if (ssums == NULL || dsums == NULL)
+	fatal("out of memory");
+    win = (len > APPEND_WINDOW) ? APPEND_WINDOW : len;
+    if (ValidateOpt) {
+	r = AppendMatch(spath, dpath, 0, len, ssums, dsums);
+    } else {
+	r = AppendMatch(spath, dpath, 0, win, ssums, dsums);
+	if (r == 0 && len > win)
+	    r = AppendMatch(spath, dpath, len - win, win, ssums, dsums);
+    }
+    free(ssums);
+    free(dsums);
+    return(r);
+}
+
+/*
+ * Make target <n> the one DstHost and the other per-target globals
+ * refer to.  Each target walks the whole source, so the source counters
+ * are kept per target too, and the summary reports those of the first.
+ */
+static void
+FanSelect(int n)
+{
+    FanDest *fd = &FanDests[n];
+
+    CurFan->sourcebytes = CountSourceBytes;
+    CurFan->sourceitems = CountSourceItems;
+    CurFan = fd;
+    CountSourceBytes = fd->sourcebytes;
+    CountSourceItems = fd->sourceitems;
+    CurDst = &fd->host;
+    hltable = fd->hltable;
+    DstBaseLen = fd->baselen;
+    DstRootPrivs = fd->rootprivs;
+    GroupCount = fd->groupcount;
+    GroupList = fd->grouplist;
+}
+
+/*
+ * Let the thread of each other target which is not done yet take one
+ * turn, then continue.  Only the thread whose turn it is runs, so the
+ * threads need no locking among themselves.
+ */
+static void
+FanYield(void)
+{
+    int me = FanTurn;
+    int i;
+
+    if (FanCount <= 1)
+	return;
+    pthread_mutex_lock(&FanLock);
+    for (i = 1; i < FanCount; ++i) {
+	if (FanDests[(me + i) % FanCount].done == 0)
+	    break;
+    }
+    FanTurn = (me + i) % FanCount;
+    pthread_cond_broadcast(&FanCond);
+    while (FanTurn != me)
+	pthread_cond_wait(&FanCond, &FanLock);
+    pthread_mutex_unlock(&FanLock);
+    FanSelect(me);
+}
+
+static void *
+FanThread(void *arg)
+{
+    FanDest *fd = arg;
+    struct copy_info info;
+    int me = fd - FanDests;
+    int i;
+
+    pthread_mutex_lock(&FanLock);
+    while (FanTurn != me)
+	pthread_cond_wait(&FanCond, &FanLock);
+    pthread_mutex_unlock(&FanLock);
+    FanSelect(me);
+
+    memset(&info, 0, sizeof(info));
+    info.spath = FanSrc;
+    info.dpath = fd->path;
+    info.sdevNo = (dev_t)-1;
+    info.ddevNo = (dev_t)-1;
+    fd->result = DoCopy(&info, NULL, -1);
+    fd->result += hc_putfiles_flush(&DstHost, PutFileReport);
+
+    pthread_mutex_lock(&FanLock);
+    fd->done = 1;
+    for (i = 1; i < FanCount; ++i) {
+	if (FanDests[(me + i) % FanCount].done == 0)
+	    break;
+    }
+    FanTurn = (me + i) % FanCount;
+    pthread_cond_broadcast(&FanCond);
+    pthread_mutex_unlock(&FanLock);
+    return (NULL);
+}
+
+/*
+ * Copy <src> to all targets, each compared and cleaned up on its own.
+ */
+static int
+FanRun(char *src)
+{
+    int r = 0;
+    int i;
+
+    FanSrc = src;
+    FanTurn = 0;
+    for (i = 0; i < FanCount; ++i) {
+	if ((errno = pthread_create(&FanDests[i].thread, NULL,
+				    FanThread, &FanDests[i])) != 0)
+	    fatal("cannot create target thread: %s", strerror(errno));
+    }
+    for (i = 0; i < FanCount; ++i) {
+	pthread_join(FanDests[i].thread, NULL);
+	r += FanDests[i].result;
+    }
+    FanSelect(0);
+    return (r);
+}
+
+/*
+ * A copy of one source file to all targets which need it.  The target
+ * which asks first waits for one turn of the others, any of which get
+ * to the same file in that turn join the copy.  It then reads the source
+ * once and one writer thread per target takes the data from a ring of
+ * FAN_SLOTS buffers, so the slowest target sets the pace.
+ */
+typedef struct FanJob {
+    struct FanJob *next;
+    char	*path;		/* source */
+    off_t	size;
+    time_t	mtime;
+    int		count;		/* targets joined */
+    int		refs;		/* targets yet to take their result */
+    int		finished;
+    struct FanOut {
+	struct FanJob *job;
+	struct HostConf *host;
+	int	fd;
+	int	tail;		/* buffers written */
+	int	error;
+	const char *op;
+	pthread_t thread;
+    } out[FAN_MAX];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char	*ring[FAN_SLOTS];
+    int		bytes[FAN_SLOTS];
+    int		head;		/* buffers read */
+    int		done;		/* reader hit EOF or an error */
+} FanJob;
+
+static void *
+FanWriter(void *arg)
+{
+    struct FanOut *out = arg;
+    FanJob *job = out->job;
+    int slot;
+
+    pthread_mutex_lock(&job->lock);
+    for (;;) {
+	while (out->tail == job->head && job->done == 0)
+	    pthread_cond_wait(&job->cond, &job->lock);
+	if (out->tail == job->head)
+	    break;
+	slot = out->tail % FAN_SLOTS;
+	pthread_mutex_unlock(&job->lock);
+
+	/* a failed target keeps taking buffers so the others go on */
+	if (out->error == 0 &&
+	    hc_write(out->host, out->fd, job->ring[slot],
+		     job->bytes[slot]) != job->bytes[slot]) {
+	    out->error = errno ? errno : EIO;
+	    out->op = "write";
+	}
+
+	pthread_mutex_lock(&job->lock);
+	++out->tail;
+	pthread_cond_broadcast(&job->cond);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return (NULL);
+}
+
+static void
+FanTee(FanJob *job)
+{
+    int64_t bytes = 0;
+    int error = 0;
+    int fd1;
+    int slot;
+    int tail;
+    int i;
+    int n;
+
+    if ((fd1 = hc_open(&SrcHost, job->path, O_RDONLY, 0)) < 0) {
+	for (i = 0; i < job->count; ++i)
+	    job->out[i].error = errno ? errno : EIO;
+	return;
+    }
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, NULL);
+    for (i = 0; i < FAN_SLOTS; ++i) {
+	if ((job->ring[i] = malloc(FAN_BLOCK)) == NULL)
+	    fatal("out of memory");
+    }
+    for (i = 0; i < job->count; ++i) {
+	job->out[i].job = job;
+	if ((errno = pthread_create(&job->out[i].thread, NULL, FanWriter,
+				    &job->out[i])) != 0)
+	    fatal("cannot create copy thread: %s", strerror(errno));
+    }
+
+    pthread_mutex_lock(&job->lock);
+    for (;;) {
+	for (;;) {
+	    tail = job->head;
+	    for (i = 0; i < job->count; ++i) {
+		if (job->out[i].tail < tail)
+		    tail = job->out[i].tail;
+	    }
+	    if (job->head - tail < FAN_SLOTS)
+		break;
+	    pthread_cond_wait(&job->cond, &job->lock);
+	}
+	slot = job->head % FAN_SLOTS;
+	pthread_mutex_unlock(&job->lock);
+
+	n = hc_read(&SrcHost, fd1, job->ring[slot], FAN_BLOCK);
+
+	pthread_mutex_lock(&job->lock);
+	if (n <= 0) {
+	    error = (n < 0) ? (errno ? errno : EIO) : 0;
+	    break;
+	}
+	job->bytes[slot] = n;
+	++job->head;
+	bytes += n;
+	pthread_cond_broadcast(&job->cond);
+    }
+    job->done = 1;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+
+    for (i = 0; i < job->count; ++i) {
+	pthread_join(job->out[i].thread, NULL);
+	if (error && job->out[i].error == 0) {
+	    job->out[i].error = error;
+	    job->out[i].op = "read";
+	}
+    }
+    hc_close(&SrcHost, fd1);
+    CountSourceReadBytes += bytes;
+    for (i = 0; i < FAN_SLOTS; ++i)
+	free(job->ring[i]);
+    pthread_cond_destroy(&job->cond);
+    pthread_mutex_destroy(&job->lock);
+}
+
+/*
+ * Copy the source <spath> to <fd2> on the current target, together with
+ * the other targets which copy it too.
+ *
+ * Returns 0 on success, else -1 with errno set and *opp naming the
+ * operation which failed.
+ */
+static int
+FanCopy(const char *spath, struct stat *stat1, int fd2, const char **opp)
+{
+    FanJob **jobp;
+    FanJob *job;
+    int error;
+    int n;
+
+    for (job = FanJobs; job; job = job->next) {
+	if (strcmp(job->path, spath) == 0 && job->size == stat1->st_size &&
+	    job->mtime == stat1->st_mtime)
+	    break;
+    }
+    if (job == NULL) {
+	if ((job = calloc(1, sizeof(*job))) == NULL)
+	    fatal("out of memory");
+	job->path = strdup(spath);
+	job->size = stat1->st_size;
+	job->mtime = stat1->st_mtime;
+	job->next = FanJobs;
+	FanJobs = job;
+    }
+    n = job->count++;
+    ++job->refs;
+    job->out[n].host = &DstHost;
+    job->out[n].fd = fd2;
+    job->out[n].op = "read";
+
+    if (n == 0) {
+	FanYield();
+	for (jobp = &FanJobs; *jobp != job; jobp = &(*jobp)->next)
+	    ;
+	*jobp = job->next;
+	FanTee(job);
+	job->finished = 1;
+    } else {
+	while (job->finished == 0)
+	    FanYield();
+    }
+
+    error = job->out[n].error;
+    *opp = job->out[n].op;
+    if (--job->refs == 0) {
+	free(job->path);
+	free(job);
+    }
+    if (error) {
+	errno = error;
+	return (-1);
+    }
+    return (0);
+}
+
+/*
+ * Source directory listings shared by the targets.  The first target
+ * to list a directory records the entries ScanDir() adds, the others
+ * add the same entries from the record.  A record goes away when all
+ * targets used it, or when FAN_SCANS newer ones pushed it out.
+ */
+typedef struct FanScan {
+    struct FanScan *next;
+    char	*path;
+    int		refs;		/* targets yet to use it */
+    int		count;
+    int		max;
+    struct FanName {
+	char	*name;
+	struct stat st;
+	int	hasstat;
+    } *ents;
+} FanScan;
+
+static void
+FanScanFree(FanScan *fs)
+{
+    int i;
+
+    for (i = 0; i < fs->count; ++i)
+	free(fs->ents[i].name);
+    free(fs->ents);
+    free(fs->path);
+    free(fs);
+}
+
+/*
+ * Start recording the listing of <path>, or stop if <path> is NULL.
+ */
+static void
+FanRecord(const char *path)
+{
+    FanScan **fsp;
+    FanScan *fs;
+    int n;
+
+    FanRec = NULL;
+    if (path == NULL || FanCount <= 1)
+	return;
+    if ((fs = calloc(1, sizeof(*fs))) == NULL)
+	fatal("out of memory");
+    fs->path = strdup(path);
+    fs->refs = FanCount - 1;
+    fs->next = FanScans;
+    FanScans = fs;
+    FanRec = fs;
+
+    for (n = 0, fsp = &FanScans; *fsp; ++n) {
+	if (n < FAN_SCANS) {
+	    fsp = &(*fsp)->next;
+	} else {
+	    fs = *fsp;
+	    *fsp = fs->next;
+	    FanScanFree(fs);
+	}
+    }
+}
+
+static void
+FanNote(const char *name, struct stat *st)
+{
+    FanScan *fs = FanRec;
+    struct FanName *ent;
+
+    if (fs == NULL)
+	return;
+    if (fs->count == fs->max) {
+	fs->max = fs->max ? fs->max * 2 : 64;
+	fs->ents = realloc(fs->ents, fs->max * sizeof(*fs->ents));
+	if (fs->ents == NULL)
+	    fatal("out of memory");
+    }
+    ent = &fs->ents[fs->count++];
+    ent->name = strdup(name);
+    ent->hasstat = (st != NULL);
+    if (st)
+	ent->st = *st;
+}
+
+/*
+ * Add the recorded listing of <path> to <list>.  Returns 0, or -1 if
+ * there is no record of it.
+ */
+static int
+FanReplay(List *list, const char *path)
+{
+    FanScan **fsp;
+    FanScan *fs;
+    struct stat *st;
+    int i;
+
+    if (FanCount <= 1)
+	return (-1);
+    for (fsp = &FanScans; (fs = *fsp) != NULL; fsp = &fs->next) {
+	if (strcmp(fs->path, path) == 0)
+	    break;
+    }
+    if (fs == NULL)
+	return (-1);
+    for (i = 0; i < fs->count; ++i) {
+	st = NULL;
+	if (fs->ents[i].hasstat) {
+	    if ((st = malloc(sizeof(*st))) == NULL)
+		fatal("out of memory");
+	    *st = fs->ents[i].st;
+	}
+	ScanAdd(list, fs->ents[i].name, 0, st);
+    }
+    if (--fs->refs == 0) {
+	*fsp = fs->next;
+	FanScanFree(fs);
+    }
+    return (0);
+}
+
+/*
+ * Queue a small regular file for a batched create on the remote target
+ * (HC_PUTFILES).  <rpath> is where <path> is renamed to, or NULL.
+ *
+ * Returns -1 if the file has to be copied normally, otherwise the number
+ * of files which failed in a batch that had to be sent first.
+ */
+static int
+PutFile(struct stat *stat1, const char *spath, const char *path,
+	const char *rpath)
+{
+    char *buf;
+    int max;
+    int bytes;
+    int fd;
+    int n;
+
+    if ((max = hc_putfile_max(&DstHost)) == 0 || stat1->st_size > max)
+	return(-1);
+    if ((fd = hc_open(&SrcHost, spath, O_RDONLY, 0)) < 0)
+	return(-1);
+    buf = malloc(max + 1);
+    bytes = 0;
+    while ((n = hc_read(&SrcHost, fd, buf + bytes, max + 1 - bytes)) > 0) {
+	if ((bytes += n) > max)
+	    break;
+    }
+    hc_close(&SrcHost, fd);
+    if (n < 0 || bytes > max) {
+	/* let the normal copy report the error or handle the growth */
+	free(buf);
+	return(-1);
+    }
+    n = hc_putfile(&DstHost, path, rpath, stat1, DstRootPrivs,
+		   DstRootPrivs || ChgrpAllowed(stat1->st_gid),
+		   buf, bytes, PutFileReport);
+    free(buf);
+    return(n);
+}
+
+static void
+PutFileReport(const char *path, int bytes, int error)
+{
+    if (bytes < 0) {
+	/* a hardlink (-H) */
+	if (error) {
+	    logerr("%-32s hardlink failed: %s\n", path, strerror(error));
+	    return;
+	}
+	if (VerboseOpt)
+	    logstd("%-32s hardlinked(-H)\n", path);
+	++CountLinkedItems;
+	return;
+    }
+    if (error) {
+	logerr("%-32s copy failed: %s\n", path, strerror(error));
+	return;
+    }
+    if (VerboseOpt)
+	logstd("%-32s copy-ok\n", path);
+    CountSourceReadBytes += bytes;
+    CountWriteBytes += bytes;
+    CountSourceBytes += bytes;
+    CountSourceItems++;
+    CountCopiedItems++;
+}
+
+/*
+ * Tell the source host which files of the directory are going to be
+ * copied, in the order DoCopy() visits them, so it can read them ahead
+ * (-A).  Files which look the same on the target are left out unless
+ * they are compared or copied anyway.
+ */
+static void
+PrefetchList(List *list, List *dlist, const char *spath, const char *dpath)
+{
+    Node *node = NULL;
+    Node *dnode;
+    struct stat *st;
+    struct stat st2;
+    struct stat *dst;
+    char *npath;
+
+    hc_prefetch_begin(&SrcHost);
+    while ((node = IterateList(list, node, 0)) != NULL) {
+	if ((st = node->no_Stat) == NULL || !S_ISREG(st->st_mode))
+	    continue;
+	if (ForceOpt == 0 && ValidateOpt == 0 && dlist != NULL &&
+	    (dnode = MatchList(dlist, node->no_Name, 0)) != NULL) {
+	    if ((dst = dnode->no_Stat) == NULL) {
+		/* a local target is listed without stat info */
+		npath = mprintf("%s/%s", dpath, node->no_Name);
+		dst = (hc_lstat(&DstHost, npath, &st2) == 0 ? &st2 : NULL);
+		free(npath);
+	    }
+	    if (dst != NULL && dst->st_size == st->st_size &&
+		mtimecmp(st, dst) == 0)
+		continue;
+	}
+	npath = mprintf("%s/%s", spath, node->no_Name);
+	hc_prefetch(&SrcHost, npath, st->st_size);
+	free(npath);
+    }
+}
+
+/*
+ * Copy a directory whose source or target listing was too large to hold
+ * in memory (-B).  Both listings are read in name order, side by side,
+ * and each entry is copied, or removed from the target, as it comes.
+ */
+static int
+MergeDir(copy_info_t info, List *list, List *dlist, int depth)
+{
+    char *spath = info->spath;
+    char *dpath = info->dpath;
+    dev_t sdevNo = info->sdevNo;
+    dev_t ddevNo = info->ddevNo;
+    SortRun *srun;
+    SortRun *drun = NULL;
+    char *nspath;
+    char *ndpath;
+    int r = 0;
+    int c;
+
+    SortList(list, 0);
+    srun = SortNext(list);
+    if (dlist) {
+	SortList(dlist, 3);
+	drun = SortNext(dlist);
+    }
+    while (srun != NULL || drun != NULL) {
+	if (srun == NULL)
+	    c = 1;
+	else if (drun == NULL)
+	    c = -1;
+	else
+	    c = strcmp(srun->sr_Name, drun->sr_Name);
+
+	if (c > 0) {
+	    /*
+	     * If object does not exist in source or .cpignore
+	     * then recursively remove it.
+	     */
+	    if (MatchList(list, drun->sr_Name, 3) == NULL &&
+		(UseCpFile == NULL || UseCpFile[0] != '/' ||
+		 CheckList(list, dpath, drun->sr_Name) != 0)) {
+		ndpath = mprintf("%s/%s", dpath, drun->sr_Name);
+		RemoveRecur(ndpath, ddevNo, drun->sr_Stat);
+		free(ndpath);
+	    }
+	    drun = SortNext(dlist);
+	    continue;
+	}
+
+	nspath = mprintf("%s/%s", spath, srun->sr_Name);
+	ndpath = NULL;
+	if (dpath)
+	    ndpath = mprintf("%s/%s", dpath, srun->sr_Name);
+	info->spath = nspath;
+	info->dpath = ndpath;
+	info->sdevNo = sdevNo;
+	info->ddevNo = ddevNo;
+	info->dstat = NULL;
+	info->dabsent = 0;
+	info->hstat = NULL;
+	info->habsent = 0;
+	if (c == 0)
+	    info->dstat = drun->sr_Stat;
+	else if (dlist)
+	    info->dabsent = 1;
+	if (depth < 0)
+	    r += DoCopy(info, srun->sr_Stat, depth);
+	else
+	    r += DoCopy(info, srun->sr_Stat, depth + 1);
+	free(nspath);
+	if (ndpath)
+	    free(ndpath);
+	info->spath = NULL;
+	info->dpath = NULL;
+	info->dstat = NULL;
+	info->dabsent = 0;
+	info->hstat = NULL;
+	info->habsent = 0;
+
+	srun = SortNext(list);
+	if (c == 0)
+	    drun = SortNext(dlist);
+    }
+    return (r);
+}
+
+int
+ScanDir(List *list, struct HostConf *host, const char *path,
+	int64_t *CountReadBytes, int n)
+{
+    DIR *dir;
+    struct HostConf *cphost;
+    struct HCDirEntry *den;
+    struct stat *statptr;
+
+    if (n == 0) {
+	/*
+	 * scan .cpignore file for files/directories to ignore
+	 * (only in the source directory, i.e. if n == 0).
+	 */
+	if (UseCpFile) {
+	    int fd;
+	    int nread;
+	    int bufused;
+	    char *buf = malloc(GETBUFSIZE);
+	    char *nl, *next;
+	    char *fpath;
+
+	    if (UseCpFile[0] == '/') {
+		fpath = mprintf("%s", UseCpFile);
+		cphost = NULL;
+	    } else {
+		fpath = mprintf("%s/%s", path, UseCpFile);
+		AddList(list, strrchr(fpath, '/') + 1, 1, NULL);
+		cphost = host;
+	    }
+	    fd = hc_open(cphost, fpath, O_RDONLY, 0);
+	    if (fd >= 0) {
+		bufused = 0;
+		while ((nread = hc_read(cphost, fd, buf + bufused,
+			GETBUFSIZE - bufused - 1)) > 0) {
+		    *CountReadBytes += nread;
+		    bufused += nread;
+		    buf[bufused] = 0;
+		    for (next = buf; (nl = strchr(next, '\n')); next = nl+1) {
+			*nl = 0;
+			AddList(list, next, 1, NULL);
+		    }
+		    bufused = strlen(next);
+		    if (bufused)
+			memcpy(buf, next, bufused);
+		}
+		if (bufused) {
+		    /* last line has no trailing newline */
+		    buf[bufused] = 0;
+		    AddList(list, buf, 1, NULL);
+		}
+		hc_close(cphost, fd);
+	    }
+	    free(fpath);
+	    free(buf);
+	}
+
+	/*
+	 * Automatically exclude MD5CacheFile that we create on the
+	 * source from the copy to the destination.
+	 */
+	if (UseMD5Opt)
+	    AddList(list, MD5CacheFile, 1, NULL);
+    }
+
+    /*
+     * Another target may just have listed the same source directory.
+     */
+    if (n == 0 && host == &SrcHost && FanReplay(list, path) == 0)
+	return (0);
+    if ((dir = hc_opendir(host, path)) == NULL)
+	return (1);
+    if (n == 0 && host == &SrcHost)
+	FanRecord(path);
+    if (n == 0 && LayoutOpt && BigDirOpt == 0 && host->host == NULL) {
+	ScanLayout(list, host, dir, path);
+	hc_closedir(host, dir);
+	FanRecord(NULL);
+	return (0);
+    }
+    while ((den = hc_readdir(host, dir, &statptr)) != NULL) {
+	/*
+	 * ignore . and ..
+	 */
+	if (strcmp(den->d_name, ".") != 0 && strcmp(den->d_name, "..") != 0) {
+	    if (UseCpFile && UseCpFile[0] == '/') {
+		if (CheckList(list, path, den->d_name) == 0)
+		    continue;
+	    }
+	    ScanAdd(list, den->d_name, n, statptr);
+	}
+    }
+    hc_closedir(host, dir);
+    FanRecord(NULL);
+
+    return (0);
+}
+
+/*
+ * Physical layout order for a local source (-O).  The directory is read
+ * completely, its entries are lstat()ed in inode number order, and then
+ * added to the list so that DoCopy() visits the regular files in the
+ * order of their first data block on the disk, followed by everything
+ * else in inode order.  This keeps a disk with moving heads from seeking
+ * back and forth between inode tables and file data.
+ */
+typedef struct LayoutEnt {
+    char	*name;
+    ino_t	ino;
+    uint64_t	block;		/* first physical byte, UINT64_MAX unknown */
+    struct stat	*st;
+} LayoutEnt;
+
+static int
+LayoutInoCmp(const void *p1, const void *p2)
+{
+    const LayoutEnt *e1 = p1;
+    const LayoutEnt *e2 = p2;
+
+    if (e1->ino != e2->ino)
+	return (e1->ino < e2->ino ? -1 : 1);
+    return (0);
+}
+
+static int
+LayoutBlockCmp(const void *p1, const void *p2)
+{
+    const LayoutEnt *e1 = p1;
+    const LayoutEnt *e2 = p2;
+    int f1 = (e1->st != NULL && S_ISREG(e1->st->st_mode));
+    int f2 = (e2->st != NULL && S_ISREG(e2->st->st_mode));
+
+    if (f1 != f2)
+	return (f1 ? -1 : 1);
+    if (e1->block != e2->block)
+	return (e1->block < e2->block ? -1 : 1);
+    return (LayoutInoCmp(p1, p2));
+}
+
+/*
+ * Return the position of the first data block of a file on its device,
+ * where the system can tell.
+ */
+static uint64_t
+PhysicalBlock(const char *fpath)
+{
+#ifdef FS_IOC_FIEMAP
+    union {
+	struct fiemap fm;
+	char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } u;
+    int fd;
+
+    if ((fd = open(fpath, O_RDONLY)) >= 0) {
+	memset(&u, 0, sizeof(u));
+	u.fm.fm_length = FIEMAP_MAX_OFFSET;
+	u.fm.fm_extent_count = 1;
+	if (ioctl(fd, FS_IOC_FIEMAP, &u.fm) == 0 &&
+	    u.fm.fm_mapped_extents == 1) {
+	    close(fd);
+	    return (u.fm.fm_extents[0].fe_physical);
+	}
+	close(fd);
+    }
+#else
+    (void)fpath;
+#endif
+    return (UINT64_MAX);
+}
+
+static void
+ScanLayout(List *list, struct HostConf *host, DIR *dir, const char *path)
+{
+    LayoutEnt *ents = NULL;
+    struct HCDirEntry *den;
+    struct stat *statptr;
+    char *fpath;
+    int count = 0;
+    int i;
+
+    while ((den = hc_readdir(host, dir, &statptr)) != NULL) {
+	free(statptr);
+	if (strcmp(den->d_name, ".") == 0 || strcmp(den->d_name, "..") == 0)
+	    continue;
+	if (UseCpFile && UseCpFile[0] == '/') {
+	    if (CheckList(list, path, den->d_name) == 0)
+		continue;
+	}
+	if (MatchList(list, den->d_name, 0) != NULL)
+	    continue;		/* excluded */
+	if ((count & 255) == 0) {
+	    ents = realloc(ents, (count + 256) * sizeof(*ents));
+	    if (ents == NULL)
+		fatal("out of memory");
+	}
+	ents[count].name = strdup(den->d_name);
+	ents[count].ino = den->d_ino;
+	ents[count].block = UINT64_MAX;
+	ents[count].st = NULL;
+	++count;
+    }
+    if (count == 0)
+	return;
+
+    qsort(ents, count, sizeof(*ents), LayoutInoCmp);
+    for (i = 0; i < count; ++i) {
+	fpath = mprintf("%s/%s", path, ents[i].name);
+	if ((statptr = malloc(sizeof(*statptr))) == NULL)
+	    fatal("out of memory");
+	if (lstat(fpath, statptr) == 0) {
+	    ents[i].st = statptr;
+	    if (S_ISREG(statptr->st_mode))
+		ents[i].block = PhysicalBlock(fpath);
+	} else {
+	    free(statptr);
+	}
+	free(fpath);
+    }
+    qsort(ents, count, sizeof(*ents), LayoutBlockCmp);
+
+    /* AddList() prepends, IterateList() returns the last added first */
+    for (i = count - 1; i >= 0; --i) {
+	FanNote(ents[i].name, ents[i].st);
+	AddList(list, ents[i].name, 0, ents[i].st);
+	free(ents[i].name);
+    }
+    free(ents);
+}
+
+/*
+ * RemoveRecur()
+ */
+
+static void
+RemoveRecur(const char *dpath, dev_t devNo, struct stat *dstat)
+{
+    struct stat st;
+
+    if (JournalUsed(dpath))
+	return;		/* resumed and renamed */
+    if (dstat == NULL) {
+	if (hc_lstat(&DstHost, dpath, &st) == 0)
+	    dstat = &st;
+    }
+    if (dstat != NULL) {
+	if (devNo == (dev_t)-1)
+	    devNo = dstat->st_dev;
+	if (dstat->st_dev == devNo) {
+	    if (PlanFile != NULL && NoRemoveOpt == 0) {
+		/* the plan removes the whole subtree at once */
+		PlanAdd(PLAN_REMOVE, dpath, dstat, NULL);
+		if (VerboseOpt)
+		    logstd("%-32s remove-planned\n", dpath);
+		CountRemovedItems++;
+		return;
+	    }
+	    if (S_ISDIR(dstat->st_mode)) {
+		DIR *dir;
+		int n;
+
+		/*
+		 * Let a remote slave remove the whole subtree by itself
+		 * if no confirmation is needed.
+		 */
+		if (AskConfirmation == 0 && NoRemoveOpt == 0 &&
+		    NotForRealOpt == 0 && RenameFp == NULL &&
+		    (n = hc_rmtree(&DstHost, dpath, devNo, RemoveReport)) >= 0) {
+		    CountRemovedItems += n;
+		    return;
+		}
+
+		if ((dir = hc_opendir(&DstHost, dpath)) != NULL) {
+		    List *list = malloc(sizeof(List));
+		    Node *node = NULL;
+		    struct HCDirEntry *den;
+
+		    InitList(list);
+		    while ((den = hc_readdir(&DstHost, dir, &dstat)) != NULL) {
+			if (strcmp(den->d_name, ".") == 0)
+			    continue;
+			if (strcmp(den->d_name, "..") == 0)
+			    continue;
+			ScanAdd(list, den->d_name, 3, dstat);
+		    }
+		    hc_closedir(&DstHost, dir);
+		    if (list->li_NRuns) {
+			SortRun *run;
+
+			/* too large to hold in memory (-B) */
+			SortList(list, 3);
+			while ((run = SortNext(list)) != NULL) {
+			    char *ndpath;
+
+			    ndpath = mprintf("%s/%s", dpath, run->sr_Name);
+			    RemoveRecur(ndpath, devNo, run->sr_Stat);
+			    free(ndpath);
+			}
+		    }
+		    while ((node = IterateList(list, node, 3)) != NULL) {
+			char *ndpath;
+
+			ndpath = mprintf("%s/%s", dpath, node->no_Name);
+			RemoveRecur(ndpath, devNo, node->no_Stat);
+			free(ndpath);
+		    }
+		    ResetList(list);
+		    free(list);
+		}
+		if (AskConfirmation && NoRemoveOpt == 0) {
+		    if (YesNo(dpath)) {
+			if (xrmdir(&DstHost, dpath) < 0) {
+			    logerr("%-32s rmdir failed: %s\n",
+				dpath, strerror(errno)
+			    );
+			}
+			CountRemovedItems++;
+		    }
+		} else {
+		    if (NoRemoveOpt) {
+			if (VerboseOpt)
+			    logstd("%-32s not-removed\n", dpath);
+		    } else if (xrmdir(&DstHost, dpath) == 0) {
+			if (VerboseOpt)
+			    logstd("%-32s rmdir-ok\n", dpath);
+			CountRemovedItems++;
+		    } else {
+			logerr("%-32s rmdir failed: %s\n",
+			    dpath, strerror(errno)
+			);
+		    }
+		}
+	    } else if (RenameStash(dpath, dstat) == 0) {
+		if (AskConfirmation && NoRemoveOpt == 0) {
+		    if (YesNo(dpath)) {
+			if (xremove(&DstHost, dpath) < 0) {
+			    logerr("%-32s remove failed: %s\n",
+				dpath, strerror(errno)
+			    );
+			}
+			CountRemovedItems++;
+		    }
+		} else {
+		    if (NoRemoveOpt) {
+			if (VerboseOpt)
+			    logstd("%-32s not-removed\n", dpath);
+		    } else if (xremove(&DstHost, dpath) == 0) {
+			if (VerboseOpt)
+			    logstd("%-32s remove-ok\n", dpath);
+			CountRemovedItems++;
+		    } else {
+			logerr("%-32s remove failed: %s\n",
+			    dpath, strerror(errno)
+			);
+		    }
+		}
+	    }
+	}
+    }
+}
+
+/*
+ * Report an entry removed (or not) by hc_rmtree().
+ */
+static void
+RemoveReport(const char *dpath, mode_t mode, int error)
+{
+    const char *op = S_ISDIR(mode) ? "rmdir" : "remove";
+
+    if (error)
+	logerr("%-32s %s failed: %s\n", dpath, op, strerror(error));
+    else if (VerboseOpt)
+	logstd("%-32s %s-ok\n", dpath, op);
+}
+
+/*
+ * Write a change plan (-w).  DoCopy() runs as with -n and calls
+ * PlanAdd() wherever it would change the target.  Directories are
+ * created before their contents, and their attributes noted after them.
+ */
+static void
+PlanWrite(int op, const char *path, const char *link, mode_t mode,
+	  int64_t size)
+{
+    PlanRec rec;
+    size_t plen = strlen(path);
+    size_t llen = link ? strlen(link) : 0;
+
+    if (plen > UINT16_MAX || llen > UINT16_MAX)
+	fatal("%s: path too long for the plan", path);
+    memset(&rec, 0, sizeof(rec));
+    rec.pr_Size = size;
+    rec.pr_Mode = mode;
+    rec.pr_PathLen = plen;
+    rec.pr_LinkLen = llen;
+    rec.pr_Op = op;
+    if (fwrite(&rec, sizeof(rec), 1, PlanFile) != 1 ||
+	fwrite(path, 1, plen, PlanFile) != plen ||
+	(llen && fwrite(link, 1, llen, PlanFile) != llen)) {
+	fatal("write to the plan failed: %s", strerror(errno));
+    }
+}
+
+static void
+PlanCreate(const char *file, const char *src, const char *dst)
+{
+    if ((PlanFile = fopen(file, "w")) == NULL)
+	fatal("cannot create %s: %s", file, strerror(errno));
+    if (fwrite(PLAN_MAGIC, sizeof(PLAN_MAGIC) - 1, 1, PlanFile) != 1)
+	fatal("write to the plan failed: %s", strerror(errno));
+    PlanWrite(PLAN_ROOT, src, dst, 0, 0);
+}
+
+/*
+ * Note a change to <dpath>.  Paths are kept relative to the target,
+ * the source path is the same.
+ */
+static void
+PlanAdd(int op, const char *dpath, struct stat *st, const char *link)
+{
+    const char *rel = dpath + DstBaseLen;
+    const char *lrel = NULL;
+
+    if (PlanFile == NULL)
+	return;
+    if (*rel == '/')
+	++rel;
+    if (link && op == PLAN_HLINK) {
+	lrel = link;
+    } else if (link) {
+	lrel = link + DstBaseLen;
+	if (*lrel == '/')
+	    ++lrel;
+    }
+    PlanCount[op]++;
+    if (op == PLAN_COPY)
+	PlanBytes += st->st_size;
+    PlanWrite(op, rel, lrel, st->st_mode, (op == PLAN_COPY ? st->st_size : 0));
+}
+
+static void
+PlanClose(void)
+{
+    if (fclose(PlanFile) != 0)
+	fatal("write to the plan failed: %s", strerror(errno));
+    PlanFile = NULL;
+    if (QuietOpt == 0) {
+	logstd("plan: %lld mkdir, %lld copy (%lld bytes), %lld link, "
+	       "%lld other, %lld attr, %lld remove\n",
+	    (long long)PlanCount[PLAN_MKDIR],
+	    (long long)PlanCount[PLAN_COPY], (long long)PlanBytes,
+	    (long long)(PlanCount[PLAN_LINK] + PlanCount[PLAN_HLINK]),
+	    (long long)PlanCount[PLAN_OTHER],
+	    (long long)PlanCount[PLAN_ATTR],
+	    (long long)PlanCount[PLAN_REMOVE]);
+    }
+}
+
+/*
+ * Read the next record of a plan, with its paths in malloc()ed strings.
+ * Returns 0 at the end of the plan.
+ */
+static int
+PlanRead(FILE *fp, PlanRec *rec, char **pathp, char **linkp)
+{
+    char *path;
+    char *link;
+
+    if (fread(rec, sizeof(*rec), 1, fp) != 1)
+	return (0);
+    path = malloc(rec->pr_PathLen + 1);
+    link = malloc(rec->pr_LinkLen + 1);
+    if (path == NULL || link == NULL)
+	fatal("out of memory");
+    if (rec->pr_Op >= PLAN_NOPS ||
+	fread(path, 1, rec->pr_PathLen, fp) != rec->pr_PathLen ||
+	fread(link, 1, rec->pr_LinkLen, fp) != rec->pr_LinkLen) {
+	fatal("the plan is corrupt");
+    }
+    path[rec->pr_PathLen] = 0;
+    link[rec->pr_LinkLen] = 0;
+    *pathp = path;
+    *linkp = link;
+    return (1);
+}
+
+static FILE *
+PlanOpen(const char *file, char **srcp, char **dstp)
+{
+    char magic[sizeof(PLAN_MAGIC) - 1];
+    PlanRec rec;
+    FILE *fp;
+    char *src;
+    char *dst;
+
+    if ((fp = fopen(file, "r")) == NULL)
+	fatal("cannot open %s: %s", file, strerror(errno));
+    if (fread(magic, sizeof(magic), 1, fp) != 1 ||
+	memcmp(magic, PLAN_MAGIC, sizeof(magic)) != 0 ||
+	PlanRead(fp, &rec, &src, &dst) == 0 || rec.pr_Op != PLAN_ROOT) {
+	fatal("%s is not a cpdup plan", file);
+    }
+    if (srcp)
+	*srcp = src;
+    else
+	free(src);
+    if (dstp)
+	*dstp = dst;
+    else
+	free(dst);
+    return (fp);
+}
+
+static char *
+PlanPath(const char *root, const char *rel)
+{
+    if (*rel == 0)
+	return (mprintf("%s", root));
+    return (mprintf("%s/%s", root, rel));
+}
+
+static int
+PlanMkdir(const char *dpath, struct stat *st1)
+{
+    struct stat st2;
+
+    if (hc_lstat(&DstHost, dpath, &st2) == 0) {
+	if (S_ISDIR(st2.st_mode)) {
+	    /* keep it accessible until its own attributes are set */
+	    if ((st2.st_mode & 0700) != 0700)
+		hc_chmod(&DstHost, dpath, st2.st_mode | 0700);
+	    return (0);
+	}
+	xremove(&DstHost, dpath);
+    }
+    if (hc_mkdir(&DstHost, dpath, st1->st_mode | 0700) != 0) {
+	logerr("%s: mkdir failed: %s\n", dpath, strerror(errno));
+	return (1);
+    }
+    hc_chown(&DstHost, dpath, st1->st_uid, st1->st_gid);
+    if (VerboseOpt)
+	logstd("%-32s mkdir-ok\n", dpath);
+    CountCopiedItems++;
+    return (0);
+}
+
+static int
+PlanLink(const char *target, const char *dpath)
+{
+    struct stat st2;
+
+    if (hc_lstat(&DstHost, dpath, &st2) == 0)
+	xremove(&DstHost, dpath);
+    if (xlink(target, dpath, 0) < 0) {
+	logerr("%-32s hardlink: unable to link to %s: %s\n",
+	       dpath, target, strerror(errno));
+	return (1);
+    }
+    if (VerboseOpt)
+	logstd("%-32s hardlink: linked\n", dpath);
+    CountCopiedItems++;
+    return (0);
+}
+
+/*
+ * Directories get all their attributes, other entries only what DoCopy()
+ * sets on entries which are otherwise the same.
+ */
+static void
+PlanAttr(const char *dpath, struct stat *st1)
+{
+    struct timeval tv[2];
+
+    if (S_ISLNK(st1->st_mode)) {
+	hc_lchown(&DstHost, dpath, st1->st_uid, st1->st_gid);
+    } else if (S_ISDIR(st1->st_mode)) {
+	hc_chown(&DstHost, dpath, st1->st_uid, st1->st_gid);
+	hc_chmod(&DstHost, dpath, st1->st_mode);
+	memset(tv, 0, sizeof(tv));
+	tv[0].tv_sec = st1->st_mtime;
+	tv[1].tv_sec = st1->st_mtime;
+#if defined(st_mtime)
+	tv[0].tv_usec = st1->st_mtim.tv_nsec / 1000;
+	tv[1].tv_usec = st1->st_mtim.tv_nsec / 1000;
+#endif
+	hc_utimes(&DstHost, dpath, tv);
+    } else {
+	hc_chown(&DstHost, dpath, st1->st_uid, st1->st_gid);
+    }
+#ifdef _ST_FLAGS_PRESENT_
+    if (!S_ISLNK(st1->st_mode))
+	hc_chflags(&DstHost, dpath, st1->st_flags);
+#endif
+    if (VerboseOpt >= 2)
+	logstd("%-32s attr-ok\n", dpath);
+}
+
+/*
+ * Carry out a plan (-e).  Each change is made in the order of the plan,
+ * against the current state of the source: entries which are gone or
+ * changed their type since are skipped.  Files are copied by DoCopy(),
+ * which compares them with the target again as it would without a plan,
+ * copies large ones in parallel lanes (-p) and batches small ones
+ * for a remote target, so the batch is sent before anything which could
+ * depend on it.
+ */
+static int
+PlanRun(FILE *fp, const char *src, const char *dst)
+{
+    struct copy_info info;
+    struct stat st;
+    PlanRec rec;
+    char *rel;
+    char *link;
+    char *spath;
+    char *dpath;
+    char *lpath;
+    int r = 0;
+
+    while (PlanRead(fp, &rec, &rel, &link)) {
+	spath = PlanPath(src, rel);
+	dpath = PlanPath(dst, rel);
+	if (rec.pr_Op != PLAN_LINK && rec.pr_Op != PLAN_HLINK &&
+	    rec.pr_Op != PLAN_REMOVE &&
+	    (hc_lstat(&SrcHost, spath, &st) != 0 ||
+	     (st.st_mode & S_IFMT) != (rec.pr_Mode & S_IFMT))) {
+	    logerr("%-32s changed since it was planned, skipped\n", dpath);
+	    ++r;
+	    goto next;
+	}
+	switch (rec.pr_Op) {
+	case PLAN_MKDIR:
+	    r += PlanMkdir(dpath, &st);
+	    break;
+	case PLAN_COPY:
+	case PLAN_OTHER:
+	    memset(&info, 0, sizeof(info));
+	    info.spath = spath;
+	    info.dpath = dpath;
+	    info.sdevNo = (dev_t)-1;
+	    info.ddevNo = (dev_t)-1;
+	    r += DoCopy(&info, &st, -1);
+	    break;
+	case PLAN_LINK:
+	    r += hc_putfiles_flush(&DstHost, PutFileReport);
+	    lpath = PlanPath(dst, link);
+	    r += PlanLink(lpath, dpath);
+	    free(lpath);
+	    break;
+	case PLAN_HLINK:
+	    r += hc_putfiles_flush(&DstHost, PutFileReport);
+	    r += PlanLink(link, dpath);
+	    break;
+	case PLAN_ATTR:
+	    r += hc_putfiles_flush(&DstHost, PutFileReport);
+	    PlanAttr(dpath, &st);
+	    break;
+	case PLAN_REMOVE:
+	    RemoveRecur(dpath, (dev_t)-1, NULL);
+	    break;
+	}
+next:
+	free(spath);
+	free(dpath);
+	free(rel);
+	free(link);
+    }
+    fclose(fp);
+    return (r);
+}
+
+/*
+ * Checkpoint journal (-J).  Directories are noted once everything in
+ * them was copied, and large files while they are copied, with the
+ * number of bytes the target acknowledged every JOURNAL_STEP bytes.
+ * A run started with the journal of an interrupted run between the same
+ * source and target resumes it: it skips the directories noted, unless
+ * their source directory was modified since, and continues interrupted
+ * copies of files which did not change.  Nothing tells whether anything
+ * deeper in a skipped directory changed, so the journal is only good for
+ * the run it was written by and those resuming it, and is removed once
+ * a run gets through the whole tree, with or without errors.
+ */
+static JournalEnt **
+JournalLookup(const char *path)
+{
+    JournalEnt **jep;
+
+    jep = &JournalHash[shash(path)];
+    while (*jep != NULL && strcmp((*jep)->je_Path, path) != 0)
+	jep = &(*jep)->je_Next;
+    return (jep);
+}
+
+/*
+ * Apply a record to the table of what was done.
+ */
+static void
+JournalApply(JournalRec *rec, const char *path, const char *tmp)
+{
+    JournalEnt **jep = JournalLookup(path);
+    JournalEnt *je = *jep;
+
+    if (rec->jr_Type == JOURNAL_RUN)
+	return;
+    if (rec->jr_Type == JOURNAL_PROGRESS) {
+	if (je != NULL && je->je_Rec.jr_Type == JOURNAL_FILE)
+	    je->je_Rec.jr_Offset = rec->jr_Offset;
+	return;
+    }
+    if (je != NULL) {
+	*jep = je->je_Next;
+	free(je->je_Tmp);
+	free(je);
+    }
+    if (rec->jr_Type == JOURNAL_DONE)
+	return;
+    if ((je = malloc(sizeof(*je) + strlen(path) + 1)) == NULL)
+	fatal("out of memory");
+    je->je_Rec = *rec;
+    je->je_Tmp = tmp ? strdup(tmp) : NULL;
+    strcpy(je->je_Path, path);
+    je->je_Next = *jep;
+    *jep = je;
+}
+
+static void
+JournalWrite(int type, const char *path, struct stat *st, const char *tmp,
+	     off_t offset)
+{
+    JournalRec rec;
+    size_t plen = strlen(path);
+    size_t tlen = tmp ? strlen(tmp) : 0;
+
+    if (plen > UINT16_MAX || tlen > UINT16_MAX)
+	return;
+    memset(&rec, 0, sizeof(rec));
+    if (st != NULL) {
+	rec.jr_Size = st->st_size;
+	rec.jr_Mtime = st->st_mtime;
+#if defined(st_mtime)
+	rec.jr_Nsec = st->st_mtim.tv_nsec;
+#endif
+    }
+    rec.jr_Offset = offset;
+    rec.jr_PathLen = plen;
+    rec.jr_TmpLen = tlen;
+    rec.jr_Type = type;
+    if (fwrite(&rec, sizeof(rec), 1, JournalFp) != 1 ||
+	fwrite(path, 1, plen, JournalFp) != plen ||
+	(tlen && fwrite(tmp, 1, tlen, JournalFp) != tlen) ||
+	fflush(JournalFp) != 0) {
+	fatal("write to the journal failed: %s", strerror(errno));
+    }
+}
+
+/*
+ * Read what an earlier run did, and continue the journal.  A record cut
+ * short when that run was killed is dropped, and so is the whole journal
+ * if it was written by a run with another source or target.
+ */
+static void
+JournalOpen(const char *file, const char *src, const char *dst)
+{
+    JournalRec rec;
+    off_t good = 0;
+    char *srun;
+    char *drun;
+    char *path;
+    char *tmp;
+    int fd;
+
+    srun = mprintf("%s%s%s", SrcHost.host ? SrcHost.host : "",
+		   SrcHost.host ? ":" : "", src);
+    drun = mprintf("%s%s%s", DstHost.host ? DstHost.host : "",
+		   DstHost.host ? ":" : "", dst);
+
+    if ((fd = open(file, O_RDWR | O_CREAT, 0600)) < 0 ||
+	(JournalFp = fdopen(fd, "r+")) == NULL) {
+	fatal("cannot open %s: %s", file, strerror(errno));
+    }
+    while (fread(&rec, sizeof(rec), 1, JournalFp) == 1) {
+	path = malloc(rec.jr_PathLen + 1);
+	tmp = malloc(rec.jr_TmpLen + 1);
+	if (path == NULL || tmp == NULL)
+	    fatal("out of memory");
+	if (fread(path, 1, rec.jr_PathLen, JournalFp) != rec.jr_PathLen ||
+	    fread(tmp, 1, rec.jr_TmpLen, JournalFp) != rec.jr_TmpLen) {
+	    free(path);
+	    free(tmp);
+	    break;
+	}
+	path[rec.jr_PathLen] = 0;
+	tmp[rec.jr_TmpLen] = 0;
+	if (good == 0 && (rec.jr_Type != JOURNAL_RUN ||
+			  strcmp(path, srun) != 0 || strcmp(tmp, drun) != 0)) {
+	    if (VerboseOpt)
+		logstd("%s: journal of another run, starting over\n", file);
+	    free(path);
+	    free(tmp);
+	    break;
+	}
+	JournalApply(&rec, path, (rec.jr_TmpLen ? tmp : NULL));
+	free(path);
+	free(tmp);
+	good += sizeof(rec) + rec.jr_PathLen + rec.jr_TmpLen;
+    }
+    if (ftruncate(fd, good) < 0 || fseeko(JournalFp, good, SEEK_SET) < 0)
+	fatal("cannot update %s: %s", file, strerror(errno));
+    if (good == 0)
+	JournalWrite(JOURNAL_RUN, srun, NULL, drun, 0);
+    free(srun);
+    free(drun);
+}
+
+/*
+ * The run got through the whole tree, so the journal has served.
+ */
+static void
+JournalClose(const char *file)
+{
+    fclose(JournalFp);
+    JournalFp = NULL;
+    remove(file);
+}
+
+/*
+ * Returns 1 if <dpath> was completed by an earlier run.
+ */
+static int
+JournalDone(const char *dpath, struct stat *stat1)
+{
+    JournalEnt *je;
+
+    if (JournalFp == NULL || (je = *JournalLookup(dpath)) == NULL)
+	return (0);
+    return (je->je_Rec.jr_Type == JOURNAL_DIR &&
+	    je->je_Rec.jr_Mtime == stat1->st_mtime
+#if defined(st_mtime)
+	    && je->je_Rec.jr_Nsec == stat1->st_mtim.tv_nsec
+#endif
+	   );
+}
+
+static void
+JournalDir(const char *dpath, struct stat *stat1)
+{
+    if (JournalFp != NULL)
+	JournalWrite(JOURNAL_DIR, dpath, stat1, NULL, 0);
+}
+
+static int
+JournalUsable(struct stat *stat1)
+{
+    return (JournalFp != NULL && stat1->st_size >= JOURNAL_MIN &&
+	    SrcHost.version >= HCPROTO_VERSION_RANGES &&
+	    DstHost.version >= HCPROTO_VERSION_RANGES);
+}
+
+/*
+ * If an earlier run was interrupted while copying the unchanged source
+ * of <dpath>, replace *pathp with the file it was writing and return
+ * how far it got.  Returns 0 if the copy has to start over.
+ */
+static off_t
+JournalResume(const char *dpath, struct stat *stat1, char **pathp)
+{
+    JournalEnt *je;
+    JournalRec rec;
+    struct stat st;
+    off_t offset;
+
+    if (!JournalUsable(stat1) || (je = *JournalLookup(dpath)) == NULL ||
+	je->je_Rec.jr_Type != JOURNAL_FILE ||
+	je->je_Rec.jr_Size != stat1->st_size ||
+	je->je_Rec.jr_Mtime != stat1->st_mtime
+#if defined(st_mtime)
+	|| je->je_Rec.jr_Nsec != stat1->st_mtim.tv_nsec
+#endif
+       ) {
+	return (0);
+    }
+    if (hc_lstat(&DstHost, je->je_Tmp, &st) < 0 || !S_ISREG(st.st_mode))
+	return (0);
+    offset = je->je_Rec.jr_Offset;
+    if (offset > st.st_size)
+	offset = st.st_size;
+    if (offset <= 0 || offset >= stat1->st_size)
+	return (0);
+
+    if (strcmp(je->je_Tmp, dpath) != 0) {
+	/* keep the directory scan from removing it */
+	memset(&rec, 0, sizeof(rec));
+	rec.jr_Type = JOURNAL_USED;
+	JournalApply(&rec, je->je_Tmp, NULL);
+    }
+    free(*pathp);
+    *pathp = strdup(je->je_Tmp);
+    if (VerboseOpt)
+	logstd("%-32s resuming at %jd\n", dpath, (intmax_t)offset);
+    return (offset);
+}
+
+/*
+ * Note the copy of <dpath> into <path>, from <offset> on.
+ */
+static void
+JournalStart(const char *dpath, struct stat *stat1, const char *path,
+	     off_t offset)
+{
+    if (!JournalUsable(stat1))
+	return;
+    JournalWrite(JOURNAL_FILE, dpath, stat1, path, 0);
+    if (offset)
+	JournalWrite(JOURNAL_PROGRESS, dpath, NULL, NULL, offset);
+    JournalCur = strdup(dpath);
+    JournalCurOffset = offset;
+    JournalCurNoted = offset;
+}
+
+static void
+JournalProgress(int bytes)
+{
+    if (JournalCur == NULL)
+	return;
+    JournalCurOffset += bytes;
+    if (JournalCurOffset - JournalCurNoted >= JOURNAL_STEP) {
+	JournalWrite(JOURNAL_PROGRESS, JournalCur, NULL, NULL,
+		     JournalCurOffset);
+	JournalCurNoted = JournalCurOffset;
+    }
+}
+
+static void
+JournalEnd(void)
+{
+    if (JournalCur == NULL)
+	return;
+    JournalWrite(JOURNAL_DONE, JournalCur, NULL, NULL, 0);
+    free(JournalCur);
+    JournalCur = NULL;
+}
+
+static int
+JournalUsed(const char *dpath)
+{
+    JournalEnt *je;
+
+    return (JournalFp != NULL && (je = *JournalLookup(dpath)) != NULL &&
+	    je->je_Rec.jr_Type == JOURNAL_USED);
+}
+
+/*
+ * Rename detection (-r).  Every regular file on the target is noted in
+ * a new manifest with the device, inode, size and mtime of its source.
+ * A file which is new on the target but whose source is in the old
+ * manifest under another path, on the same device with the same size
+ * and mtime to the nanosecond, is moved or linked
+ * from there instead of being copied.  Files about to be removed which
+ * could still be claimed are moved aside first, and removed at the end
+ * if they were not.
+ */
+static RenameEnt **
+RenamePath(const char *rel)
+{
+    RenameEnt **rep;
+
+    rep = &RenamePHash[shash(rel)];
+    while (*rep != NULL && strcmp((*rep)->re_Path, rel) != 0)
+	rep = &(*rep)->re_PNext;
+    return (rep);
+}
+
+static void
+RenameOpen(const char *file, const char *src, const char *dst)
+{
+    RenameRec rec;
+    RenameEnt *re;
+    RenameEnt **rep;
+    FILE *fp;
+    int n;
+
+    if ((fp = fopen(file, "r")) != NULL) {
+	while (fread(&rec, sizeof(rec), 1, fp) == 1) {
+	    if ((re = malloc(sizeof(*re) + rec.rr_PathLen + 1)) == NULL)
+		fatal("out of memory");
+	    if (fread(re->re_Path, 1, rec.rr_PathLen, fp) != rec.rr_PathLen) {
+		free(re);
+		break;
+	    }
+	    re->re_Path[rec.rr_PathLen] = 0;
+	    re->re_Rec = rec;
+	    re->re_Stash = NULL;
+	    re->re_Moved = 0;
+	    rep = RenamePath(re->re_Path);
+	    if (*rep != NULL) {
+		free(re);	/* cannot happen */
+		continue;
+	    }
+	    re->re_PNext = NULL;
+	    *rep = re;
+	    n = rec.rr_Ino & HMASK;
+	    re->re_INext = RenameIHash[n];
+	    RenameIHash[n] = re;
+	}
+	fclose(fp);
+    } else if (errno != ENOENT) {
+	fatal("cannot open %s: %s", file, strerror(errno));
+    }
+    RenameNew = mprintf("%s.new", file);
+    if ((RenameFp = fopen(RenameNew, "w")) == NULL)
+	fatal("cannot create %s: %s", RenameNew, strerror(errno));
+    RenameSrc = src;
+    RenameDst = dst;
+    RenameDir = mprintf("%s/.cpdup.renamed.%d", dst, (int)getpid());
+}
+
+/*
+ * Remove what was moved aside but not claimed, and replace the manifest.
+ */
+static void
+RenameClose(const char *file)
+{
+    RenameEnt *re;
+    struct timeval tv[2];
+    struct stat st;
+    int i;
+
+    for (i = 0; i < HSIZE; ++i) {
+	for (re = RenamePHash[i]; re != NULL; re = re->re_PNext) {
+	    if (re->re_Stash == NULL)
+		continue;
+	    if (xremove(&DstHost, re->re_Stash) == 0) {
+		if (VerboseOpt)
+		    logstd("%-32s remove-ok\n", re->re_Path);
+		CountRemovedItems++;
+	    } else {
+		logerr("%-32s remove failed: %s\n",
+		    re->re_Stash, strerror(errno));
+	    }
+	}
+    }
+    if (RenameCount && xrmdir(&DstHost, RenameDir) == 0 &&
+	hc_lstat(&SrcHost, RenameSrc, &st) == 0 && S_ISDIR(st.st_mode)) {
+	/* put back the mtime of the target's root */
+	memset(tv, 0, sizeof(tv));
+	tv[0].tv_sec = st.st_mtime;
+	tv[1].tv_sec = st.st_mtime;
+#if defined(st_mtime)
+	tv[0].tv_usec = st.st_mtim.tv_nsec / 1000;
+	tv[1].tv_usec = st.st_mtim.tv_nsec / 1000;
+#endif
+	hc_utimes(&DstHost, RenameDst, tv);
+    }
+    if (fclose(RenameFp) != 0 || rename(RenameNew, file) != 0)
+	fatal("cannot write %s: %s", file, strerror(errno));
+    RenameFp = NULL;
+}
+
+static void
+RenameNote(const char *dpath, struct stat *stat1)
+{
+    RenameRec rec;
+    size_t plen = strlen(dpath + DstBaseLen);
+
+    if (RenameFp == NULL || plen > UINT16_MAX)
+	return;
+    memset(&rec, 0, sizeof(rec));
+    rec.rr_Ino = stat1->st_ino;
+    rec.rr_Dev = stat1->st_dev;
+    rec.rr_Size = stat1->st_size;
+    rec.rr_Mtime = stat1->st_mtime;
+#if defined(st_mtime)
+    rec.rr_Nsec = stat1->st_mtim.tv_nsec;
+#endif
+    rec.rr_PathLen = plen;
+    if (fwrite(&rec, sizeof(rec), 1, RenameFp) != 1 ||
+	fwrite(dpath + DstBaseLen, 1, plen, RenameFp) != plen) {
+	fatal("write to %s failed: %s", RenameNew, strerror(errno));
+    }
+}
+
+/*
+ * Look for the source of the new file <dpath> in the manifest, and if
+ * the target still has a copy under the old name (or moved aside), move
+ * it to <dpath> if its source is gone, else link it.  Returns 0 if
+ * <dpath> is in place, -1 if it has to be copied.
+ */
+static int
+RenameFind(const char *spath, const char *dpath, struct stat *stat1)
+{
+    const char *rel = dpath + DstBaseLen;
+    RenameEnt *re;
+    struct stat st;
+    char *opath;
+    char *path;
+    int moved;
+    int error;
+
+    if (RenameFp == NULL)
+	return (-1);
+    for (re = RenameIHash[stat1->st_ino & HMASK]; re; re = re->re_INext) {
+	if (re->re_Rec.rr_Ino == (int64_t)stat1->st_ino &&
+	    re->re_Rec.rr_Dev == (int64_t)stat1->st_dev &&
+	    re->re_Rec.rr_Size == stat1->st_size &&
+	    re->re_Rec.rr_Mtime == stat1->st_mtime &&
+#if defined(st_mtime)
+	    re->re_Rec.rr_Nsec == stat1->st_mtim.tv_nsec &&
+#endif
+	    strcmp(re->re_Path, rel) != 0) {
+	    break;
+	}
+    }
+    if (re == NULL)
+	return (-1);
+
+    if (re->re_Stash != NULL) {
+	path = strdup(re->re_Stash);
+	moved = 1;
+    } else {
+	opath = mprintf("%s%s", RenameSrc, re->re_Path);
+	moved = (hc_lstat(&SrcHost, opath, &st) < 0 ||
+		 st.st_ino != stat1->st_ino || st.st_dev != stat1->st_dev);
+	free(opath);
+	path = mprintf("%.*s%s", DstBaseLen, dpath, re->re_Path);
+    }
+    if (hc_lstat(&DstHost, path, &st) < 0 || !S_ISREG(st.st_mode) ||
+	st.st_size != stat1->st_size || mtimecmp(stat1, &st) != 0 ||
+	(ValidateOpt && validate_check(spath, path) != 0)) {
+	free(path);
+	return (-1);
+    }
+
+    /*
+     * Removing the old name needs confirmation unless -i0, so link
+     * to it and leave that to the directory scan.
+     */
+    if (moved && AskConfirmation == 0 && NoRemoveOpt == 0)
+	error = hc_rename(&DstHost, path, dpath);
+    else
+	error = hc_link(&DstHost, path, dpath);
+    if (error < 0) {
+	if (VerboseOpt >= 2) {
+	    logstd("%-32s cannot take over %s: %s\n", dpath, path,
+		   strerror(errno));
+	}
+	free(path);
+	return (-1);
+    }
+    if (!OwnerMatch(stat1, &st))
+	hc_chown(&DstHost, dpath, stat1->st_uid, stat1->st_gid);
+    if (stat1->st_mode != st.st_mode)
+	hc_chmod(&DstHost, dpath, stat1->st_mode);
+    if (VerboseOpt) {
+	logstd("%-32s %s from %s\n", dpath,
+	       (moved && AskConfirmation == 0 ? "renamed" : "linked"),
+	       re->re_Path);
+    }
+    if (re->re_Stash != NULL) {
+	free(re->re_Stash);
+	re->re_Stash = NULL;
+    }
+    if (moved && AskConfirmation == 0)
+	re->re_Moved = 1;
+    free(path);
+    CountSourceBytes += stat1->st_size;
+    CountSourceItems++;
+    return (0);
+}
+
+/*
+ * Move a file about to be removed aside if a new file could still claim
+ * it.  Returns 1 if it was moved, now or to a new name before.
+ */
+static int
+RenameStash(const char *dpath, struct stat *dstat)
+{
+    RenameEnt *re;
+    char *path;
+
+    if (RenameFp == NULL || !S_ISREG(dstat->st_mode) ||
+	AskConfirmation || NoRemoveOpt) {
+	return (0);
+    }
+    re = *RenamePath(dpath + DstBaseLen);
+    if (re != NULL && re->re_Moved)
+	return (1);
+    if (re == NULL || re->re_Rec.rr_Size != dstat->st_size ||
+	re->re_Rec.rr_Mtime != dstat->st_mtime) {
+	return (0);
+    }
+    if (RenameCount == 0 && hc_mkdir(&DstHost, RenameDir, 0700) < 0)
+	return (0);
+    path = mprintf("%s/%d", RenameDir, ++RenameCount);
+    if (hc_rename(&DstHost, dpath, path) < 0) {
+	free(path);
+	return (0);
+    }
+    if (VerboseOpt >= 2)
+	logstd("%-32s moved aside\n", dpath);
+    re->re_Stash = path;
+    return (1);
+}
+
+/*
+ * Store mode (-D).  The contents of regular files are kept once in the
+ * store, as objects named after their SHA-256 digest, and the target
+ * trees hardlink to them.  A file to be copied is linked to the object
+ * with its digest if that object has the same size, mtime, mode, owner
+ * and flags; otherwise it is copied and becomes the object.  Digests are
+ * computed on the source host and kept in an index per source, so files
+ * whose size, mtime and ctime did not change are not read again.  The
+ * ctime catches contents rewritten with the mtime set back.
+ */
+static StoreEnt **
+StoreLookup(int64_t ino, int64_t dev)
+{
+    StoreEnt **sep;
+
+    sep = &StoreHash[ino & HMASK];
+    while (*sep != NULL && ((*sep)->se_Rec.so_Ino != ino ||
+			    (*sep)->se_Rec.so_Dev != dev)) {
+	sep = &(*sep)->se_Next;
+    }
+    return (sep);
+}
+
+/*
+ * Returns 1 if the index record <rec> is for <st> as it is now.
+ */
+static int
+StoreCurrent(const StoreRec *rec, struct stat *st)
+{
+    return (rec->so_Size == st->st_size &&
+	    rec->so_Mtime == st->st_mtime &&
+	    rec->so_Ctime == st->st_ctime
+#if defined(st_mtime)
+	    && rec->so_MtimeNsec == st->st_mtim.tv_nsec
+	    && rec->so_CtimeNsec == st->st_ctim.tv_nsec
+#endif
+	   );
+}
+
+static void
+StoreOpen(const char *store, const char *host, const char *src)
+{
+    StoreRec rec;
+    StoreEnt *se;
+    StoreEnt **sep;
+    char *buf;
+    char *ptr;
+    int fd;
+    int n;
+
+    StoreDir = store;
+    ptr = mprintf("%s/objects", store);
+    if ((hc_mkdir(&DstHost, store, 0755) < 0 && errno != EEXIST) ||
+	(hc_mkdir(&DstHost, ptr, 0755) < 0 && errno != EEXIST)) {
+	fatal("cannot create %s: %s", ptr, strerror(errno));
+    }
+    free(ptr);
+
+    /*
+     * Source inodes only mean something on their host, so each source
+     * gets an index of its own.
+     */
+    StoreIndex = mprintf("%s/index.%s%s%s", store, (host ? host : ""),
+			 (host ? ":" : ""), src);
+    for (ptr = StoreIndex + strlen(store) + 1; *ptr; ++ptr) {
+	if (*ptr == '/')
+	    *ptr = '_';
+    }
+    if ((fd = hc_open(&DstHost, StoreIndex, O_RDONLY, 0)) < 0)
+	return;
+    buf = malloc(GETIOSIZE);
+    n = 0;
+    for (;;) {
+	int r = hc_read(&DstHost, fd, buf + n, GETIOSIZE - n);
+
+	if (r <= 0)
+	    break;
+	n += r;
+	for (ptr = buf; n >= (int)sizeof(rec); ptr += sizeof(rec)) {
+	    memcpy(&rec, ptr, sizeof(rec));
+	    n -= sizeof(rec);
+	    sep = StoreLookup(rec.so_Ino, rec.so_Dev);
+	    if (*sep != NULL)
+		continue;
+	    if ((se = malloc(sizeof(*se))) == NULL)
+		fatal("out of memory");
+	    se->se_Rec = rec;
+	    se->se_Next = NULL;
+	    *sep = se;
+	}
+	memmove(buf, ptr, n);
+    }
+    hc_close(&DstHost, fd);
+    free(buf);
+}
+
+static void
+StoreClose(void)
+{
+    StoreEnt *se;
+    char *path;
+    char *buf;
+    int fd;
+    int n;
+    int i;
+
+    if (!StoreDirty)
+	return;
+    path = mprintf("%s.tmp%d", StoreIndex, (int)getpid());
+    if ((fd = hc_open(&DstHost, path, O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0) {
+	logerr("%-32s create failed: %s\n", path, strerror(errno));
+	free(path);
+	return;
+    }
+    buf = malloc(GETIOSIZE);
+    n = 0;
+    for (i = 0; i < HSIZE; ++i) {
+	for (se = StoreHash[i]; se != NULL; se = se->se_Next) {
+	    if (n + (int)sizeof(se->se_Rec) > GETIOSIZE) {
+		if (hc_write(&DstHost, fd, buf, n) != n)
+		    goto failed;
+		n = 0;
+	    }
+	    memcpy(buf + n, &se->se_Rec, sizeof(se->se_Rec));
+	    n += sizeof(se->se_Rec);
+	}
+    }
+    if (n && hc_write(&DstHost, fd, buf, n) != n)
+	goto failed;
+    hc_close(&DstHost, fd);
+    fd = -1;
+    if (hc_rename(&DstHost, path, StoreIndex) == 0) {
+	free(buf);
+	free(path);
+	return;
+    }
+failed:
+    logerr("%-32s write failed: %s\n", StoreIndex, strerror(errno));
+    if (fd >= 0)
+	hc_close(&DstHost, fd);
+    hc_remove(&DstHost, path);
+    free(buf);
+    free(path);
+}
+
+static char *
+StoreObject(const char *digest)
+{
+    return (mprintf("%s/objects/%.2s/%s", StoreDir, digest, digest + 2));
+}
+
+/*
+ * Look up the digest of <spath> and link <dpath> to its object.
+ * Returns 0 if <dpath> is in place.  Otherwise <digest> is set if the
+ * copy should be added to the store, else cleared.
+ */
+static int
+StoreLink(const char *spath, const char *dpath, struct stat *stat1,
+	  int st2Valid, u_long st2_flags, char *digest)
+{
+    StoreEnt **sep;
+    StoreEnt *se;
+    struct stat st;
+    char *obj;
+    char *path;
+
+    digest[0] = 0;
+    if (StoreDir == NULL || stat1->st_size == 0)
+	return (-1);
+    sep = StoreLookup(stat1->st_ino, stat1->st_dev);
+    if ((se = *sep) != NULL && StoreCurrent(&se->se_Rec, stat1)) {
+	memcpy(digest, se->se_Rec.so_Digest, HC_DIGESTLEN);
+	digest[HC_DIGESTLEN] = 0;
+    } else {
+	if (hc_digest(&SrcHost, spath, digest) < 0) {
+	    logerr("%-32s digest failed: %s\n", spath, strerror(errno));
+	    digest[0] = 0;
+	    return (-1);
+	}
+	if (se == NULL) {
+	    if ((se = malloc(sizeof(*se))) == NULL)
+		fatal("out of memory");
+	    se->se_Next = NULL;
+	    *sep = se;
+	}
+	se->se_Rec.so_Ino = stat1->st_ino;
+	se->se_Rec.so_Dev = stat1->st_dev;
+	se->se_Rec.so_Size = stat1->st_size;
+	se->se_Rec.so_Mtime = stat1->st_mtime;
+	se->se_Rec.so_Ctime = stat1->st_ctime;
+#if defined(st_mtime)
+	se->se_Rec.so_MtimeNsec = stat1->st_mtim.tv_nsec;
+	se->se_Rec.so_CtimeNsec = stat1->st_ctim.tv_nsec;
+#endif
+	memcpy(se->se_Rec.so_Digest, digest, HC_DIGESTLEN);
+	StoreDirty = 1;
+    }
+
+    obj = StoreObject(digest);
+    if (hc_lstat(&DstHost, obj, &st) < 0) {
+	free(obj);
+	return (-1);
+    }
+    if (!S_ISREG(st.st_mode) || st.st_mode != stat1->st_mode ||
+	st.st_size != stat1->st_size || mtimecmp(stat1, &st) != 0 ||
+	!OwnerMatch(stat1, &st) || !FlagsMatch(stat1, &st)) {
+	/* a variant, copy it without storing it */
+	digest[0] = 0;
+	free(obj);
+	return (-1);
+    }
+    if (st2Valid) {
+	path = mprintf("%s.tmp%d", dpath, (int)getpid());
+	hc_remove(&DstHost, path);
+    } else {
+	path = mprintf("%s", dpath);
+    }
+    if (hc_link(&DstHost, obj, path) < 0 ||
+	(st2Valid && xrename(path, dpath, st2_flags) < 0)) {
+	/* e.g. too many links to the object */
+	if (VerboseOpt >= 2)
+	    logstd("%-32s cannot link %s: %s\n", dpath, obj, strerror(errno));
+	if (st2Valid)
+	    hc_remove(&DstHost, path);
+	digest[0] = 0;
+	free(path);
+	free(obj);
+	return (-1);
+    }
+    if (VerboseOpt)
+	logstd("%-32s hardlinked(-D)\n", dpath);
+    ++CountLinkedItems;
+    CountSourceBytes += stat1->st_size;
+    CountSourceItems++;
+    free(path);
+    free(obj);
+    return (0);
+}
+
+/*
+ * Make the new copy <dpath> the object for <digest>, unless the source
+ * changed while it was copied.
+ */
+static void
+StoreAdd(const char *spath, const char *dpath, struct stat *stat1,
+	 const char *digest)
+{
+    struct stat st;
+    char *obj;
+
+    if (StoreDir == NULL || digest[0] == 0)
+	return;
+    if (hc_lstat(&SrcHost, spath, &st) < 0 ||
+	st.st_size != stat1->st_size || mtimecmp(stat1, &st) != 0) {
+	return;
+    }
+    obj = StoreObject(digest);
+    if (hc_link(&DstHost, dpath, obj) < 0 && errno == ENOENT) {
+	char *dir = mprintf("%s/objects/%.2s", StoreDir, digest);
+
+	hc_mkdir(&DstHost, dir, 0755);
+	free(dir);
+	if (hc_link(&DstHost, dpath, obj) < 0 && VerboseOpt >= 2)
+	    logstd("%-32s cannot store: %s\n", dpath, strerror(errno));
+    }
+    free(obj);
+}
+
+/*
+ * Tree comparison (-t).  Instead of copying, the source and target trees
+ * are compared by subtree digests which each host computes on its own
+ * side (hc_treedigest()), descending only into directories whose digests
+ * differ.  The entries which differ are printed, nothing is changed.
+ */
+static int
+TreeNameCmp(const void *p1, const void *p2)
+{
+    return (strcmp(*(char * const *)p1, *(char * const *)p2));
+}
+
+/*
+ * The sorted names in directory <path>.  Returns their number.
+ */
+static int
+TreeNames(struct HostConf *host, const char *path, char ***namesp)
+{
+    struct HCDirEntry *den;
+    struct stat *statptr;
+    char **names = NULL;
+    DIR *dir;
+    int count = 0;
+    int max = 0;
+
+    if ((dir = hc_opendir(host, path)) != NULL) {
+	while ((den = hc_readdir(host, dir, &statptr)) != NULL) {
+	    if (statptr != NULL)
+		free(statptr);
+	    if (strcmp(den->d_name, ".") == 0 ||
+		strcmp(den->d_name, "..") == 0)
+		continue;
+	    if (count == max) {
+		max = max ? max * 2 : 64;
+		if ((names = realloc(names, max * sizeof(*names))) == NULL)
+		    fatal("out of memory");
+	    }
+	    names[count++] = mprintf("%s", den->d_name);
+	}
+	hc_closedir(host, dir);
+    }
+    if (count > 1)
+	qsort(names, count, sizeof(*names), TreeNameCmp);
+    *namesp = names;
+    return (count);
+}
 
-    if (dstat == NULL) {
-	if (hc_lstat(&DstHost, dpath, &st) == 0)
-	    dstat = &st;
+static void
+TreeReport(const char *dpath, const char *what)
+{
+    if (QuietOpt == 0)
+	logstd("%-32s %s\n", dpath, what);
+}
+
+/*
+ * Compare <spath> and <dpath>, whose digests differ or, if <failed>,
+ * could not be computed on one side.  Returns the number of differences
+ * found.  A directory whose own type, mode or owner differ is reported,
+ * and so is one in which no entry is found to differ.
+ */
+static int
+TreeDiff(const char *spath, const char *dpath, int failed)
+{
+    char (*sdigests)[HC_DIGESTLEN + 1];
+    char (*ddigests)[HC_DIGESTLEN + 1];
+    struct stat st1;
+    struct stat st2;
+    char **snames;
+    char **dnames;
+    const char **spaths;
+    const char **dpaths;
+    int ns;
+    int nd;
+    int i;
+    int j;
+    int k;
+    int bad;
+    int n = 0;
+    int r = 0;
+
+    /*
+     * Only directories on the filesystems of the roots are descended
+     * into, a difference anywhere else is the entry's own.
+     */
+    if (hc_lstat(&SrcHost, spath, &st1) < 0 ||
+	hc_lstat(&DstHost, dpath, &st2) < 0 ||
+	!S_ISDIR(st1.st_mode) || !S_ISDIR(st2.st_mode) ||
+	st1.st_dev != TreeSrcDev || st2.st_dev != TreeDstDev) {
+	TreeReport(dpath, (failed ? "cannot be digested" : "differs"));
+	return (1);
+    }
+    if (st1.st_mode != st2.st_mode ||
+	((TreeFlags & TREE_OWNER) &&
+	 (st1.st_uid != st2.st_uid || st1.st_gid != st2.st_gid))) {
+	TreeReport(dpath, "differs");
+	++r;
     }
-    if (dstat != NULL) {
-	if (devNo == (dev_t)-1)
-	    devNo = dstat->st_dev;
-	if (dstat->st_dev == devNo) {
-	    if (S_ISDIR(dstat->st_mode)) {
-		DIR *dir;
 
-		if ((dir = hc_opendir(&DstHost, dpath)) != NULL) {
-		    List *list = malloc(sizeof(List));
-		    Node *node = NULL;
-		    struct HCDirEntry *den;
+    ns = TreeNames(&SrcHost, spath, &snames);
+    nd = TreeNames(&DstHost, dpath, &dnames);
+    k = (ns < nd) ? nd : ns;
+    spaths = malloc((k + 1) * sizeof(*spaths));
+    dpaths = malloc((k + 1) * sizeof(*dpaths));
+    if (spaths == NULL || dpaths == NULL)
+	fatal("out of memory");
+    for (i = j = 0; i < ns || j < nd; ) {
+	k = (i == ns) ? 1 : (j == nd) ? -1 : strcmp(snames[i], dnames[j]);
+	if (k < 0) {
+	    char *path = mprintf("%s/%s", dpath, snames[i++]);
 
-		    InitList(list);
-		    while ((den = hc_readdir(&DstHost, dir, &dstat)) != NULL) {
-			if (strcmp(den->d_name, ".") == 0)
-			    continue;
-			if (strcmp(den->d_name, "..") == 0)
-			    continue;
-			AddList(list, den->d_name, 3, dstat);
-		    }
-		    hc_closedir(&DstHost, dir);
-		    while ((node = IterateList(list, node, 3)) != NULL) {
-			char *ndpath;
+	    TreeReport(path, "missing");
+	    free(path);
+	    ++r;
+	} else if (k > 0) {
+	    char *path = mprintf("%s/%s", dpath, dnames[j++]);
 
-			ndpath = mprintf("%s/%s", dpath, node->no_Name);
-			RemoveRecur(ndpath, devNo, node->no_Stat);
-			free(ndpath);
-		    }
-		    ResetList(list);
-		    free(list);
-		}
-		if (AskConfirmation && NoRemoveOpt == 0) {
-		    if (YesNo(dpath)) {
-			if (xrmdir(&DstHost, dpath) < 0) {
-			    logerr("%-32s rmdir failed: %s\n",
-				dpath, strerror(errno)
-			    );
-			}
-			CountRemovedItems++;
-		    }
-		} else {
-		    if (NoRemoveOpt) {
-			if (VerboseOpt)
-			    logstd("%-32s not-removed\n", dpath);
-		    } else if (xrmdir(&DstHost, dpath) == 0) {
-			if (VerboseOpt)
-			    logstd("%-32s rmdir-ok\n", dpath);
-			CountRemovedItems++;
-		    } else {
-			logerr("%-32s rmdir failed: %s\n",
-			    dpath, strerror(errno)
-			);
-		    }
-		}
-	    } else {
-		if (AskConfirmation && NoRemoveOpt == 0) {
-		    if (YesNo(dpath)) {
-			if (xremove(&DstHost, dpath) < 0) {
-			    logerr("%-32s remove failed: %s\n",
-				dpath, strerror(errno)
-			    );
-			}
-			CountRemovedItems++;
-		    }
-		} else {
-		    if (NoRemoveOpt) {
-			if (VerboseOpt)
-			    logstd("%-32s not-removed\n", dpath);
-		    } else if (xremove(&DstHost, dpath) == 0) {
-			if (VerboseOpt)
-			    logstd("%-32s remove-ok\n", dpath);
-			CountRemovedItems++;
-		    } else {
-			logerr("%-32s remove failed: %s\n",
-			    dpath, strerror(errno)
-			);
-		    }
-		}
-	    }
+	    TreeReport(path, "extra");
+	    free(path);
+	    ++r;
+	} else {
+	    spaths[n] = mprintf("%s/%s", spath, snames[i++]);
+	    dpaths[n] = mprintf("%s/%s", dpath, dnames[j++]);
+	    ++n;
 	}
     }
+
+    sdigests = malloc((n + 1) * sizeof(*sdigests));
+    ddigests = malloc((n + 1) * sizeof(*ddigests));
+    if (sdigests == NULL || ddigests == NULL)
+	fatal("out of memory");
+    if (hc_treedigest(&SrcHost, TreeSrc, spaths, n,
+		      TreeFlags, sdigests) < 0 ||
+	hc_treedigest(&DstHost, TreeDst, dpaths, n,
+		      TreeFlags, ddigests) < 0) {
+	logerr("%-32s tree digests failed: %s\n", dpath, strerror(errno));
+	++r;
+	n = 0;
+    }
+    for (k = 0; k < n; ++k) {
+	bad = (strcmp(sdigests[k], TREE_ERROR) == 0 ||
+	       strcmp(ddigests[k], TREE_ERROR) == 0);
+	if (bad || strcmp(sdigests[k], ddigests[k]) != 0)
+	    r += TreeDiff(spaths[k], dpaths[k], bad);
+    }
+    if (r == 0) {
+	TreeReport(dpath, (failed ? "cannot be digested" : "differs"));
+	r = 1;
+    }
+
+    for (k = 0; k < n; ++k) {
+	free((void *)(uintptr_t)spaths[k]);
+	free((void *)(uintptr_t)dpaths[k]);
+    }
+    for (i = 0; i < ns; ++i)
+	free(snames[i]);
+    for (j = 0; j < nd; ++j)
+	free(dnames[j]);
+    free(spaths);
+    free(dpaths);
+    free(snames);
+    free(dnames);
+    free(sdigests);
+    free(ddigests);
+    return (r);
+}
+
+/*
+ * Compare the trees <src> and <dst>.  Returns the number of differences
+ * found.
+ */
+static int
+TreeCompare(const char *src, const char *dst)
+{
+    char sdigest[1][HC_DIGESTLEN + 1];
+    char ddigest[1][HC_DIGESTLEN + 1];
+    struct stat st;
+    int failed;
+
+    TreeSrc = src;
+    TreeDst = dst;
+    TreeFlags = (DstRootPrivs ? TREE_OWNER : 0) |
+		(ValidateOpt ? TREE_CONTENTS : 0) |
+		(ValidateOpt > 1 ? TREE_NOMTIME : 0);
+    if (hc_lstat(&SrcHost, src, &st) < 0) {
+	logerr("%-32s stat failed: %s\n", src, strerror(errno));
+	return (1);
+    }
+    TreeSrcDev = st.st_dev;
+    if (hc_lstat(&DstHost, dst, &st) < 0) {
+	TreeReport(dst, "missing");
+	return (1);
+    }
+    TreeDstDev = st.st_dev;
+
+    if (hc_treedigest(&SrcHost, src, &src, 1, TreeFlags, sdigest) < 0 ||
+	hc_treedigest(&DstHost, dst, &dst, 1, TreeFlags, ddigest) < 0)
+	fatal("cannot compute tree digests: %s", strerror(errno));
+    failed = (strcmp(sdigest[0], TREE_ERROR) == 0 ||
+	      strcmp(ddigest[0], TREE_ERROR) == 0);
+    if (!failed && strcmp(sdigest[0], ddigest[0]) == 0)
+	return (0);
+    return (TreeDiff(src, dst, failed));
 }
 
 static void
@@ -1584,6 +5017,11 @@ ResetList(List *list)
 	    free(node->no_Stat);
 	free(node);
     }
+    while (list->li_NRuns > 0) {
+	fclose(list->li_Runs[--list->li_NRuns]->sr_File);
+	free(list->li_Runs[list->li_NRuns]);
+    }
+    free(list->li_Runs);
     InitList(list);
 }
 
@@ -1605,6 +5043,37 @@ AddList(List *list, const char *name, int n, struct stat *st)
     Node *node;
     int hv;
 
+    if ((node = MatchList(list, name, n)) != NULL)
+	return(node->no_Value);
+
+    hv = shash(name);
+    node = malloc(sizeof(Node) + strlen(name) + 1);
+    if (node == NULL)
+	fatal("out of memory");
+
+    node->no_Next = list->li_Node.no_Next;
+    list->li_Node.no_Next = node;
+
+    node->no_HNext = list->li_Hash[hv];
+    list->li_Hash[hv] = node;
+
+    strcpy(node->no_Name, name);
+    node->no_Value = n;
+    node->no_Stat = st;
+
+    return(n);
+}
+
+/*
+ * Find the node a name added with value n would collide with, either
+ * an exact match or (unless n is 1) a wildcard from the .cpignore file.
+ */
+static Node *
+MatchList(List *list, const char *name, int n)
+{
+    Node *node;
+    int hv;
+
     /*
      * Scan against wildcards.  Only a node value of 1 can be a wildcard
      * ( usually scanned from .cpignore )
@@ -1614,35 +5083,20 @@ AddList(List *list, const char *name, int n, struct stat *st)
 	    (n != 1 && node->no_Value == 1 &&
 	    fnmatch(node->no_Name, name, 0) == 0)
 	) {
-	    return(node->no_Value);
+	    return(node);
 	}
     }
 
     /*
      * Look for exact match
      */
-
     hv = shash(name);
     for (node = list->li_Hash[hv]; node; node = node->no_HNext) {
 	if (strcmp(name, node->no_Name) == 0) {
-	    return(node->no_Value);
+	    return(node);
 	}
     }
-    node = malloc(sizeof(Node) + strlen(name) + 1);
-    if (node == NULL)
-	fatal("out of memory");
-
-    node->no_Next = list->li_Node.no_Next;
-    list->li_Node.no_Next = node;
-
-    node->no_HNext = list->li_Hash[hv];
-    list->li_Hash[hv] = node;
-
-    strcpy(node->no_Name, name);
-    node->no_Value = n;
-    node->no_Stat = st;
-
-    return(n);
+    return(NULL);
 }
 
 /*
@@ -1690,6 +5144,254 @@ CheckList(List *list, const char *path, const char *name)
     return 1;
 }
 
+/*
+ * Sorted runs (-B).  A directory with more than BigDirOpt entries is not
+ * held in memory: whenever that many entries were scanned, they are
+ * sorted by name and written to a temporary file.  SortList() then
+ * merges the runs, and SortNext() returns the entries in name order, so
+ * MergeDir() can join the source and the target listings.
+ */
+static void
+ScanAdd(List *list, const char *name, int n, struct stat *st)
+{
+    FanNote(name, st);
+    if (AddList(list, name, n, st) != n) {
+	free(st);		/* excluded */
+	return;
+    }
+    if (BigDirOpt && ++list->li_Count >= BigDirOpt)
+	SpillList(list, n);
+}
+
+static FILE *
+SortTemp(void)
+{
+    const char *dir;
+    char *path;
+    FILE *fp;
+    int fd;
+
+    if ((dir = getenv("TMPDIR")) == NULL || *dir == '\0')
+	dir = "/tmp";
+    path = mprintf("%s/cpdup.XXXXXX", dir);
+    if ((fd = mkstemp(path)) < 0 || (fp = fdopen(fd, "w+")) == NULL)
+	fatal("cannot create temporary file in %s: %s", dir, strerror(errno));
+    unlink(path);
+    free(path);
+    return (fp);
+}
+
+static void
+SortWrite(FILE *fp, const char *name, struct stat *st)
+{
+    uint16_t len = strlen(name);
+    uint8_t valid = (st != NULL);
+
+    if (fwrite(&len, sizeof(len), 1, fp) != 1 ||
+	fwrite(&valid, sizeof(valid), 1, fp) != 1 ||
+	fwrite(name, len, 1, fp) != 1 ||
+	(st != NULL && fwrite(st, sizeof(*st), 1, fp) != 1)) {
+	fatal("write to temporary file failed: %s", strerror(errno));
+    }
+}
+
+/*
+ * Read the next entry of a run.  Returns 0 at the end of the run.
+ */
+static int
+SortRead(SortRun *run)
+{
+    uint16_t len;
+    uint8_t valid;
+
+    if (fread(&len, sizeof(len), 1, run->sr_File) != 1)
+	return (0);
+    if (len >= sizeof(run->sr_Name) ||
+	fread(&valid, sizeof(valid), 1, run->sr_File) != 1 ||
+	fread(run->sr_Name, len, 1, run->sr_File) != 1 ||
+	(valid && fread(&run->sr_StatBuf, sizeof(run->sr_StatBuf), 1,
+			run->sr_File) != 1)) {
+	fatal("read from temporary file failed");
+    }
+    run->sr_Name[len] = 0;
+    run->sr_Stat = valid ? &run->sr_StatBuf : NULL;
+    return (1);
+}
+
+static int
+SortNodeCmp(const void *p1, const void *p2)
+{
+    const Node *n1 = *(Node * const *)p1;
+    const Node *n2 = *(Node * const *)p2;
+
+    return (strcmp(n1->no_Name, n2->no_Name));
+}
+
+/*
+ * Restore the heap order of runs[] below i.
+ */
+static void
+SortSift(SortRun **runs, int count, int i)
+{
+    SortRun *tmp;
+    int j;
+
+    while ((j = 2 * i + 1) < count) {
+	if (j + 1 < count &&
+	    strcmp(runs[j + 1]->sr_Name, runs[j]->sr_Name) < 0)
+	    ++j;
+	if (strcmp(runs[i]->sr_Name, runs[j]->sr_Name) <= 0)
+	    break;
+	tmp = runs[i];
+	runs[i] = runs[j];
+	runs[j] = tmp;
+	i = j;
+    }
+}
+
+/*
+ * Position the runs at their first entries and make them a heap.
+ * Empty runs are dropped.  Returns the new count.
+ */
+static int
+SortStart(SortRun **runs, int count)
+{
+    int i;
+
+    for (i = 0; i < count; ) {
+	rewind(runs[i]->sr_File);
+	if (SortRead(runs[i])) {
+	    ++i;
+	} else {
+	    fclose(runs[i]->sr_File);
+	    free(runs[i]);
+	    runs[i] = runs[--count];
+	}
+    }
+    for (i = count / 2 - 1; i >= 0; --i)
+	SortSift(runs, count, i);
+    return (count);
+}
+
+/*
+ * Advance the smallest run of a heap.  Returns the new count.
+ */
+static int
+SortAdvance(SortRun **runs, int count)
+{
+    if (SortRead(runs[0]) == 0) {
+	fclose(runs[0]->sr_File);
+	free(runs[0]);
+	runs[0] = runs[--count];
+    }
+    SortSift(runs, count, 0);
+    return (count);
+}
+
+static SortRun *
+SortAddRun(List *list, FILE *fp)
+{
+    SortRun *run;
+
+    if ((list->li_NRuns & 15) == 0) {
+	list->li_Runs = realloc(list->li_Runs,
+				(list->li_NRuns + 16) * sizeof(SortRun *));
+	if (list->li_Runs == NULL)
+	    fatal("out of memory");
+    }
+    if ((run = calloc(1, sizeof(*run))) == NULL)
+	fatal("out of memory");
+    run->sr_File = fp;
+    list->li_Runs[list->li_NRuns++] = run;
+    return (run);
+}
+
+/*
+ * Move the entries added with value n to a new sorted run.
+ */
+static void
+SpillList(List *list, int n)
+{
+    Node **nodes;
+    Node **scan;
+    Node *node;
+    FILE *fp;
+    int count = 0;
+    int i;
+
+    if ((nodes = malloc(list->li_Count * sizeof(Node *))) == NULL)
+	fatal("out of memory");
+    for (scan = &list->li_Node.no_Next; (node = *scan) != &list->li_Node; ) {
+	if (node->no_Value == n && count < list->li_Count) {
+	    *scan = node->no_Next;
+	    nodes[count++] = node;
+	} else {
+	    scan = &node->no_Next;
+	}
+    }
+    qsort(nodes, count, sizeof(Node *), SortNodeCmp);
+    fp = SortTemp();
+    for (i = 0; i < count; ++i) {
+	SortWrite(fp, nodes[i]->no_Name, nodes[i]->no_Stat);
+	if (nodes[i]->no_Stat != NULL)
+	    free(nodes[i]->no_Stat);
+	free(nodes[i]);
+    }
+    free(nodes);
+    SortAddRun(list, fp);
+    list->li_Count = 0;
+
+    /* rehash what is left, the .cpignore entries */
+    memset(list->li_Hash, 0, sizeof(list->li_Hash));
+    for (node = list->li_Node.no_Next; node != &list->li_Node;
+	 node = node->no_Next) {
+	i = shash(node->no_Name);
+	node->no_HNext = list->li_Hash[i];
+	list->li_Hash[i] = node;
+    }
+}
+
+/*
+ * Spill the rest of the entries added with value n, and merge the runs
+ * until SortNext() can merge what is left at once.
+ */
+static void
+SortList(List *list, int n)
+{
+    SortRun **runs;
+    FILE *fp;
+    int count;
+
+    if (list->li_Count)
+	SpillList(list, n);
+    while (list->li_NRuns > SORT_FANIN) {
+	runs = list->li_Runs;
+	count = SortStart(runs, SORT_FANIN);
+	fp = SortTemp();
+	while (count > 0) {
+	    SortWrite(fp, runs[0]->sr_Name, runs[0]->sr_Stat);
+	    count = SortAdvance(runs, count);
+	}
+	list->li_NRuns -= SORT_FANIN;
+	memmove(runs, runs + SORT_FANIN, list->li_NRuns * sizeof(SortRun *));
+	SortAddRun(list, fp);
+    }
+    list->li_NRuns = SortStart(list->li_Runs, list->li_NRuns);
+    list->li_Taken = 0;
+}
+
+/*
+ * Return the next entry in name order, valid until the next call.
+ */
+static SortRun *
+SortNext(List *list)
+{
+    if (list->li_Taken && list->li_NRuns > 0)
+	list->li_NRuns = SortAdvance(list->li_Runs, list->li_NRuns);
+    list->li_Taken = 1;
+    return (list->li_NRuns > 0 ? list->li_Runs[0] : NULL);
+}
+
 static int
 shash(const char *s)
 {
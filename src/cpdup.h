@@ -35,6 +35,11 @@
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <fcntl.h>
 #include <stdio.h>
@@ -50,19 +55,22 @@
 #include <signal.h>
 #include <pwd.h>
 #include <fnmatch.h>
+#include <netdb.h>
 #include <assert.h>
+#include <pthread.h>
 
 #ifdef __linux
 
 /*
- * This is a horrible hack.  lchmod also seems to be missing
- * on the Debian system I am testing compatibility on (which will
- * break the symlink handling code), so not sure what to do about
- * that.
- *
- * XXX TODO
+ * lchmod is missing on Linux.  chmod would follow the link and change
+ * the mode of its target, fchmodat() fails instead (symlinks have no
+ * mode of their own there).
  */
-#define lchmod	chmod	/* horrible hack */
+#define lchmod(path, mode)	fchmodat(AT_FDCWD, path, mode, AT_SYMLINK_NOFOLLOW)
+
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
 
 #endif /* __linux */
 
@@ -125,6 +133,17 @@ extern int CompressOpt;
 extern int ReadOnlyOpt;
 extern int DstRootPrivs;
 extern int ValidateOpt;
+extern int ScanTreeOpt;
+extern int InlineOpt;
+extern int PrefetchOpt;
+extern int ParallelOpt;
+extern int LayoutOpt;
+extern int BigDirOpt;
+extern int CloneOpt;
+extern int AppendOpt;
+extern int TreeOpt;
+extern int TransportOpt;
+extern const char *TransportPort;
 
 extern int ssh_argc;
 extern const char *ssh_argv[];
@@ -38,19 +38,70 @@
 #include "hclink.h"
 #include "hcproto.h"
 
+#include <sys/wait.h>
+
 static void hcc_start_reply(hctransaction_t trans, struct HCHead *rhead);
 static int hcc_finish_reply(hctransaction_t trans, struct HCHead *head);
+static int hcc_connect_ssh(struct HostConf *hc, int readonly);
+static int hcc_connect_local(struct HostConf *hc, int readonly);
+static int hcc_connect_tcp(struct HostConf *hc);
+static int hcc_connect_shm(struct HostConf *hc, int readonly);
+static void hcc_tune_socket(int fd);
+static ssize_t hcc_read(struct HostConf *hc, void *buf, size_t bytes);
+static ssize_t hcc_write(struct HostConf *hc, const void *buf, size_t bytes);
+static ssize_t hcc_writev(struct HostConf *hc, const struct iovec *iov, int count);
+
+static struct HCShm *SlaveShm;	/* rings of a slave forked for -T shm */
 
 int
 hcc_connect(struct HostConf *hc, int readonly)
+{
+    if (hc == NULL || hc->host == NULL)
+	return(0);
+
+    switch(TransportOpt) {
+    case TRANSPORT_LOCAL:
+	return(hcc_connect_local(hc, readonly));
+    case TRANSPORT_TCP:
+	return(hcc_connect_tcp(hc));
+    case TRANSPORT_SHM:
+	return(hcc_connect_shm(hc, readonly));
+    default:
+	return(hcc_connect_ssh(hc, readonly));
+    }
+}
+
+/*
+ * Close a connection made by hcc_connect() and wait for a slave we
+ * started, which exits when it sees the connection go away.
+ */
+void
+hcc_disconnect(struct HostConf *hc)
+{
+    if (hc == NULL || hc->host == NULL)
+	return;
+    if (hc->shm != NULL) {
+	hcc_shm_destroy(hc->shm);
+	hc->shm = NULL;
+    }
+    if (hc->fdin >= 0)
+	close(hc->fdin);
+    if (hc->fdout >= 0 && hc->fdout != hc->fdin)
+	close(hc->fdout);
+    hc->fdin = -1;
+    hc->fdout = -1;
+    if (hc->pid > 0)
+	waitpid(hc->pid, NULL, 0);
+    hc->pid = 0;
+}
+
+static int
+hcc_connect_ssh(struct HostConf *hc, int readonly)
 {
     int fdin[2];
     int fdout[2];
     const char *av[32];
 
-    if (hc == NULL || hc->host == NULL)
-	return(0);
-
     if (pipe(fdin) < 0)
 	return(-1);
     if (pipe(fdout) < 0) {
@@ -100,6 +151,159 @@ hcc_connect(struct HostConf *hc, int readonly)
     }
 }
 
+/*
+ * Fork a slave which talks to us over a socketpair.  The host part of
+ * the path is only a name, both sides run on this machine.
+ */
+static int
+hcc_connect_local(struct HostConf *hc, int readonly)
+{
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+	return(-1);
+    hcc_tune_socket(sv[0]);
+    hcc_tune_socket(sv[1]);
+    fflush(stdout);
+    fflush(stderr);
+    if ((hc->pid = fork()) == 0) {
+	/*
+	 * Child process, becomes the slave as if run by cpdup -S
+	 */
+	close(sv[0]);
+	SlaveOpt = 1;
+	ReadOnlyOpt = readonly;
+	DstRootPrivs = (geteuid() == 0);
+	hc_slave(sv[1], sv[1]);
+	_exit(0);
+    } else if (hc->pid < 0) {
+	close(sv[0]);
+	close(sv[1]);
+	return(-1);
+    }
+    close(sv[1]);
+    hc->fdin = sv[0];
+    hc->fdout = sv[0];
+    return(0);
+}
+
+/*
+ * Connect to a slave started with cpdup -S -T tcp[:port].  There is no
+ * authentication or encryption, this is meant for trusted networks.
+ */
+static int
+hcc_connect_tcp(struct HostConf *hc)
+{
+    struct addrinfo hints;
+    struct addrinfo *res;
+    struct addrinfo *ai;
+    const char *host;
+    int error;
+    int fd = -1;
+
+    /* a [user@] prefix means nothing here */
+    if ((host = strchr(hc->host, '@')) != NULL)
+	++host;
+    else
+	host = hc->host;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((error = getaddrinfo(host, TransportPort, &hints, &res)) != 0) {
+	fprintf(stderr, "%s: %s\n", host, gai_strerror(error));
+	return(-1);
+    }
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+	if ((fd = socket(ai->ai_family, ai->ai_socktype,
+			 ai->ai_protocol)) < 0)
+	    continue;
+	/* buffer sizes must be set before connecting to take effect */
+	hcc_tune_socket(fd);
+	if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+	    break;
+	close(fd);
+	fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0)
+	return(-1);
+    hc->fdin = fd;
+    hc->fdout = fd;
+    return(0);
+}
+
+/*
+ * Fork a slave like hcc_connect_local(), but exchange the data through
+ * shared memory rings, see hcshm.c.
+ */
+static int
+hcc_connect_shm(struct HostConf *hc, int readonly)
+{
+    struct HCShm *shm;
+
+    if ((shm = hcc_shm_create()) == NULL)
+	return(-1);
+    fflush(stdout);
+    fflush(stderr);
+    if ((hc->pid = fork()) == 0) {
+	hcc_shm_side(shm, 1);
+	SlaveShm = shm;
+	SlaveOpt = 1;
+	ReadOnlyOpt = readonly;
+	DstRootPrivs = (geteuid() == 0);
+	hc_slave(-1, -1);
+	_exit(0);
+    } else if (hc->pid < 0) {
+	hcc_shm_destroy(shm);
+	return(-1);
+    }
+    hcc_shm_side(shm, 0);
+    hc->shm = shm;
+    hc->fdin = -1;
+    hc->fdout = -1;
+    return(0);
+}
+
+static ssize_t
+hcc_read(struct HostConf *hc, void *buf, size_t bytes)
+{
+    if (hc->shm != NULL)
+	return(hcc_shm_read(hc->shm, buf, bytes));
+    return(read(hc->fdin, buf, bytes));
+}
+
+static ssize_t
+hcc_write(struct HostConf *hc, const void *buf, size_t bytes)
+{
+    if (hc->shm != NULL)
+	return(hcc_shm_write(hc->shm, buf, bytes));
+    return(write(hc->fdout, buf, bytes));
+}
+
+static ssize_t
+hcc_writev(struct HostConf *hc, const struct iovec *iov, int count)
+{
+    if (hc->shm != NULL)
+	return(hcc_shm_writev(hc->shm, iov, count));
+    return(writev(hc->fdout, iov, count));
+}
+
+/*
+ * Use socket buffers large enough for the largest frames, and do not
+ * delay the small command packets.
+ */
+static void
+hcc_tune_socket(int fd)
+{
+    int bytes = HC_MAXBUFSIZE;
+    int on = 1;
+
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
 static int
 rc_badop(hctransaction_t trans __unused, struct HCHead *head)
 {
@@ -131,7 +335,9 @@ hcc_slave(int fdin, int fdout, struct HCDesc *descs, int count)
     }
     hcslave.fdin = fdin;
     hcslave.fdout = fdout;
+    hcslave.shm = SlaveShm;
     trans.hc = &hcslave;
+    hcc_set_bufsize(&trans, HC_BUFSIZE);
 
     /*
      * Process commands on fdin and write out results on fdout
@@ -151,6 +357,7 @@ hcc_slave(int fdin, int fdout, struct HCDesc *descs, int count)
 	hcc_start_reply(&trans, head);
 
 	r = dispatch[head->cmd & 255](&trans, head);
+	head = (void *)trans.rbuf;	/* moved if the hello grew it */
 
 	switch(r) {
 	case -2:
@@ -172,6 +379,77 @@ hcc_slave(int fdin, int fdout, struct HCDesc *descs, int count)
     return(0);
 }
 
+/*
+ * Accept connections on a TCP port and run a slave for each of them.
+ * Only returns if the port cannot be set up.
+ */
+int
+hcc_listen(const char *port, struct HCDesc *descs, int count)
+{
+    struct addrinfo hints;
+    struct addrinfo *res;
+    struct addrinfo *ai;
+    int error;
+    int on = 1;
+    int lfd = -1;
+    int fd;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if ((error = getaddrinfo(NULL, port, &hints, &res)) != 0) {
+	fprintf(stderr, "port %s: %s\n", port, gai_strerror(error));
+	return(-1);
+    }
+    /* prefer IPv6, which accepts IPv4 connections too on most systems */
+    for (ai = res; ai != NULL && ai->ai_family != AF_INET6; ai = ai->ai_next)
+	;
+    if (ai == NULL)
+	ai = res;
+    for (; ai != NULL; ai = ai->ai_next) {
+	if ((lfd = socket(ai->ai_family, ai->ai_socktype,
+			  ai->ai_protocol)) < 0)
+	    continue;
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	/* accepted sockets inherit the buffer sizes */
+	hcc_tune_socket(lfd);
+	if (bind(lfd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+	    listen(lfd, 16) == 0)
+	    break;
+	close(lfd);
+	lfd = -1;
+    }
+    freeaddrinfo(res);
+    if (lfd < 0) {
+	fprintf(stderr, "cannot listen on port %s: %s\n",
+		port, strerror(errno));
+	return(-1);
+    }
+
+    signal(SIGCHLD, SIG_IGN);	/* no zombies */
+    for (;;) {
+	if ((fd = accept(lfd, NULL, NULL)) < 0) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    fprintf(stderr, "accept: %s\n", strerror(errno));
+	    close(lfd);
+	    return(-1);
+	}
+	hcc_tune_socket(fd);
+	switch(fork()) {
+	case 0:
+	    close(lfd);
+	    hcc_slave(fd, fd, descs, count);
+	    _exit(0);
+	case -1:
+	    fprintf(stderr, "fork: %s\n", strerror(errno));
+	    break;
+	}
+	close(fd);
+    }
+}
+
 /*
  * This reads a command from fdin, fixes up the byte ordering, and returns
  * a pointer to HCHead.
@@ -190,7 +468,7 @@ hcc_read_command(struct HostConf *hc, hctransaction_t trans)
 
     n = 0;
     while (n < (int)sizeof(struct HCHead)) {
-	r = read(hc->fdin, (char *)&tmp + n, sizeof(struct HCHead) - n);
+	r = hcc_read(hc, (char *)&tmp + n, sizeof(struct HCHead) - n);
 	if (r <= 0)
 	    goto fail;
 	n += r;
@@ -209,14 +487,14 @@ hcc_read_command(struct HostConf *hc, hctransaction_t trans)
 	tmp.error = hc_bswap32(tmp.error);
     }
 
-    assert(tmp.bytes >= (int)sizeof(tmp) && tmp.bytes < HC_BUFSIZE);
+    assert(tmp.bytes >= (int)sizeof(tmp) && tmp.bytes < trans->bufsize);
 
     trans->swap = need_swap;
     memcpy(trans->rbuf, &tmp, n);
     aligned_bytes = HCC_ALIGN(tmp.bytes);
 
     while (n < aligned_bytes) {
-	r = read(hc->fdin, trans->rbuf + n, aligned_bytes - n);
+	r = hcc_read(hc, trans->rbuf + n, aligned_bytes - n);
 	if (r <= 0)
 	    goto fail;
 	n += r;
@@ -241,6 +519,8 @@ hcc_start_command(struct HostConf *hc, int16_t cmd)
     hctransaction_t trans;
 
     trans = &hc->trans;
+    if (trans->bufsize == 0)
+	hcc_set_bufsize(trans, HC_BUFSIZE);
 
     whead = (void *)trans->wbuf;
     whead->magic = HCMAGIC;
@@ -250,6 +530,8 @@ hcc_start_command(struct HostConf *hc, int16_t cmd)
     whead->error = 0;
 
     trans->windex = sizeof(*whead);
+    trans->wdata = NULL;
+    trans->wdatalen = 0;
     trans->hc = hc;
     trans->state = HCT_IDLE;
 
@@ -281,17 +563,36 @@ hcc_finish_command(hctransaction_t trans)
     struct HCHead *whead;
     struct HCHead *rhead;
     int aligned_bytes;
+    int n;
     int16_t wcmd;
 
     hc = trans->hc;
     whead = (void *)trans->wbuf;
-    whead->bytes = trans->windex;
-    aligned_bytes = HCC_ALIGN(trans->windex);
-    trans->windex = 0;	/* initialize for hcc_nextchaineditem() */
+    aligned_bytes = HCC_ALIGN(trans->windex + trans->wdatalen);
+    whead->bytes = aligned_bytes;
 
     trans->state = HCT_SENT;
 
-    if (write(hc->fdout, whead, aligned_bytes) != aligned_bytes) {
+    if (trans->wdata != NULL) {
+	/* the data of the last leaf goes out straight from the caller */
+	static const char pad[8];
+	struct iovec iov[3];
+
+	iov[0].iov_base = whead;
+	iov[0].iov_len = trans->windex;
+	iov[1].iov_base = (void *)(uintptr_t)trans->wdata;
+	iov[1].iov_len = trans->wdatalen;
+	iov[2].iov_base = (void *)(uintptr_t)pad;
+	iov[2].iov_len = aligned_bytes - trans->windex - trans->wdatalen;
+	n = hcc_writev(hc, iov, 3);
+	trans->wdata = NULL;
+	trans->wdatalen = 0;
+    } else {
+	n = hcc_write(hc, whead, aligned_bytes);
+    }
+    trans->windex = 0;	/* initialize for hcc_nextchaineditem() */
+
+    if (n != aligned_bytes) {
 #ifdef __error
 	*__error = EIO;
 #else
@@ -344,7 +645,7 @@ hcc_finish_reply(hctransaction_t trans, struct HCHead *head)
 #ifdef DEBUG
     hcc_debug_dump(trans, whead);
 #endif
-    return (write(trans->hc->fdout, whead, aligned_bytes) == aligned_bytes);
+    return (hcc_write(trans->hc, whead, aligned_bytes) == aligned_bytes);
 }
 
 void
@@ -354,7 +655,7 @@ hcc_leaf_string(hctransaction_t trans, int16_t leafid, const char *str)
     int bytes = strlen(str) + 1;
 
     item = (void *)(trans->wbuf + trans->windex);
-    assert(trans->windex + sizeof(*item) + bytes < HC_BUFSIZE);
+    assert(trans->windex + sizeof(*item) + bytes < (size_t)trans->bufsize);
     item->leafid = leafid;
     item->reserved = 0;
     item->bytes = sizeof(*item) + bytes;
@@ -368,7 +669,7 @@ hcc_leaf_data(hctransaction_t trans, int16_t leafid, const void *ptr, int bytes)
     struct HCLeaf *item;
 
     item = (void *)(trans->wbuf + trans->windex);
-    assert(trans->windex + sizeof(*item) + bytes < HC_BUFSIZE);
+    assert(trans->windex + sizeof(*item) + bytes < (size_t)trans->bufsize);
     item->leafid = leafid;
     item->reserved = 0;
     item->bytes = sizeof(*item) + bytes;
@@ -382,7 +683,7 @@ hcc_leaf_int32(hctransaction_t trans, int16_t leafid, int32_t value)
     struct HCLeaf *item;
 
     item = (void *)(trans->wbuf + trans->windex);
-    assert(trans->windex + sizeof(*item) + sizeof(value) < HC_BUFSIZE);
+    assert(trans->windex + sizeof(*item) + sizeof(value) < (size_t)trans->bufsize);
     item->leafid = leafid;
     item->reserved = 0;
     item->bytes = sizeof(*item) + sizeof(value);
@@ -396,7 +697,7 @@ hcc_leaf_int64(hctransaction_t trans, int16_t leafid, int64_t value)
     struct HCLeaf *item;
 
     item = (void *)(trans->wbuf + trans->windex);
-    assert(trans->windex + sizeof(*item) + sizeof(value) < HC_BUFSIZE);
+    assert(trans->windex + sizeof(*item) + sizeof(value) < (size_t)trans->bufsize);
     item->leafid = leafid;
     item->reserved = 0;
     item->bytes = sizeof(*item) + sizeof(value);
@@ -404,6 +705,153 @@ hcc_leaf_int64(hctransaction_t trans, int16_t leafid, int64_t value)
     trans->windex = HCC_ALIGN(trans->windex + item->bytes);
 }
 
+/*
+ * Add a data leaf without copying the data into the write buffer, it is
+ * written out directly by hcc_finish_command().  This must be the last
+ * leaf of the command and <ptr> must stay valid until then.
+ */
+void
+hcc_leaf_data_ref(hctransaction_t trans, int16_t leafid, const void *ptr, int bytes)
+{
+    struct HCLeaf *item;
+
+    item = (void *)(trans->wbuf + trans->windex);
+    assert(trans->windex + sizeof(*item) + bytes < (size_t)trans->bufsize);
+    item->leafid = leafid;
+    item->reserved = 0;
+    item->bytes = sizeof(*item) + bytes;
+    trans->windex += sizeof(*item);
+    trans->wdata = ptr;
+    trans->wdatalen = bytes;
+}
+
+/*
+ * Add a data leaf holding up to <bytes> read from <fd>, reading straight
+ * into the write buffer.  Returns the result of read().
+ */
+int
+hcc_leaf_read(hctransaction_t trans, int16_t leafid, int fd, int bytes)
+{
+    struct HCLeaf *item;
+    int n;
+
+    item = (void *)(trans->wbuf + trans->windex);
+    assert(trans->windex + sizeof(*item) + bytes < (size_t)trans->bufsize);
+    if ((n = read(fd, item + 1, bytes)) < 0)
+	return(-1);
+    item->leafid = leafid;
+    item->reserved = 0;
+    item->bytes = sizeof(*item) + n;
+    trans->windex = HCC_ALIGN(trans->windex + item->bytes);
+    return(n);
+}
+
+/*
+ * Send up to <bytes> read from <fd> in a reply packet of its own, with
+ * HCF_CONTINUE set, holding a single <leafid> leaf.  The data is spliced
+ * from the file into a pipe and from there to the output descriptor, so
+ * it never passes through user space.
+ *
+ * Returns the number of bytes sent, 0 at EOF, or -1 on error.  errno is
+ * EOPNOTSUPP if <fd> cannot be spliced from, in which case nothing was
+ * consumed and the caller should fall back to hcc_leaf_read().
+ */
+#ifdef __linux
+
+int
+hcc_leaf_splice(hctransaction_t trans, struct HCHead *head, int16_t leafid,
+		int fd, int bytes)
+{
+    static const char pad[8];
+    struct HCHead *whead = (void *)trans->wbuf;
+    struct {
+	struct HCHead head;
+	struct HCLeaf item;
+    } hdr;
+    ssize_t n;
+    ssize_t r;
+    ssize_t x;
+    int padding;
+
+    assert(sizeof(*whead) + bytes < (size_t)trans->bufsize);
+    if (trans->splice == 0 && trans->hc->shm != NULL)
+	trans->splice = -1;	/* nothing to splice to */
+    if (trans->splice == 0) {
+	trans->splice = (pipe(trans->spipe) == 0) ? 1 : -1;
+#ifdef F_SETPIPE_SZ
+	/* try to fit a whole chunk, the default is only 64KB */
+	if (trans->splice > 0 && bytes > 65536)
+	    fcntl(trans->spipe[1], F_SETPIPE_SZ, bytes);
+#endif
+    }
+    if (trans->splice < 0) {
+	errno = EOPNOTSUPP;
+	return(-1);
+    }
+    if ((n = splice(fd, NULL, trans->spipe[1], NULL, bytes, SPLICE_F_MOVE)) < 0) {
+	if (errno == EINVAL || errno == ENOSYS)
+	    errno = EOPNOTSUPP;
+	return(-1);
+    }
+    if (n == 0)
+	return(0);
+
+    /* anything already in the reply must go out first */
+    if (trans->windex > (int)sizeof(*whead)) {
+	whead->cmd |= HCF_CONTINUE;
+	if (!hcc_finish_reply(trans, head))
+	    return(-1);
+	hcc_start_reply(trans, head);
+    }
+
+    padding = HCC_ALIGN(n) - n;
+    hdr.head.magic = HCMAGIC;
+    hdr.head.bytes = sizeof(hdr) + n + padding;
+    hdr.head.cmd = whead->cmd | HCF_CONTINUE;
+    hdr.head.id = whead->id;
+    hdr.head.error = 0;
+    hdr.item.leafid = leafid;
+    hdr.item.reserved = 0;
+    hdr.item.bytes = sizeof(hdr.item) + n;
+    if (write(trans->hc->fdout, &hdr, sizeof(hdr)) != sizeof(hdr))
+	return(-1);
+    for (x = 0; x < n; x += r) {
+	r = splice(trans->spipe[0], NULL, trans->hc->fdout, NULL, n - x,
+		   SPLICE_F_MOVE);
+	if (r > 0)
+	    continue;
+	if (r == 0 || errno != EINVAL)
+	    return(-1);
+	/*
+	 * The output descriptor cannot be spliced to, copy the data
+	 * through the (empty) write buffer and stop splicing.
+	 */
+	r = read(trans->spipe[0], whead + 1, n - x);
+	if (r <= 0 || write(trans->hc->fdout, whead + 1, r) != r)
+	    return(-1);
+	if (x + r == n) {
+	    close(trans->spipe[0]);
+	    close(trans->spipe[1]);
+	    trans->splice = -1;
+	}
+    }
+    if (padding && write(trans->hc->fdout, pad, padding) != padding)
+	return(-1);
+    return(n);
+}
+
+#else
+
+int
+hcc_leaf_splice(hctransaction_t trans __unused, struct HCHead *head __unused,
+		int16_t leafid __unused, int fd __unused, int bytes __unused)
+{
+    errno = EOPNOTSUPP;
+    return(-1);
+}
+
+#endif
+
 /*
  * Check if there's enough space left in the write buffer for <n>
  * leaves with a total of <size> data bytes.
@@ -416,7 +864,7 @@ int
 hcc_check_space(hctransaction_t trans, struct HCHead *head, int n, int size)
 {
     size = HCC_ALIGN(size) + n * sizeof(struct HCLeaf);
-    if (size >= HC_BUFSIZE - trans->windex) {
+    if (size >= trans->bufsize - trans->windex) {
 	struct HCHead *whead = (void *)trans->wbuf;
 
 	whead->cmd |= HCF_CONTINUE;
@@ -427,6 +875,23 @@ hcc_check_space(hctransaction_t trans, struct HCHead *head, int n, int size)
     return (1);
 }
 
+/*
+ * Set the frame size, growing the buffers as needed.  The buffers may
+ * move, so the caller must not hold pointers into them.
+ */
+void
+hcc_set_bufsize(hctransaction_t trans, int bytes)
+{
+    assert(bytes >= HC_BUFSIZE && bytes <= HC_MAXBUFSIZE);
+    if (bytes > trans->bufsize) {
+	trans->rbuf = realloc(trans->rbuf, bytes);
+	trans->wbuf = realloc(trans->wbuf, bytes);
+	if (trans->rbuf == NULL || trans->wbuf == NULL)
+	    fatal("out of memory");
+    }
+    trans->bufsize = bytes;
+}
+
 intptr_t
 hcc_alloc_descriptor(struct HostConf *hc, void *ptr, int type)
 {
@@ -519,7 +984,7 @@ hcc_nextitem(hctransaction_t trans, struct HCHead *head, struct HCLeaf *item)
     }
     assert(head->bytes >= offset + (int)sizeof(*item));
     assert(head->bytes >= offset + item->bytes);
-    assert(item->bytes >= (int)sizeof(*item) && item->bytes < HC_BUFSIZE);
+    assert(item->bytes >= (int)sizeof(*item) && item->bytes < trans->bufsize);
     return (item);
 }
 
@@ -34,8 +34,23 @@
 #ifndef _HCLINK_H_
 #define _HCLINK_H_
 
-/* Changing the buffer size breaks protocol compatibility! */
+/*
+ * Frames are limited to HC_BUFSIZE bytes unless both peers agree on a
+ * larger size, up to HC_MAXBUFSIZE, in the hello.  Changing HC_BUFSIZE
+ * breaks protocol compatibility!
+ */
 #define HC_BUFSIZE	65536
+#define HC_MAXBUFSIZE	(4 * 1024 * 1024)
+
+/*
+ * Transports (-T)
+ */
+#define TRANSPORT_SSH	0	/* ssh to the host, run cpdup -S */
+#define TRANSPORT_LOCAL	1	/* fork a slave, socketpair */
+#define TRANSPORT_TCP	2	/* plain TCP, cpdup -S -T tcp listens */
+#define TRANSPORT_SHM	3	/* fork a slave, shared memory rings */
+
+#define HC_TCP_PORT	"5775"
 
 struct HCHostDesc {
     struct HCHostDesc *next;
@@ -45,14 +60,25 @@ struct HCHostDesc {
 };
 
 struct HostConf;
+struct HCScanTree;
+struct HCStatBase;
+struct HCShm;
+struct HCPutFiles;
+struct HCInlineCache;
+struct HCPrefetch;
 
 typedef struct HCTransaction {
-    char	rbuf[HC_BUFSIZE];	/* input buffer */
-    char	wbuf[HC_BUFSIZE];	/* output buffer */
+    char	*rbuf;		/* input buffer */
+    char	*wbuf;		/* output buffer */
+    int		bufsize;	/* agreed on frame size, size of the buffers */
     struct HostConf *hc;
     uint16_t	id;		/* assigned transaction id */
     int		swap;		/* have to swap byte order */
     int		windex;		/* output buffer index */
+    const void	*wdata;		/* data of the last leaf, not in wbuf */
+    int		wdatalen;
+    int		splice;		/* splice pipe: 0 untried, 1 open, -1 n/a */
+    int		spipe[2];
     enum { HCT_IDLE, HCT_SENT, HCT_REPLIED, HCT_DONE, HCT_FAIL } state;
 } *hctransaction_t;
 
@@ -60,10 +86,17 @@ struct HostConf {
     char	*host;		/* [user@]host */
     int		fdin;		/* pipe */
     int		fdout;		/* pipe */
+    struct HCShm *shm;		/* shared memory rings instead, if set */
     int		error;		/* permanent failure code */
     pid_t	pid;
     int		version;	/* cpdup protocol version */
     struct HCHostDesc *hostdescs;
+    struct HCScanTree *scan;	/* tree listing streamed ahead, if any */
+    struct HCStatBase *statbase;	/* packed stat decoding state */
+    struct HCPutFiles *putfiles;	/* small files waiting for HC_PUTFILES */
+    int		inlinemax;	/* list files up to this size with contents */
+    struct HCInlineCache *inlines;	/* contents received with listings */
+    struct HCPrefetch *prefetch;	/* files read ahead, if any */
     struct HCTransaction trans;
 };
 
@@ -98,6 +131,9 @@ struct HCDesc {
     int (*func)(hctransaction_t, struct HCHead *);
 };
 
+#define HC_MAXPREFETCH	256		/* files read ahead */
+#define HC_MAXLANES	16		/* parallel copies of a file */
+
 /*
  * Item extraction macros
  */
@@ -114,7 +150,9 @@ struct HCDesc {
  * Prototypes
  */
 int hcc_connect(struct HostConf *hc, int readonly);
+void hcc_disconnect(struct HostConf *hc);
 int hcc_slave(int fdin, int fdout, struct HCDesc *descs, int count);
+int hcc_listen(const char *port, struct HCDesc *descs, int count);
 
 struct HCHead *hcc_read_command(struct HostConf *hc, hctransaction_t trans);
 hctransaction_t hcc_start_command(struct HostConf *hc, int16_t cmd);
@@ -123,7 +161,11 @@ void hcc_leaf_string(hctransaction_t trans, int16_t leafid, const char *str);
 void hcc_leaf_data(hctransaction_t trans, int16_t leafid, const void *ptr, int bytes);
 void hcc_leaf_int32(hctransaction_t trans, int16_t leafid, int32_t value);
 void hcc_leaf_int64(hctransaction_t trans, int16_t leafid, int64_t value);
+void hcc_leaf_data_ref(hctransaction_t trans, int16_t leafid, const void *ptr, int bytes);
+int hcc_leaf_read(hctransaction_t trans, int16_t leafid, int fd, int bytes);
+int hcc_leaf_splice(hctransaction_t trans, struct HCHead *head, int16_t leafid, int fd, int bytes);
 int hcc_check_space(hctransaction_t trans, struct HCHead *head, int n, int size);
+void hcc_set_bufsize(hctransaction_t trans, int bytes);
 
 intptr_t hcc_alloc_descriptor(struct HostConf *hc, void *ptr, int type);
 void *hcc_get_descriptor(struct HostConf *hc, intptr_t desc, int type);
@@ -136,4 +178,11 @@ struct HCLeaf *hcc_currentchaineditem(struct HostConf *hc, struct HCHead *head);
 
 void hcc_debug_dump(struct HCHead *head);
 
+struct HCShm *hcc_shm_create(void);
+void hcc_shm_side(struct HCShm *shm, int slave);
+void hcc_shm_destroy(struct HCShm *shm);
+ssize_t hcc_shm_read(struct HCShm *shm, void *buf, size_t bytes);
+ssize_t hcc_shm_write(struct HCShm *shm, const void *buf, size_t bytes);
+ssize_t hcc_shm_writev(struct HCShm *shm, const struct iovec *iov, int count);
+
 #endif /* !_HCLINK_H_ */
@@ -38,9 +38,30 @@
 #include "hclink.h"
 #include "hcproto.h"
 
+#include <openssl/evp.h>
+
+/* decoding state of packed stat records, see rc_encode_packed() */
+struct HCStatBase {
+    int64_t	time;		/* mtime of the directory */
+    uint64_t	dev;		/* device of the directory */
+    uint64_t	ino;		/* inode of the previous entry */
+    int		namelen;	/* name of the previous entry */
+    char	name[NAME_MAX + 1];
+};
+
 static int hc_decode_stat(hctransaction_t trans, struct stat *, struct HCHead *);
 static int hc_decode_stat_item(struct stat *st, struct HCLeaf *item);
 static int rc_encode_stat(hctransaction_t trans, struct stat *);
+static int hc_decode_packed(struct HCLeaf *item, struct HCStatBase *base,
+			    struct HCDirEntry *den, struct stat *st);
+static int hc_decode_dirent(struct HostConf *hc, struct HCLeaf *item,
+			    struct HCDirEntry *den, struct stat *st);
+static void hc_decode_dirbase(struct HostConf *hc, struct HCLeaf *item);
+static void rc_encode_packed(hctransaction_t trans, int16_t leafid,
+			     struct HCStatBase *base, const char *name,
+			     struct stat *st);
+static void rc_encode_dirbase(hctransaction_t trans, struct HCStatBase *base,
+			      DIR *dir);
 
 static int rc_hello(hctransaction_t trans, struct HCHead *);
 static int rc_stat(hctransaction_t trans, struct HCHead *);
@@ -49,6 +70,8 @@ static int rc_opendir(hctransaction_t trans, struct HCHead *);
 static int rc_readdir(hctransaction_t trans, struct HCHead *);
 static int rc_closedir(hctransaction_t trans, struct HCHead *);
 static int rc_scandir(hctransaction_t trans, struct HCHead *);
+static int rc_scantree(hctransaction_t trans, struct HCHead *);
+static int rc_putfiles(hctransaction_t trans, struct HCHead *);
 static int rc_open(hctransaction_t trans, struct HCHead *);
 static int rc_close(hctransaction_t trans, struct HCHead *);
 static int rc_read(hctransaction_t trans, struct HCHead *);
@@ -57,6 +80,7 @@ static int rc_write(hctransaction_t trans, struct HCHead *);
 static int rc_remove(hctransaction_t trans, struct HCHead *);
 static int rc_mkdir(hctransaction_t trans, struct HCHead *);
 static int rc_rmdir(hctransaction_t trans, struct HCHead *);
+static int rc_rmtree(hctransaction_t trans, struct HCHead *);
 static int rc_chown(hctransaction_t trans, struct HCHead *);
 static int rc_lchown(hctransaction_t trans, struct HCHead *);
 static int rc_chmod(hctransaction_t trans, struct HCHead *);
@@ -66,6 +90,9 @@ static int rc_link(hctransaction_t trans, struct HCHead *);
 static int rc_chflags(hctransaction_t trans, struct HCHead *);
 #endif
 static int rc_readlink(hctransaction_t trans, struct HCHead *);
+static int rc_digest(hctransaction_t trans, struct HCHead *);
+static int rc_clone(hctransaction_t trans, struct HCHead *);
+static int rc_treedigest(hctransaction_t trans, struct HCHead *);
 static int rc_umask(hctransaction_t trans, struct HCHead *);
 static int rc_symlink(hctransaction_t trans, struct HCHead *);
 static int rc_rename(hctransaction_t trans, struct HCHead *);
@@ -113,8 +140,34 @@ static struct HCDesc HCDispatchTable[] = {
     { HC_LCHFLAGS,	rc_chflags },
 #endif
     { HC_LCHMOD,	rc_chmod },
+    { HC_RMTREE,	rc_rmtree },
+    { HC_SCANTREE,	rc_scantree },
+    { HC_PUTFILES,	rc_putfiles },
+    { HC_DIGEST,	rc_digest },
+    { HC_CLONE,		rc_clone },
+    { HC_TREEDIGEST,	rc_treedigest },
+};
+
+/*
+ * State of a tree listing (HC_SCANTREE) streamed over a second connection
+ * to the source host.  It is consumed by hc_opendir()/hc_readdir() in the
+ * order DoCopy() traverses the tree.
+ */
+struct HCScanTree {
+    struct HostConf conn;	/* connection carrying the stream */
+    enum { SCAN_IDLE, SCAN_RUNNING, SCAN_DONE } state;
+    int atheader;		/* current item starts the next directory */
 };
 
+static int scan_opendir(struct HostConf *hc, const char *path);
+static struct HCDirEntry *scan_readdir(struct HostConf *hc,
+	struct HCDirEntry *den, struct stat **statpp);
+static void inline_dir(struct HostConf *hc, const char *path);
+static void inline_data(struct HostConf *hc, struct HCLeaf *item);
+static void inline_entry(struct HostConf *hc, const char *name,
+	const struct stat *st);
+static int inline_open(struct HostConf *hc, const char *path);
+
 static int chown_warning;
 #ifdef _ST_FLAGS_PRESENT_
 static int chflags_warning;
@@ -149,7 +202,17 @@ hc_connect(struct HostConf *hc, int readonly)
 	fprintf(stderr, "Unable to connect to %s\n", hc->host);
 	return(-1);
     }
-    return(hc_hello(hc));
+    if (hc_hello(hc) < 0) {
+	hcc_disconnect(hc);
+	return(-1);
+    }
+    return(0);
+}
+
+void
+hc_disconnect(struct HostConf *hc)
+{
+    hcc_disconnect(hc);
 }
 
 void
@@ -159,6 +222,13 @@ hc_slave(int fdin, int fdout)
 	      sizeof(HCDispatchTable) / sizeof(HCDispatchTable[0]));
 }
 
+void
+hc_listen(const char *port)
+{
+    hcc_listen(port, HCDispatchTable,
+	       sizeof(HCDispatchTable) / sizeof(HCDispatchTable[0]));
+}
+
 /*
  * A HELLO RPC is sent on the initial connect.
  */
@@ -169,6 +239,7 @@ hc_hello(struct HostConf *hc)
     struct HCLeaf *item;
     hctransaction_t trans;
     char hostbuf[256];
+    int bufsize;
     int error;
 
     memset(hostbuf, 0, sizeof(hostbuf));
@@ -180,6 +251,7 @@ hc_hello(struct HostConf *hc)
     trans = hcc_start_command(hc, HC_HELLO);
     hcc_leaf_string(trans, LC_HELLOSTR, hostbuf);
     hcc_leaf_int32(trans, LC_VERSION, HCPROTO_VERSION);
+    hcc_leaf_int32(trans, LC_BUFSIZE, HC_MAXBUFSIZE);
     if (UseCpFile)
 	hcc_leaf_string(trans, LC_PATH1, UseCpFile);
     if ((head = hcc_finish_command(trans)) == NULL) {
@@ -195,6 +267,7 @@ hc_hello(struct HostConf *hc)
     }
 
     error = -1;
+    bufsize = HC_BUFSIZE;
     FOR_EACH_ITEM(item, trans, head) {
 	switch(item->leafid) {
 	case LC_HELLOSTR:
@@ -205,8 +278,19 @@ hc_hello(struct HostConf *hc)
 	case LC_VERSION:
 	    hc->version = HCC_INT32(item);
 	    break;
+	case LC_BUFSIZE:
+	    bufsize = HCC_INT32(item);
+	    break;
 	}
     }
+    /* the slave only answers with a size we offered */
+    if (bufsize < HC_BUFSIZE || bufsize > HC_MAXBUFSIZE) {
+	fprintf(stderr, "Remote cpdup at %s sent a bad frame size %d\n",
+		hc->host, bufsize);
+	error = -1;
+    } else {
+	hcc_set_bufsize(trans, bufsize);
+    }
     if (hc->version < HCPROTO_VERSION_COMPAT) {
 	fprintf(stderr, "Remote cpdup at %s has an incompatible version\n",
 		hc->host);
@@ -226,10 +310,20 @@ rc_hello(hctransaction_t trans, struct HCHead *head)
 {
     struct HCLeaf *item;
     char hostbuf[256];
+    int bufsize = 0;
 
     FOR_EACH_ITEM(item, trans, head) {
-	if (item->leafid == LC_PATH1)
+	switch(item->leafid) {
+	case LC_PATH1:
 	    UseCpFile = strdup(HCC_STRING(item));
+	    break;
+	case LC_VERSION:
+	    trans->hc->version = HCC_INT32(item);
+	    break;
+	case LC_BUFSIZE:
+	    bufsize = HCC_INT32(item);
+	    break;
+	}
     }
 
     memset(hostbuf, 0, sizeof(hostbuf));
@@ -240,6 +334,17 @@ rc_hello(hctransaction_t trans, struct HCHead *head)
 
     hcc_leaf_string(trans, LC_HELLOSTR, hostbuf);
     hcc_leaf_int32(trans, LC_VERSION, HCPROTO_VERSION);
+
+    /*
+     * Agree on the largest frame size both sides support.  Clients
+     * which do not offer one keep using HC_BUFSIZE.
+     */
+    if (bufsize > HC_BUFSIZE) {
+	if (bufsize > HC_MAXBUFSIZE)
+	    bufsize = HC_MAXBUFSIZE;
+	hcc_leaf_int32(trans, LC_BUFSIZE, bufsize);
+	hcc_set_bufsize(trans, bufsize);
+    }
     return(0);
 }
 
@@ -288,8 +393,17 @@ hc_decode_stat(hctransaction_t trans, struct stat *st, struct HCHead *head)
     struct HCLeaf *item;
 
     memset(st, 0, sizeof(*st));
-    FOR_EACH_ITEM(item, trans, head)
-	hc_decode_stat_item(st, item);
+    FOR_EACH_ITEM(item, trans, head) {
+	if (item->leafid == LC_STATREC) {
+	    struct HCStatBase base;
+
+	    memset(&base, 0, sizeof(base));
+	    if (hc_decode_packed(item, &base, NULL, st) < 0)
+		fatal("cpdup hlink protocol error with %s", trans->hc->host);
+	} else {
+	    hc_decode_stat_item(st, item);
+	}
+    }
     return(0);
 }
 
@@ -402,6 +516,13 @@ rc_lstat(hctransaction_t trans, struct HCHead *head)
 static int
 rc_encode_stat(hctransaction_t trans, struct stat *st)
 {
+    if (trans->hc->version >= HCPROTO_VERSION_PACKSTAT) {
+	struct HCStatBase base;
+
+	memset(&base, 0, sizeof(base));
+	rc_encode_packed(trans, LC_STATREC, &base, NULL, st);
+	return(0);
+    }
     hcc_leaf_int32(trans, LC_DEV, st->st_dev);
     hcc_leaf_int64(trans, LC_INO, st->st_ino);
     hcc_leaf_int32(trans, LC_MODE, st->st_mode);
@@ -426,6 +547,299 @@ rc_encode_stat(hctransaction_t trans, struct stat *st)
     return(0);
 }
 
+/*
+ * Packed stat records
+ *
+ * A peer which announced HCPROTO_VERSION_PACKSTAT in its hello is sent
+ * a single LC_STATREC (HC_STAT, HC_LSTAT) or LC_DIRENT (HC_SCANDIR,
+ * HC_SCANTREE) leaf per entry instead of a leaf per stat field.  The
+ * numbers are varints, which are byte order independent, with signed
+ * values zigzag encoded.
+ *
+ * The listing of each directory starts with an LC_DIRBASE leaf holding
+ * the device and mtime of the directory.  An entry only carries its
+ * device if it differs, its times relative to the directory mtime, its
+ * inode number relative to the previous entry, and its name front coded
+ * against the previous name.
+ */
+#define SR_STAT		0x01	/* stat info present */
+#define SR_DEV		0x02	/* device differs from the directory */
+#define SR_RDEV		0x04	/* character or block device */
+#define SR_NSEC		0x08	/* nanoseconds present */
+#define SR_FLAGS	0x10	/* file flags present */
+
+/*
+ * Upper bound of a record without the name: flags, 16 stat fields and
+ * the two name lengths, at most 10 bytes each.
+ */
+#define STATREC_MAX	(19 * 10)
+
+static uint8_t *
+pack_uint(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80) {
+	*p++ = (uint8_t)(v | 0x80);
+	v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return(p);
+}
+
+static uint8_t *
+pack_int(uint8_t *p, int64_t v)
+{
+    return(pack_uint(p, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63)));
+}
+
+/*
+ * Returns a pointer past the varint, or NULL if it is truncated.  A
+ * NULL <p> is passed through so that a run of fields needs only one
+ * check at the end.
+ */
+static const uint8_t *
+unpack_uint(const uint8_t *p, const uint8_t *end, uint64_t *vp)
+{
+    uint64_t v = 0;
+    int shift;
+
+    *vp = 0;
+    for (shift = 0; p != NULL && p < end && shift < 64; shift += 7) {
+	v |= (uint64_t)(*p & 0x7f) << shift;
+	if ((*p++ & 0x80) == 0) {
+	    *vp = v;
+	    return(p);
+	}
+    }
+    return(NULL);
+}
+
+static const uint8_t *
+unpack_int(const uint8_t *p, const uint8_t *end, int64_t *vp)
+{
+    uint64_t v;
+
+    p = unpack_uint(p, end, &v);
+    *vp = (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+    return(p);
+}
+
+static void
+rc_encode_packed(hctransaction_t trans, int16_t leafid,
+		 struct HCStatBase *base, const char *name, struct stat *st)
+{
+    uint8_t rec[STATREC_MAX + NAME_MAX];
+    uint8_t *p = rec;
+    int flags = 0;
+    int len;
+    int n;
+
+    if (st != NULL) {
+	flags |= SR_STAT;
+	if ((uint64_t)st->st_dev != base->dev)
+	    flags |= SR_DEV;
+	if (S_ISCHR(st->st_mode) || S_ISBLK(st->st_mode))
+	    flags |= SR_RDEV;
+#if defined(st_atime)
+	if (st->st_atim.tv_nsec || st->st_mtim.tv_nsec || st->st_ctim.tv_nsec)
+	    flags |= SR_NSEC;
+#endif
+#ifdef _ST_FLAGS_PRESENT_
+	if (st->st_flags)
+	    flags |= SR_FLAGS;
+#endif
+    }
+    p = pack_uint(p, flags);
+    if (st != NULL) {
+	p = pack_uint(p, st->st_mode);
+	p = pack_uint(p, st->st_nlink);
+	p = pack_uint(p, st->st_uid);
+	p = pack_uint(p, st->st_gid);
+	if (flags & SR_DEV)
+	    p = pack_uint(p, st->st_dev);
+	if (flags & SR_RDEV)
+	    p = pack_uint(p, st->st_rdev);
+	p = pack_int(p, (int64_t)(st->st_ino - base->ino));
+	base->ino = st->st_ino;
+	p = pack_uint(p, st->st_size);
+	p = pack_uint(p, st->st_blocks);
+	p = pack_uint(p, st->st_blksize);
+	p = pack_int(p, (int64_t)st->st_mtime - base->time);
+	p = pack_int(p, (int64_t)st->st_atime - base->time);
+	p = pack_int(p, (int64_t)st->st_ctime - base->time);
+#if defined(st_atime)
+	if (flags & SR_NSEC) {
+	    p = pack_uint(p, st->st_mtim.tv_nsec);
+	    p = pack_uint(p, st->st_atim.tv_nsec);
+	    p = pack_uint(p, st->st_ctim.tv_nsec);
+	}
+#endif
+#ifdef _ST_FLAGS_PRESENT_
+	if (flags & SR_FLAGS)
+	    p = pack_uint(p, st->st_flags);
+#endif
+    }
+    if (name != NULL) {
+	len = strlen(name);
+	assert(len <= NAME_MAX);
+	for (n = 0; n < len && n < base->namelen; ++n) {
+	    if (name[n] != base->name[n])
+		break;
+	}
+	p = pack_uint(p, n);
+	p = pack_uint(p, len - n);
+	memcpy(p, name + n, len - n);
+	p += len - n;
+	memcpy(base->name + n, name + n, len - n);
+	base->namelen = len;
+    }
+    hcc_leaf_data(trans, leafid, rec, p - rec);
+}
+
+/*
+ * Start the listing of a directory.  The client resets its decoding
+ * state when it sees the LC_DIRBASE leaf.
+ */
+static void
+rc_encode_dirbase(hctransaction_t trans, struct HCStatBase *base, DIR *dir)
+{
+    uint8_t rec[2 * 10];
+    uint8_t *p = rec;
+    struct stat st;
+
+    memset(base, 0, sizeof(*base));
+    if (fstat(dirfd(dir), &st) == 0) {
+	base->dev = st.st_dev;
+	base->time = st.st_mtime;
+    }
+    p = pack_uint(p, base->dev);
+    p = pack_int(p, base->time);
+    hcc_leaf_data(trans, LC_DIRBASE, rec, p - rec);
+}
+
+/*
+ * Decode a packed record into <st> and, if <den> is not NULL, the name
+ * into <den>.  Returns 1 if the record has stat info, 0 if not, -1 if
+ * it is malformed.
+ */
+static int
+hc_decode_packed(struct HCLeaf *item, struct HCStatBase *base,
+		 struct HCDirEntry *den, struct stat *st)
+{
+    const uint8_t *p = HCC_BINARYDATA(item);
+    const uint8_t *end = (const uint8_t *)item + item->bytes;
+    uint64_t flags;
+    uint64_t prefix;
+    uint64_t len;
+    uint64_t v;
+    int64_t i;
+
+    p = unpack_uint(p, end, &flags);
+    if (flags & SR_STAT) {
+	memset(st, 0, sizeof(*st));
+	p = unpack_uint(p, end, &v);
+	st->st_mode = v;
+	p = unpack_uint(p, end, &v);
+	st->st_nlink = v;
+	p = unpack_uint(p, end, &v);
+	st->st_uid = v;
+	p = unpack_uint(p, end, &v);
+	st->st_gid = v;
+	st->st_dev = base->dev;
+	if (flags & SR_DEV) {
+	    p = unpack_uint(p, end, &v);
+	    st->st_dev = v;
+	}
+	if (flags & SR_RDEV) {
+	    p = unpack_uint(p, end, &v);
+	    st->st_rdev = v;
+	}
+	p = unpack_int(p, end, &i);
+	base->ino += i;
+	st->st_ino = base->ino;
+	p = unpack_uint(p, end, &v);
+	st->st_size = v;
+	p = unpack_uint(p, end, &v);
+	st->st_blocks = v;
+	p = unpack_uint(p, end, &v);
+	st->st_blksize = v;
+	p = unpack_int(p, end, &i);
+	st->st_mtime = (time_t)(base->time + i);
+	p = unpack_int(p, end, &i);
+	st->st_atime = (time_t)(base->time + i);
+	p = unpack_int(p, end, &i);
+	st->st_ctime = (time_t)(base->time + i);
+	if (flags & SR_NSEC) {
+	    p = unpack_uint(p, end, &v);
+#if defined(st_atime)
+	    st->st_mtim.tv_nsec = v;
+#endif
+	    p = unpack_uint(p, end, &v);
+#if defined(st_atime)
+	    st->st_atim.tv_nsec = v;
+#endif
+	    p = unpack_uint(p, end, &v);
+#if defined(st_atime)
+	    st->st_ctim.tv_nsec = v;
+#endif
+	}
+	if (flags & SR_FLAGS) {
+	    p = unpack_uint(p, end, &v);
+#ifdef _ST_FLAGS_PRESENT_
+	    st->st_flags = (uint32_t)v;
+#endif
+	}
+    }
+    if (den != NULL) {
+	p = unpack_uint(p, end, &prefix);
+	p = unpack_uint(p, end, &len);
+	if (p == NULL || prefix > (uint64_t)base->namelen ||
+	    len > NAME_MAX - prefix || len > (uint64_t)(end - p))
+	    return(-1);
+	memcpy(base->name + prefix, p, len);
+	base->namelen = prefix + len;
+	base->name[base->namelen] = 0;
+	memcpy(den->d_name, base->name, base->namelen + 1);
+    }
+    if (p == NULL)
+	return(-1);
+    return((flags & SR_STAT) ? 1 : 0);
+}
+
+static struct HCStatBase *
+hc_statbase(struct HostConf *hc)
+{
+    if (hc->statbase == NULL) {
+	if ((hc->statbase = calloc(1, sizeof(*hc->statbase))) == NULL)
+	    fatal("out of memory");
+    }
+    return(hc->statbase);
+}
+
+static void
+hc_decode_dirbase(struct HostConf *hc, struct HCLeaf *item)
+{
+    struct HCStatBase *base = hc_statbase(hc);
+    const uint8_t *p = HCC_BINARYDATA(item);
+    const uint8_t *end = (const uint8_t *)item + item->bytes;
+
+    memset(base, 0, sizeof(*base));
+    p = unpack_uint(p, end, &base->dev);
+    p = unpack_int(p, end, &base->time);
+    if (p == NULL)
+	fatal("cpdup hlink protocol error with %s", hc->host);
+}
+
+static int
+hc_decode_dirent(struct HostConf *hc, struct HCLeaf *item,
+		 struct HCDirEntry *den, struct stat *st)
+{
+    int r;
+
+    if ((r = hc_decode_packed(item, hc_statbase(hc), den, st)) < 0)
+	fatal("cpdup hlink protocol error with %s", hc->host);
+    return(r);
+}
+
 /*
  * OPENDIR
  */
@@ -438,6 +852,16 @@ hc_opendir(struct HostConf *hc, const char *path)
     if (hc == NULL || hc->host == NULL)
 	return(opendir(path));
 
+    if (hc->scan != NULL) {
+	switch(scan_opendir(hc, path)) {
+	case 1:
+	    return ((void *)hc->scan);
+	case -1:
+	    return (NULL);
+	}
+	/* not in the stream, ask for it separately */
+    }
+
     if (hc->version <= 3) { /* compatibility: HC_SCANDIR not supported */
 	struct HCLeaf *item;
 	struct HCDirEntry *den;
@@ -466,8 +890,12 @@ hc_opendir(struct HostConf *hc, const char *path)
     /* hc->version >= 4: use HC_SCANDIR */
     trans = hcc_start_command(hc, HC_SCANDIR);
     hcc_leaf_string(trans, LC_PATH1, path);
+    if (hc->inlinemax && hc->version >= HCPROTO_VERSION_INLINE)
+	hcc_leaf_int32(trans, LC_INLINE, hc->inlinemax);
     if ((head = hcc_finish_command(trans)) == NULL || head->error)
 	return (NULL);
+    if (hc->inlinemax)
+	inline_dir(hc, path);
     return ((void *)head);
 }
 
@@ -513,9 +941,13 @@ hc_readdir(struct HostConf *hc, DIR *dir, struct stat **statpp)
 	    return (NULL);
 	strncpy(denbuf.d_name, sysden->d_name, sizeof(denbuf.d_name) - 1);
 	denbuf.d_name[sizeof(denbuf.d_name) - 1] = '\0';
+	denbuf.d_ino = sysden->d_ino;
 	return (&denbuf);
     }
 
+    if (hc->scan != NULL && dir == (void *)hc->scan)
+	return (scan_readdir(hc, &denbuf, statpp));
+
     if (hc->version <= 3) { /* compatibility: HC_SCANDIR not supported */
 	hctransaction_t trans;
 	struct HCDirEntry *den;
@@ -549,11 +981,20 @@ hc_readdir(struct HostConf *hc, DIR *dir, struct stat **statpp)
 	    strncpy(denbuf.d_name, HCC_STRING(item), sizeof(denbuf.d_name) - 1);
 	    denbuf.d_name[sizeof(denbuf.d_name) - 1] = '\0';
 	    break;
+	} else if (item->leafid == LC_DIRENT) {
+	    stat_ok = hc_decode_dirent(hc, item, &denbuf, *statpp);
+	    break;
+	} else if (item->leafid == LC_DIRBASE) {
+	    hc_decode_dirbase(hc, item);
+	} else if (item->leafid == LC_DATA) {
+	    inline_data(hc, item);
 	} else {
 	    stat_ok = 1;
 	    hc_decode_stat_item(*statpp, item);
 	}
     }
+    if (hc->inlines != NULL && denbuf.d_name[0])
+	inline_entry(hc, denbuf.d_name, stat_ok ? *statpp : NULL);
     if (!stat_ok) {
 	free(*statpp);
 	*statpp = NULL;
@@ -594,6 +1035,10 @@ hc_closedir(struct HostConf *hc, DIR *dir)
     if (hc == NULL || hc->host == NULL)
 	return(closedir(dir));
 
+    /* the rest of a streamed directory is skipped by scan_opendir() */
+    if (hc->scan != NULL && dir == (void *)hc->scan)
+	return (0);
+
     if (hc->version <= 3) { /* compatibility: HC_SCANDIR not supported */
 	hctransaction_t trans;
 	struct dirent *den;
@@ -647,6 +1092,44 @@ rc_closedir(hctransaction_t trans, struct HCHead *head)
 /*
  * SCANDIR
  */
+
+/*
+ * Largest file whose contents are sent with a listing, limited to a
+ * quarter of the frame so it always fits into a packet with its entry.
+ */
+static int
+rc_inline_max(hctransaction_t trans, int bytes)
+{
+    if (bytes < 0)
+	return (0);
+    if (bytes > trans->bufsize / 4)
+	return (trans->bufsize / 4);
+    return (bytes);
+}
+
+/*
+ * Send the contents of a small regular file in an LC_DATA leaf ahead of
+ * its directory entry.  Files which cannot be read are just listed.
+ *
+ * Returns success status (boolean).
+ */
+static int
+rc_encode_inline(hctransaction_t trans, struct HCHead *head,
+		 const char *fpath, const struct stat *st, int max)
+{
+    int fd;
+
+    if (!S_ISREG(st->st_mode) || st->st_size > max)
+	return (1);
+    if (!hcc_check_space(trans, head, 1, st->st_size))
+	return (0);
+    if ((fd = open(fpath, O_RDONLY)) >= 0) {
+	hcc_leaf_read(trans, LC_DATA, fd, st->st_size);
+	close(fd);
+    }
+    return (1);
+}
+
 static int
 rc_scandir(hctransaction_t trans, struct HCHead *head)
 {
@@ -656,19 +1139,48 @@ rc_scandir(hctransaction_t trans, struct HCHead *head)
     DIR *dir;
     char *fpath;
     struct stat st;
+    struct HCStatBase base;
+    int inlinemax = 0;
+    int packed;
+    int stat_ok;
 
     FOR_EACH_ITEM(item, trans, head) {
 	if (item->leafid == LC_PATH1)
 	    path = HCC_STRING(item);
+	else if (item->leafid == LC_INLINE)
+	    inlinemax = rc_inline_max(trans, HCC_INT32(item));
     }
     if (path == NULL)
 	return (-2);
     if ((dir = opendir(path)) == NULL)
 	return (-1);
+    packed = (trans->hc->version >= HCPROTO_VERSION_PACKSTAT);
+    if (packed)
+	rc_encode_dirbase(trans, &base, dir);
     while ((den = readdir(dir)) != NULL) {
 	if (den->d_name[0] == '.' && (den->d_name[1] == '\0' ||
 		(den->d_name[1] == '.' && den->d_name[2] == '\0')))
 	    continue;	/* skip "." and ".." */
+	fpath = mprintf("%s/%s", path, den->d_name);
+	stat_ok = (lstat(fpath, &st) == 0);
+	if (stat_ok && inlinemax &&
+	    !rc_encode_inline(trans, head, fpath, &st, inlinemax)) {
+	    free(fpath);
+	    closedir(dir);
+	    return (-1);
+	}
+	if (packed) {
+	    if (!hcc_check_space(trans, head, 1,
+		    STATREC_MAX + strlen(den->d_name))) {
+		free(fpath);
+		closedir(dir);
+		return (-1);
+	    }
+	    rc_encode_packed(trans, LC_DIRENT, &base, den->d_name,
+			     (stat_ok ? &st : NULL));
+	    free(fpath);
+	    continue;
+	}
 	/*
 	 * Check if there's enough space left in the current packet.
 	 * We have at most STAT_MAX_NUM_ENTRIES pieces of data, of which
@@ -679,11 +1191,11 @@ rc_scandir(hctransaction_t trans, struct HCHead *head)
 	if (!hcc_check_space(trans, head, STAT_MAX_NUM_ENTRIES,
 		(STAT_MAX_NUM_ENTRIES - 1) * sizeof(int64_t) +
 		strlen(den->d_name) + 1)) {
+	    free(fpath);
 	    closedir(dir);
 	    return (-1);
 	}
-	fpath = mprintf("%s/%s", path, den->d_name);
-	if (lstat(fpath, &st) == 0)
+	if (stat_ok)
 	    rc_encode_stat(trans, &st);
 	/* The name must be the last item! */
 	hcc_leaf_string(trans, LC_PATH1, den->d_name);
@@ -693,408 +1205,1857 @@ rc_scandir(hctransaction_t trans, struct HCHead *head)
 }
 
 /*
- * OPEN
+ * SCANTREE
+ *
+ * Open a second connection to the host which will stream the listing of
+ * the whole tree, with stat info, as soon as the first directory is
+ * opened.  hc_opendir() then reads ahead in that stream instead of
+ * issuing a HC_SCANDIR per directory.
+ *
+ * The slave sends the directories in the order DoCopy() visits them:
+ * each directory is followed by its subdirectories in reverse order,
+ * because AddList() reverses the entries of the directory.  Listings
+ * the client does not ask for (e.g. skipped subtrees) are discarded, and
+ * asking for one out of order ends the stream, which is why cpdup does
+ * not allow -P together with -B.
  */
 int
-hc_open(struct HostConf *hc, const char *path, int flags, mode_t mode)
+hc_scantree(struct HostConf *hc)
 {
-    hctransaction_t trans;
-    struct HCHead *head;
-    struct HCLeaf *item;
-    int *fdp;
-    int desc = 0;
-    int nflags;
-
-    if (NotForRealOpt && (flags & O_CREAT))
-	return(0x7FFFFFFF);
-
-    if (hc == NULL || hc->host == NULL) {
-#ifdef O_LARGEFILE
-	flags |= O_LARGEFILE;
-#endif
-	return(open(path, flags, mode));
-    }
-
-    if ((flags & (O_WRONLY | O_RDWR)) == 0 && hc->version >= 4) {
-	trans = hcc_start_command(hc, HC_READFILE);
-	hcc_leaf_string(trans, LC_PATH1, path);
-	if ((head = hcc_finish_command(trans)) == NULL || head->error)
-	    return (-1);
-	head->magic = 0; /* used to indicate offset within buffer */
-	return (1); /* dummy */
-    }
-
-    nflags = flags & XO_NATIVEMASK;
-    if (flags & O_CREAT)
-	nflags |= XO_CREAT;
-    if (flags & O_EXCL)
-	nflags |= XO_EXCL;
-    if (flags & O_TRUNC)
-	nflags |= XO_TRUNC;
-
-    trans = hcc_start_command(hc, HC_OPEN);
-    hcc_leaf_string(trans, LC_PATH1, path);
-    hcc_leaf_int32(trans, LC_OFLAGS, nflags);
-    hcc_leaf_int32(trans, LC_MODE, mode);
+    struct HCScanTree *scan;
 
-    if ((head = hcc_finish_command(trans)) == NULL)
-	return(-1);
-    if (head->error)
+    if (hc == NULL || hc->host == NULL)
+	return(0);
+    if (hc->version < HCPROTO_VERSION_SCANTREE) {
+	errno = EOPNOTSUPP;
 	return(-1);
-    FOR_EACH_ITEM(item, trans, head) {
-	if (item->leafid == LC_DESCRIPTOR)
-	    desc = HCC_INT32(item);
     }
-    if (hcc_get_descriptor(hc, desc, HC_DESC_FD)) {
-	fprintf(stderr, "hc_open: remote reused active descriptor %d\n",
-		desc);
+    if ((scan = calloc(1, sizeof(*scan))) == NULL)
+	fatal("out of memory");
+    scan->conn.host = hc->host;
+    if (hc_connect(&scan->conn, ReadOnlyOpt) < 0) {
+	free(scan);
 	return(-1);
     }
-    fdp = malloc(sizeof(int));
-    *fdp = desc;	/* really just a dummy */
-    hcc_set_descriptor(hc, desc, fdp, HC_DESC_FD);
-    return(desc);
+    hc->scan = scan;
+    return(0);
 }
 
+/*
+ * Position the stream at the listing of <path>.  The scan is started
+ * with <path> as its root on the first call.
+ *
+ * Returns 1 if found, -1 if the slave could not read the directory
+ * (errno set), 0 if the stream has no listing for it.
+ */
 static int
-rc_open(hctransaction_t trans, struct HCHead *head)
+scan_opendir(struct HostConf *hc, const char *path)
 {
+    struct HCScanTree *scan = hc->scan;
+    hctransaction_t trans;
+    struct HCHead *head;
     struct HCLeaf *item;
-    const char *path = NULL;
-    int nflags = 0;
-    int flags;
-    mode_t mode = 0666;
-    int desc;
-    int *fdp;
-    int fd;
+    int error = 0;
 
-    FOR_EACH_ITEM(item, trans, head) {
-	switch(item->leafid) {
-	case LC_PATH1:
-	    path = HCC_STRING(item);
-	    break;
-	case LC_OFLAGS:
-	    nflags = HCC_INT32(item);
-	    break;
-	case LC_MODE:
-	    mode = HCC_INT32(item);
-	    break;
+    if (scan->state == SCAN_DONE)
+	return (0);
+    if (scan->state == SCAN_IDLE) {
+	trans = hcc_start_command(&scan->conn, HC_SCANTREE);
+	hcc_leaf_string(trans, LC_PATH1, path);
+	if (hc->inlinemax && scan->conn.version >= HCPROTO_VERSION_INLINE)
+	    hcc_leaf_int32(trans, LC_INLINE, hc->inlinemax);
+	if ((head = hcc_finish_command(trans)) == NULL || head->error) {
+	    scan->state = SCAN_DONE;
+	    return (0);
 	}
+	scan->state = SCAN_RUNNING;
+	scan->atheader = 0;
     }
-    if (path == NULL)
-	return(-2);
 
-    flags = nflags & XO_NATIVEMASK;
-    if (nflags & XO_CREAT)
-	flags |= O_CREAT;
-    if (nflags & XO_EXCL)
+    head = (void *)scan->conn.trans.rbuf;
+    if (scan->atheader)
+	item = hcc_currentchaineditem(&scan->conn, head);
+    else
+	item = hcc_nextchaineditem(&scan->conn, head);
+    scan->atheader = 0;
+    for (; item != NULL; item = hcc_nextchaineditem(&scan->conn, head)) {
+	if (item->leafid == LC_ERRNO) {
+	    error = HCC_INT32(item);
+	} else if (item->leafid == LC_PATH2) {
+	    if (strcmp(HCC_STRING(item), path) == 0) {
+		if (error) {
+		    errno = error;
+		    return (-1);
+		}
+		if (hc->inlinemax)
+		    inline_dir(hc, path);
+		return (1);
+	    }
+	    error = 0;
+	}
+    }
+    scan->state = SCAN_DONE;
+    return (0);
+}
+
+static struct HCDirEntry *
+scan_readdir(struct HostConf *hc, struct HCDirEntry *den,
+	     struct stat **statpp)
+{
+    struct HCScanTree *scan = hc->scan;
+    struct HCHead *head = (void *)scan->conn.trans.rbuf;
+    struct HCLeaf *item;
+    int stat_ok = 0;
+
+    *statpp = malloc(sizeof(struct stat));
+    memset(*statpp, 0, sizeof(struct stat));
+    while ((item = hcc_nextchaineditem(&scan->conn, head)) != NULL) {
+	switch(item->leafid) {
+	case LC_PATH1:	/* this must be the last item of an entry */
+	    strncpy(den->d_name, HCC_STRING(item), sizeof(den->d_name) - 1);
+	    den->d_name[sizeof(den->d_name) - 1] = '\0';
+	    if (!stat_ok) {
+		free(*statpp);
+		*statpp = NULL;
+	    }
+	    if (hc->inlines != NULL)
+		inline_entry(hc, den->d_name, *statpp);
+	    return (den);
+	case LC_DIRENT:
+	    if (!hc_decode_dirent(&scan->conn, item, den, *statpp)) {
+		free(*statpp);
+		*statpp = NULL;
+	    }
+	    if (hc->inlines != NULL)
+		inline_entry(hc, den->d_name, *statpp);
+	    return (den);
+	case LC_DIRBASE:
+	    hc_decode_dirbase(&scan->conn, item);
+	    break;
+	case LC_DATA:
+	    inline_data(hc, item);
+	    break;
+	case LC_ERRNO:
+	case LC_PATH2:	/* start of the next directory */
+	    scan->atheader = 1;
+	    free(*statpp);
+	    *statpp = NULL;
+	    return (NULL);
+	default:
+	    stat_ok = 1;
+	    hc_decode_stat_item(*statpp, item);
+	    break;
+	}
+    }
+    scan->state = SCAN_DONE;
+    free(*statpp);
+    *statpp = NULL;
+    return (NULL);
+}
+
+struct scantree_info {
+    hctransaction_t trans;
+    struct HCHead *head;
+    dev_t dev;			/* do not descend into other devices */
+    int inlinemax;		/* send contents of files up to this size */
+    int failed;			/* lost the connection */
+};
+
+/*
+ * Read the patterns of a relative exclusion file, the way ScanDir()
+ * does, so excluded subdirectories need not be streamed.
+ */
+static char **
+scantree_excludes(const char *path, int *countp)
+{
+    char **pats = NULL;
+    char *fpath;
+    char buf[1024];
+    FILE *fp;
+    int count = 0;
+    int len;
+
+    *countp = 0;
+    if (UseCpFile == NULL || UseCpFile[0] == '/')
+	return (NULL);
+    fpath = mprintf("%s/%s", path, UseCpFile);
+    fp = fopen(fpath, "r");
+    free(fpath);
+    if (fp == NULL)
+	return (NULL);
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+	len = strlen(buf);
+	if (len && buf[len - 1] == '\n')
+	    buf[--len] = 0;
+	pats = realloc(pats, (count + 1) * sizeof(char *));
+	if (pats == NULL)
+	    fatal("out of memory");
+	pats[count++] = strdup(buf);
+    }
+    fclose(fp);
+    *countp = count;
+    return (pats);
+}
+
+static void
+scantree_dir(struct scantree_info *info, const char *path)
+{
+    hctransaction_t trans = info->trans;
+    struct dirent *den;
+    struct stat st;
+    struct HCStatBase base;
+    char **subdirs = NULL;
+    char **pats;
+    char *fpath;
+    DIR *dir;
+    int packed;
+    int stat_ok;
+    int npats;
+    int count = 0;
+    int i;
+
+    if ((dir = opendir(path)) == NULL) {
+	if (!hcc_check_space(trans, info->head, 2,
+			     sizeof(int32_t) + strlen(path) + 1)) {
+	    info->failed = 1;
+	    return;
+	}
+	hcc_leaf_int32(trans, LC_ERRNO, errno);
+	hcc_leaf_string(trans, LC_PATH2, path);
+	return;
+    }
+    if (!hcc_check_space(trans, info->head, 2, strlen(path) + 1 + 2 * 10)) {
+	closedir(dir);
+	info->failed = 1;
+	return;
+    }
+    hcc_leaf_string(trans, LC_PATH2, path);
+    packed = (trans->hc->version >= HCPROTO_VERSION_PACKSTAT);
+    if (packed)
+	rc_encode_dirbase(trans, &base, dir);
+
+    pats = scantree_excludes(path, &npats);
+    while ((den = readdir(dir)) != NULL) {
+	if (den->d_name[0] == '.' && (den->d_name[1] == '\0' ||
+		(den->d_name[1] == '.' && den->d_name[2] == '\0')))
+	    continue;	/* skip "." and ".." */
+	fpath = mprintf("%s/%s", path, den->d_name);
+	stat_ok = (lstat(fpath, &st) == 0);
+	if (stat_ok && info->inlinemax &&
+	    !rc_encode_inline(trans, info->head, fpath, &st, info->inlinemax)) {
+	    free(fpath);
+	    info->failed = 1;
+	    break;
+	}
+	/* see rc_scandir() */
+	if (packed ?
+	    !hcc_check_space(trans, info->head, 1,
+		STATREC_MAX + strlen(den->d_name)) :
+	    !hcc_check_space(trans, info->head, STAT_MAX_NUM_ENTRIES,
+		(STAT_MAX_NUM_ENTRIES - 1) * sizeof(int64_t) +
+		strlen(den->d_name) + 1)) {
+	    free(fpath);
+	    info->failed = 1;
+	    break;
+	}
+	if (packed) {
+	    rc_encode_packed(trans, LC_DIRENT, &base, den->d_name,
+			     (stat_ok ? &st : NULL));
+	} else {
+	    if (stat_ok)
+		rc_encode_stat(trans, &st);
+	    /* The name must be the last item! */
+	    hcc_leaf_string(trans, LC_PATH1, den->d_name);
+	}
+	if (stat_ok && S_ISDIR(st.st_mode) && st.st_dev == info->dev) {
+	    for (i = 0; i < npats; ++i) {
+		if (strcmp(pats[i], den->d_name) == 0 ||
+		    fnmatch(pats[i], den->d_name, 0) == 0)
+		    break;
+	    }
+	    if (i == npats) {
+		subdirs = realloc(subdirs, (count + 1) * sizeof(char *));
+		if (subdirs == NULL)
+		    fatal("out of memory");
+		subdirs[count++] = fpath;
+		fpath = NULL;
+	    }
+	}
+	free(fpath);
+    }
+    closedir(dir);
+    for (i = 0; i < npats; ++i)
+	free(pats[i]);
+    free(pats);
+
+    /* DoCopy() visits the subdirectories in reverse order */
+    while (count > 0) {
+	--count;
+	if (!info->failed)
+	    scantree_dir(info, subdirs[count]);
+	free(subdirs[count]);
+    }
+    free(subdirs);
+}
+
+static int
+rc_scantree(hctransaction_t trans, struct HCHead *head)
+{
+    struct HCLeaf *item;
+    struct scantree_info info;
+    const char *path = NULL;
+    struct stat st;
+
+    memset(&info, 0, sizeof(info));
+    FOR_EACH_ITEM(item, trans, head) {
+	if (item->leafid == LC_PATH1)
+	    path = HCC_STRING(item);
+	else if (item->leafid == LC_INLINE)
+	    info.inlinemax = rc_inline_max(trans, HCC_INT32(item));
+    }
+    if (path == NULL)
+	return (-2);
+    if (lstat(path, &st) < 0)
+	return (-1);
+    info.trans = trans;
+    info.head = head;
+    info.dev = st.st_dev;
+    scantree_dir(&info, path);
+    return (info.failed ? -1 : 0);
+}
+
+/*
+ * INLINE
+ *
+ * With hc->inlinemax set, HC_SCANDIR and HC_SCANTREE ask the slave to
+ * send the contents of regular files up to that size ahead of their
+ * directory entries.  hc_readdir() keeps them for a while and hc_open()
+ * serves reads of such a file from memory, saving the round trip of a
+ * HC_READFILE.  When the cache grows past INLINE_CACHE bytes the oldest
+ * contents are dropped; their files are fetched as usual if needed.
+ */
+struct HCInline {
+    struct HCInline *next;	/* in arrival order */
+    struct HCInline *prev;
+    struct HCInline *hnext;	/* hash chain */
+    char	*path;
+    int		offset;		/* read position once opened */
+    int		bytes;		/* followed by the contents */
+};
+
+#define INLINE_CACHE	(8 * 1024 * 1024)
+#define INLINE_HSIZE	1024
+#define INLINE_FD	0x40000000	/* pseudo descriptors start here */
+
+struct HCInlineCache {
+    struct HCInline *hash[INLINE_HSIZE];
+    struct HCInline list;	/* head of the arrival order list */
+    struct HCInline *pending;	/* contents for the next entry */
+    char	*dir;		/* directory being listed */
+    int		bytes;
+    int		nextfd;
+};
+
+static int
+inline_hash(const char *path)
+{
+    unsigned int hv = 0;
+
+    while (*path)
+	hv = hv * 33 + (unsigned char)*path++;
+    return (hv % INLINE_HSIZE);
+}
+
+static void
+inline_free(struct HCInline *ent)
+{
+    if (ent != NULL) {
+	free(ent->path);
+	free(ent);
+    }
+}
+
+static void
+inline_remove(struct HCInlineCache *cache, struct HCInline *ent)
+{
+    struct HCInline **entp;
+
+    entp = &cache->hash[inline_hash(ent->path)];
+    while (*entp != ent)
+	entp = &(*entp)->hnext;
+    *entp = ent->hnext;
+    ent->prev->next = ent->next;
+    ent->next->prev = ent->prev;
+    cache->bytes -= ent->bytes;
+}
+
+static struct HCInline *
+inline_lookup(struct HCInlineCache *cache, const char *path)
+{
+    struct HCInline *ent;
+
+    for (ent = cache->hash[inline_hash(path)]; ent; ent = ent->hnext) {
+	if (strcmp(ent->path, path) == 0)
+	    break;
+    }
+    return (ent);
+}
+
+static struct HCInlineCache *
+inline_cache(struct HostConf *hc)
+{
+    struct HCInlineCache *cache;
+
+    if ((cache = hc->inlines) == NULL) {
+	if ((cache = calloc(1, sizeof(*cache))) == NULL)
+	    fatal("out of memory");
+	cache->list.next = &cache->list;
+	cache->list.prev = &cache->list;
+	hc->inlines = cache;
+    }
+    return (cache);
+}
+
+/*
+ * Hand the contents <ent> over to a new pseudo descriptor, which
+ * hc_read() and hc_close() recognize.
+ */
+static int
+inline_fd(struct HostConf *hc, struct HCInline *ent)
+{
+    struct HCInlineCache *cache = inline_cache(hc);
+    int fd;
+
+    ent->offset = 0;
+    fd = INLINE_FD + (cache->nextfd++ & (INLINE_FD - 1));
+    hcc_set_descriptor(hc, fd, ent, HC_DESC_INLINE);
+    return (fd);
+}
+
+/*
+ * A listing of <path> starts, the following entries are relative to it.
+ */
+static void
+inline_dir(struct HostConf *hc, const char *path)
+{
+    struct HCInlineCache *cache = inline_cache(hc);
+
+    inline_free(cache->pending);
+    cache->pending = NULL;
+    free(cache->dir);
+    cache->dir = strdup(path);
+}
+
+/*
+ * Contents of the next entry.  Copy them, the receive buffer is reused
+ * if the entry is in the next packet.
+ */
+static void
+inline_data(struct HostConf *hc, struct HCLeaf *item)
+{
+    struct HCInlineCache *cache;
+    struct HCInline *ent;
+    int bytes = item->bytes - sizeof(*item);
+
+    if ((cache = hc->inlines) == NULL)
+	return;
+    inline_free(cache->pending);
+    if ((ent = malloc(sizeof(*ent) + bytes)) == NULL)
+	fatal("out of memory");
+    ent->path = NULL;
+    ent->bytes = bytes;
+    ent->offset = 0;
+    memcpy(ent + 1, HCC_BINARYDATA(item), bytes);
+    cache->pending = ent;
+}
+
+/*
+ * The entry <name> completed.  Keep the contents received for it if it
+ * is a regular file of that size, i.e. if it was read completely.
+ */
+static void
+inline_entry(struct HostConf *hc, const char *name, const struct stat *st)
+{
+    struct HCInlineCache *cache = hc->inlines;
+    struct HCInline *ent;
+    struct HCInline *old;
+    int hv;
+
+    if ((ent = cache->pending) == NULL)
+	return;
+    cache->pending = NULL;
+    if (st == NULL || !S_ISREG(st->st_mode) || st->st_size != ent->bytes ||
+	cache->dir == NULL) {
+	inline_free(ent);
+	return;
+    }
+    ent->path = mprintf("%s/%s", cache->dir, name);
+    if ((old = inline_lookup(cache, ent->path)) != NULL) {
+	inline_remove(cache, old);
+	inline_free(old);
+    }
+    hv = inline_hash(ent->path);
+    ent->hnext = cache->hash[hv];
+    cache->hash[hv] = ent;
+    ent->prev = cache->list.prev;
+    ent->next = &cache->list;
+    ent->prev->next = ent;
+    cache->list.prev = ent;
+    cache->bytes += ent->bytes;
+
+    while (cache->bytes > INLINE_CACHE) {
+	old = cache->list.next;
+	inline_remove(cache, old);
+	inline_free(old);
+    }
+}
+
+/*
+ * Open <path> for reading from the cache.
+ *
+ * Returns a pseudo descriptor, or -1 if <path> is not cached.
+ */
+static int
+inline_open(struct HostConf *hc, const char *path)
+{
+    struct HCInline *ent;
+
+    if ((ent = inline_lookup(hc->inlines, path)) == NULL)
+	return (-1);
+    inline_remove(hc->inlines, ent);
+    return (inline_fd(hc, ent));
+}
+
+/*
+ * PREFETCH
+ *
+ * HC_READFILE fetches a file only when DoCopy() opens it, so the link
+ * idles while the previous file is written to the target.  With
+ * hc_prefetch_start() a thread reads the files DoCopy() is expected to
+ * copy next over a second connection to the host, at most <ahead> files
+ * and PREFETCH_BUDGET bytes in advance.  hc_open() takes a file from
+ * there if it was read ahead, waiting for it if it is in transit.
+ *
+ * The files are queued with hc_prefetch() in the order DoCopy() will
+ * open them.  hc_prefetch_begin() starts the list of a directory, which
+ * goes ahead of what is left of the parent directory.  Files passed by
+ * an hc_open() further down the queue were not copied after all and are
+ * dropped, and DoCopy() drops each file it is done with through
+ * hc_prefetch_drop(), whether it opened it or not.
+ */
+struct HCPrefetchFile {
+    struct HCPrefetchFile *next;
+    enum { PF_QUEUED, PF_READING, PF_DONE, PF_FAILED } state;
+    int		dropped;	/* no longer queued, the reader frees it */
+    off_t	size;
+    struct HCInline *data;	/* contents once PF_DONE */
+    char	path[];
+};
+
+struct HCPrefetch {
+    struct HostConf conn;	/* connection for the reader thread */
+    pthread_t	thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct HCPrefetchFile *first;	/* in the order of hc_open() */
+    struct HCPrefetchFile **insp;	/* hc_prefetch() inserts here */
+    int		ahead;		/* files read in advance, at most */
+    int64_t	bytes;		/* bytes read in advance */
+};
+
+#define PREFETCH_BUDGET	(32 * 1024 * 1024)
+#define PREFETCH_FILE	(PREFETCH_BUDGET / 4)	/* largest file read ahead */
+
+/*
+ * Read <pf> over the reader's connection.  Fails if the file grew since
+ * it was listed, DoCopy() then reads it itself.
+ */
+static struct HCInline *
+prefetch_read(struct HostConf *conn, struct HCPrefetchFile *pf)
+{
+    struct HCInline *ent;
+    int bytes = 0;
+    int fd;
+    int n;
+
+    if ((fd = hc_open(conn, pf->path, O_RDONLY, 0)) < 0)
+	return (NULL);
+    if ((ent = malloc(sizeof(*ent) + pf->size + 1)) == NULL)
+	fatal("out of memory");
+    while (bytes <= pf->size &&
+	   (n = hc_read(conn, fd, (char *)(ent + 1) + bytes,
+			pf->size + 1 - bytes)) > 0) {
+	bytes += n;
+    }
+    if (hc_close(conn, fd) < 0 || bytes > pf->size) {
+	free(ent);
+	return (NULL);
+    }
+    ent->path = NULL;
+    ent->bytes = bytes;
+    return (ent);
+}
+
+static void *
+prefetch_thread(void *arg)
+{
+    struct HCPrefetch *prefetch = arg;
+    struct HCPrefetchFile *pf;
+    struct HCInline *ent;
+    int i;
+
+    pthread_mutex_lock(&prefetch->lock);
+    for (;;) {
+	/* the first file within reach not read yet */
+	for (pf = prefetch->first, i = 0; pf && i < prefetch->ahead;
+	     pf = pf->next, ++i) {
+	    if (pf->state == PF_QUEUED)
+		break;
+	}
+	if (pf == NULL || i == prefetch->ahead ||
+	    prefetch->bytes + pf->size > PREFETCH_BUDGET) {
+	    pthread_cond_wait(&prefetch->cond, &prefetch->lock);
+	    continue;
+	}
+	pf->state = PF_READING;
+	prefetch->bytes += pf->size;
+	pthread_mutex_unlock(&prefetch->lock);
+
+	ent = prefetch_read(&prefetch->conn, pf);
+
+	pthread_mutex_lock(&prefetch->lock);
+	if (pf->dropped) {
+	    prefetch->bytes -= pf->size;
+	    inline_free(ent);
+	    free(pf);
+	} else if (ent == NULL) {
+	    prefetch->bytes -= pf->size;
+	    pf->state = PF_FAILED;
+	} else {
+	    pf->data = ent;
+	    pf->state = PF_DONE;
+	}
+	pthread_cond_broadcast(&prefetch->cond);
+    }
+    /* not reached */
+    return (NULL);
+}
+
+/*
+ * Open the reader's connection and start it.  <ahead> is the number of
+ * files to read in advance.
+ */
+int
+hc_prefetch_start(struct HostConf *hc, int ahead)
+{
+    struct HCPrefetch *prefetch;
+
+    if (hc == NULL || hc->host == NULL || ahead <= 0)
+	return(0);
+    if (hc->version < 4) {	/* no HC_READFILE */
+	errno = EOPNOTSUPP;
+	return(-1);
+    }
+    if ((prefetch = calloc(1, sizeof(*prefetch))) == NULL)
+	fatal("out of memory");
+    prefetch->conn.host = hc->host;
+    if (hc_connect(&prefetch->conn, ReadOnlyOpt) < 0) {
+	free(prefetch);
+	return(-1);
+    }
+    prefetch->insp = &prefetch->first;
+    prefetch->ahead = ahead;
+    pthread_mutex_init(&prefetch->lock, NULL);
+    pthread_cond_init(&prefetch->cond, NULL);
+    if ((errno = pthread_create(&prefetch->thread, NULL,
+				prefetch_thread, prefetch)) != 0) {
+	fatal("cannot create prefetch thread: %s", strerror(errno));
+    }
+    pthread_detach(prefetch->thread);
+    hc->prefetch = prefetch;
+    return(0);
+}
+
+/*
+ * Start the files of a directory, they are opened before the rest of
+ * the queue.
+ */
+void
+hc_prefetch_begin(struct HostConf *hc)
+{
+    struct HCPrefetch *prefetch;
+
+    if (hc == NULL || (prefetch = hc->prefetch) == NULL)
+	return;
+    pthread_mutex_lock(&prefetch->lock);
+    prefetch->insp = &prefetch->first;
+    pthread_mutex_unlock(&prefetch->lock);
+}
+
+/*
+ * <path> of <size> bytes is expected to be opened next.
+ */
+void
+hc_prefetch(struct HostConf *hc, const char *path, off_t size)
+{
+    struct HCPrefetch *prefetch;
+    struct HCPrefetchFile *pf;
+
+    if (hc == NULL || (prefetch = hc->prefetch) == NULL)
+	return;
+    if (size > PREFETCH_FILE)
+	return;
+    if (hc->inlines != NULL && inline_lookup(hc->inlines, path) != NULL)
+	return;			/* came with the listing */
+    if ((pf = calloc(1, sizeof(*pf) + strlen(path) + 1)) == NULL)
+	fatal("out of memory");
+    strcpy(pf->path, path);
+    pf->size = size;
+    pthread_mutex_lock(&prefetch->lock);
+    pf->next = *prefetch->insp;
+    *prefetch->insp = pf;
+    prefetch->insp = &pf->next;
+    pthread_cond_broadcast(&prefetch->cond);
+    pthread_mutex_unlock(&prefetch->lock);
+}
+
+/*
+ * Remove the head of the queue.  Called with the lock held.
+ */
+static struct HCPrefetchFile *
+prefetch_unqueue(struct HCPrefetch *prefetch)
+{
+    struct HCPrefetchFile *pf = prefetch->first;
+
+    if (prefetch->insp == &pf->next)
+	prefetch->insp = &prefetch->first;
+    prefetch->first = pf->next;
+    return (pf);
+}
+
+/*
+ * Take <path> off the queue, together with the files queued before it,
+ * which were not opened after all.  Called with the lock held.  Returns
+ * NULL if <path> is not among the next <ahead> files.
+ */
+static struct HCPrefetchFile *
+prefetch_take(struct HCPrefetch *prefetch, const char *path)
+{
+    struct HCPrefetchFile *pf;
+    int i;
+
+    for (pf = prefetch->first, i = 0; pf && i < prefetch->ahead;
+	 pf = pf->next, ++i) {
+	if (strcmp(pf->path, path) == 0)
+	    break;
+    }
+    if (pf == NULL || i == prefetch->ahead)
+	return (NULL);
+
+    while (strcmp((pf = prefetch_unqueue(prefetch))->path, path) != 0) {
+	if (pf->state == PF_READING) {
+	    pf->dropped = 1;
+	    continue;
+	}
+	if (pf->state == PF_DONE) {
+	    prefetch->bytes -= pf->size;
+	    inline_free(pf->data);
+	}
+	free(pf);
+    }
+    return (pf);
+}
+
+/*
+ * Open <path> for reading if it is in the queue.
+ *
+ * Returns a pseudo descriptor (see inline_fd()), or -1 if <path> was not
+ * read ahead.
+ */
+static int
+prefetch_open(struct HostConf *hc, const char *path)
+{
+    struct HCPrefetch *prefetch = hc->prefetch;
+    struct HCPrefetchFile *pf;
+    struct HCInline *ent = NULL;
+
+    pthread_mutex_lock(&prefetch->lock);
+    if ((pf = prefetch_take(prefetch, path)) == NULL) {
+	pthread_mutex_unlock(&prefetch->lock);
+	return (-1);
+    }
+    while (pf->state == PF_READING)
+	pthread_cond_wait(&prefetch->cond, &prefetch->lock);
+    if (pf->state == PF_DONE) {
+	prefetch->bytes -= pf->size;
+	ent = pf->data;
+    }
+    free(pf);
+    pthread_cond_broadcast(&prefetch->cond);
+    pthread_mutex_unlock(&prefetch->lock);
+
+    return (ent ? inline_fd(hc, ent) : -1);
+}
+
+/*
+ * DoCopy() is done with <path> without opening it (it was linked,
+ * renamed, found to be the same, ...), or read it itself.  Drop it from
+ * the queue, so it neither holds on to the read ahead budget nor keeps
+ * the files after it out of reach.
+ */
+void
+hc_prefetch_drop(struct HostConf *hc, const char *path)
+{
+    struct HCPrefetch *prefetch;
+    struct HCPrefetchFile *pf;
+
+    if (hc == NULL || (prefetch = hc->prefetch) == NULL)
+	return;
+    pthread_mutex_lock(&prefetch->lock);
+    if ((pf = prefetch_take(prefetch, path)) != NULL) {
+	if (pf->state == PF_READING) {
+	    pf->dropped = 1;
+	} else {
+	    if (pf->state == PF_DONE) {
+		prefetch->bytes -= pf->size;
+		inline_free(pf->data);
+	    }
+	    free(pf);
+	}
+	pthread_cond_broadcast(&prefetch->cond);
+    }
+    pthread_mutex_unlock(&prefetch->lock);
+}
+
+/*
+ * OPEN
+ */
+int
+hc_open(struct HostConf *hc, const char *path, int flags, mode_t mode)
+{
+    hctransaction_t trans;
+    struct HCHead *head;
+    struct HCLeaf *item;
+    int *fdp;
+    int desc = 0;
+    int nflags;
+
+    if (NotForRealOpt && (flags & O_CREAT))
+	return(0x7FFFFFFF);
+
+    if (hc == NULL || hc->host == NULL) {
+#ifdef O_LARGEFILE
+	flags |= O_LARGEFILE;
+#endif
+	return(open(path, flags, mode));
+    }
+
+    if ((flags & (O_WRONLY | O_RDWR)) == 0 && hc->inlines != NULL &&
+	(desc = inline_open(hc, path)) >= 0) {
+	return (desc);
+    }
+    if ((flags & (O_WRONLY | O_RDWR)) == 0 && hc->prefetch != NULL &&
+	(desc = prefetch_open(hc, path)) >= 0) {
+	return (desc);
+    }
+
+    if ((flags & (O_WRONLY | O_RDWR)) == 0 && hc->version >= 4) {
+	trans = hcc_start_command(hc, HC_READFILE);
+	hcc_leaf_string(trans, LC_PATH1, path);
+	if ((head = hcc_finish_command(trans)) == NULL || head->error)
+	    return (-1);
+	head->magic = 0; /* used to indicate offset within buffer */
+	return (1); /* dummy */
+    }
+
+    nflags = flags & XO_NATIVEMASK;
+    if (flags & O_CREAT)
+	nflags |= XO_CREAT;
+    if (flags & O_EXCL)
+	nflags |= XO_EXCL;
+    if (flags & O_TRUNC)
+	nflags |= XO_TRUNC;
+
+    trans = hcc_start_command(hc, HC_OPEN);
+    hcc_leaf_string(trans, LC_PATH1, path);
+    hcc_leaf_int32(trans, LC_OFLAGS, nflags);
+    hcc_leaf_int32(trans, LC_MODE, mode);
+
+    if ((head = hcc_finish_command(trans)) == NULL)
+	return(-1);
+    if (head->error)
+	return(-1);
+    FOR_EACH_ITEM(item, trans, head) {
+	if (item->leafid == LC_DESCRIPTOR)
+	    desc = HCC_INT32(item);
+    }
+    if (hcc_get_descriptor(hc, desc, HC_DESC_FD)) {
+	fprintf(stderr, "hc_open: remote reused active descriptor %d\n",
+		desc);
+	return(-1);
+    }
+    fdp = malloc(sizeof(int));
+    *fdp = desc;	/* really just a dummy */
+    hcc_set_descriptor(hc, desc, fdp, HC_DESC_FD);
+    return(desc);
+}
+
+/*
+ * Open <path> for reading <length> bytes from <offset> on.  The data is
+ * read with hc_read() and the descriptor closed with hc_close(), like
+ * one returned by hc_open().  Locally the caller must stop reading after
+ * <length> bytes.
+ */
+int
+hc_openrange(struct HostConf *hc, const char *path, off_t offset,
+	     off_t length)
+{
+    hctransaction_t trans;
+    struct HCHead *head;
+    int fd;
+
+    if (hc == NULL || hc->host == NULL) {
+	if ((fd = hc_open(hc, path, O_RDONLY, 0)) < 0)
+	    return(-1);
+	if (lseek(fd, offset, SEEK_SET) < 0) {
+	    close(fd);
+	    return(-1);
+	}
+	return(fd);
+    }
+    if (hc->version < HCPROTO_VERSION_RANGES) {
+	errno = EOPNOTSUPP;
+	return(-1);
+    }
+    trans = hcc_start_command(hc, HC_READFILE);
+    hcc_leaf_string(trans, LC_PATH1, path);
+    hcc_leaf_int64(trans, LC_OFFSET, offset);
+    hcc_leaf_int64(trans, LC_LENGTH, length);
+    if ((head = hcc_finish_command(trans)) == NULL || head->error)
+	return (-1);
+    head->magic = 0; /* used to indicate offset within buffer */
+    return (1); /* dummy, see hc_read() */
+}
+
+static int
+rc_open(hctransaction_t trans, struct HCHead *head)
+{
+    struct HCLeaf *item;
+    const char *path = NULL;
+    int nflags = 0;
+    int flags;
+    mode_t mode = 0666;
+    int desc;
+    int *fdp;
+    int fd;
+
+    FOR_EACH_ITEM(item, trans, head) {
+	switch(item->leafid) {
+	case LC_PATH1:
+	    path = HCC_STRING(item);
+	    break;
+	case LC_OFLAGS:
+	    nflags = HCC_INT32(item);
+	    break;
+	case LC_MODE:
+	    mode = HCC_INT32(item);
+	    break;
+	}
+    }
+    if (path == NULL)
+	return(-2);
+
+    flags = nflags & XO_NATIVEMASK;
+    if (nflags & XO_CREAT)
+	flags |= O_CREAT;
+    if (nflags & XO_EXCL)
 	flags |= O_EXCL;
     if (nflags & XO_TRUNC)
 	flags |= O_TRUNC;
 
-    if (ReadOnlyOpt) {
-	if (flags & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC)) {
-	    head->error = EACCES;
-	    return (0);
+    if (ReadOnlyOpt) {
+	if (flags & (O_WRONLY | O_RDWR | O_CREAT | O_TRUNC)) {
+	    head->error = EACCES;
+	    return (0);
+	}
+	flags |= O_RDONLY;
+    }
+
+#ifdef O_LARGEFILE
+    flags |= O_LARGEFILE;
+#endif
+    if ((fd = open(path, flags, mode)) < 0)
+	return(-1);
+    fdp = malloc(sizeof(int));
+    *fdp = fd;
+    desc = hcc_alloc_descriptor(trans->hc, fdp, HC_DESC_FD);
+    hcc_leaf_int32(trans, LC_DESCRIPTOR, desc);
+    return(0);
+}
+
+/*
+ * CLOSE
+ */
+int
+hc_close(struct HostConf *hc, int fd)
+{
+    hctransaction_t trans;
+    struct HCHead *head;
+    struct HCInline *ent;
+    int *fdp;
+
+    if (NotForRealOpt && fd == 0x7FFFFFFF)
+	return(0);
+    if (hc == NULL || hc->host == NULL)
+	return(close(fd));
+
+    if (fd >= INLINE_FD &&
+	(ent = hcc_get_descriptor(hc, fd, HC_DESC_INLINE)) != NULL) {
+	hcc_set_descriptor(hc, fd, NULL, HC_DESC_INLINE);
+	inline_free(ent);
+	return (0);
+    }
+
+    if (fd == 1 && hc->version >= 4) {	/* using HC_READFILE */
+	head = (void *)hc->trans.rbuf;
+	/* skip any remaining items if the file is closed prematurely */
+	while (hcc_nextchaineditem(hc, head) != NULL)
+	    /*nothing*/ ;
+	if (hc->trans.state == HCT_FAIL || head->error)
+	    return (-1);
+	return (0);
+    }
+
+    fdp = hcc_get_descriptor(hc, fd, HC_DESC_FD);
+    if (fdp) {
+	free(fdp);
+	hcc_set_descriptor(hc, fd, NULL, HC_DESC_FD);
+
+	trans = hcc_start_command(hc, HC_CLOSE);
+	hcc_leaf_int32(trans, LC_DESCRIPTOR, fd);
+	if ((head = hcc_finish_command(trans)) == NULL)
+	    return(-1);
+	if (head->error)
+	    return(-1);
+	return(0);
+    } else {
+	return(-1);
+    }
+}
+
+static int
+rc_close(hctransaction_t trans, struct HCHead *head)
+{
+    struct HCLeaf *item;
+    int *fdp = NULL;
+    int fd;
+    int desc = -1;
+
+    FOR_EACH_ITEM(item, trans, head) {
+	if (item->leafid == LC_DESCRIPTOR)
+	    desc = HCC_INT32(item);
+    }
+    if (desc < 0)
+	return(-2);
+    if ((fdp = hcc_get_descriptor(trans->hc, desc, HC_DESC_FD)) == NULL)
+	return(-2);
+    fd = *fdp;
+    free(fdp);
+    hcc_set_descriptor(trans->hc, desc, NULL, HC_DESC_FD);
+    return(close(fd));
+}
+
+/*
+ * Largest data payload of a single READ, WRITE or READFILE packet,
+ * half of the agreed on frame size.
+ */
+static int
+getiolimit(hctransaction_t trans)
+{
+    return(trans->bufsize / 2);
+}
+
+/*
+ * READ
+ */
+ssize_t
+hc_read(struct HostConf *hc, int fd, void *buf, size_t bytes)
+{
+    hctransaction_t trans;
+    struct HCHead *head;
+    struct HCLeaf *item;
+    struct HCInline *ent;
+    int *fdp;
+    int offset;
+    int r = 0;
+    int x = 0;
+
+    if (hc == NULL || hc->host == NULL)
+	return(read(fd, buf, bytes));
+
+    if (fd >= INLINE_FD &&
+	(ent = hcc_get_descriptor(hc, fd, HC_DESC_INLINE)) != NULL) {
+	if (bytes > (size_t)(ent->bytes - ent->offset))
+	    bytes = ent->bytes - ent->offset;
+	memcpy(buf, (char *)(ent + 1) + ent->offset, bytes);
+	ent->offset += bytes;
+	return (bytes);
+    }
+
+    if (fd == 1 && hc->version >= 4) {	/* using HC_READFILE */
+	head = (void *)hc->trans.rbuf;
+	while (bytes) {
+	    if ((offset = head->magic) != 0) {
+		item = hcc_currentchaineditem(hc, head);
+	    } else {
+		item = hcc_nextchaineditem(hc, head);
+	    }
+	    if (item == NULL) {
+		if (hc->trans.state == HCT_FAIL)
+			r = -1;
+		return (r);
+	    }
+	    if (item->leafid != LC_DATA)
+		return (-1);
+	    x = item->bytes - sizeof(*item) - offset;
+	    if (x > (int)bytes) {
+		x = (int)bytes;
+		/* leave bytes in the buffer, a new packet starts at 0 */
+		head->magic = offset + x;
+	    }
+	    else
+		head->magic = 0;  /* all bytes used up */
+	    memcpy(buf, (char *)HCC_BINARYDATA(item) + offset, x);
+	    buf = (char *)buf + x;
+	    bytes -= (size_t)x;
+	    r += x;
+	}
+	return (r);
+    }
+
+    fdp = hcc_get_descriptor(hc, fd, HC_DESC_FD);
+    if (fdp) {
+	while (bytes) {
+	    size_t limit = getiolimit(&hc->trans);
+	    int n = (bytes > limit) ? limit : bytes;
+
+	    trans = hcc_start_command(hc, HC_READ);
+	    hcc_leaf_int32(trans, LC_DESCRIPTOR, fd);
+	    hcc_leaf_int32(trans, LC_BYTES, n);
+	    if ((head = hcc_finish_command(trans)) == NULL)
+		return(-1);
+	    if (head->error)
+		return(-1);
+	    FOR_EACH_ITEM(item, trans, head) {
+		if (item->leafid == LC_DATA) {
+		    x = item->bytes - sizeof(*item);
+		    if (x > (int)bytes)
+			x = (int)bytes;
+		    memcpy(buf, HCC_BINARYDATA(item), x);
+		    buf = (char *)buf + x;
+		    bytes -= (size_t)x;
+		    r += x;
+		}
+	    }
+	    if (x < n)
+		break;
+	}
+	return(r);
+    } else {
+	return(-1);
+    }
+}
+
+static int
+rc_read(hctransaction_t trans, struct HCHead *head)
+{
+    struct HCLeaf *item;
+    int *fdp = NULL;
+    int bytes = -1;
+
+    FOR_EACH_ITEM(item, trans, head) {
+	switch(item->leafid) {
+	case LC_DESCRIPTOR:
+	    fdp = hcc_get_descriptor(trans->hc, HCC_INT32(item), HC_DESC_FD);
+	    break;
+	case LC_BYTES:
+	    bytes = HCC_INT32(item);
+	    break;
+	}
+    }
+    if (fdp == NULL)
+	return(-2);
+    if (bytes < 0 || bytes > getiolimit(trans))
+	return(-2);
+    if (hcc_leaf_read(trans, LC_DATA, *fdp, bytes) < 0)
+	return(-1);
+    return(0);
+}
+
+/*
+ * READFILE
+ *
+ * Sends the whole file, or <length> bytes from <offset> on if given.
+ */
+static int
+readfile_chunk(int limit, off_t remain)
+{
+    return ((remain >= 0 && remain < limit) ? (int)remain : limit);
+}
+
+static int
+rc_readfile(hctransaction_t trans, struct HCHead *head)
+{
+    struct HCLeaf *item;
+    const char *path = NULL;
+    off_t offset = 0;
+    off_t remain = -1;
+    int limit;
+    int n;
+    int fd;
+
+    FOR_EACH_ITEM(item, trans, head) {
+	switch(item->leafid) {
+	case LC_PATH1:
+	    path = HCC_STRING(item);
+	    break;
+	case LC_OFFSET:
+	    offset = HCC_INT64(item);
+	    break;
+	case LC_LENGTH:
+	    remain = HCC_INT64(item);
+	    break;
+	}
+    }
+    if (path == NULL || offset < 0)
+	return (-2);
+    if ((fd = open(path, O_RDONLY)) < 0)
+	return(-1);
+    if (offset && lseek(fd, offset, SEEK_SET) < 0) {
+	close(fd);
+	return(-1);
+    }
+    /*
+     * Splice the data to the client where possible, else read it
+     * straight into the reply.  The last leaf has no data.
+     */
+    limit = getiolimit(trans);
+    while ((n = readfile_chunk(limit, remain)) > 0 &&
+	   (n = hcc_leaf_splice(trans, head, LC_DATA, fd, n)) > 0) {
+	if (remain > 0)
+	    remain -= n;
+    }
+    if (n == 0 || errno == EOPNOTSUPP) {
+	do {
+	    if (!hcc_check_space(trans, head, 1, limit)) {
+		close(fd);
+		return (-1);
+	    }
+	    n = hcc_leaf_read(trans, LC_DATA, fd, readfile_chunk(limit, remain));
+	    if (n > 0 && remain > 0)
+		remain -= n;
+	} while (n > 0);
+    }
+    if (n < 0) {
+	close(fd);
+	return (-1);
+    }
+    return (close(fd));
+}
+
+/*
+ * WRITE
+ */
+ssize_t
+hc_write(struct HostConf *hc, int fd, const void *buf, size_t bytes)
+{
+    return(hc_pwrite(hc, fd, buf, bytes, -1));
+}
+
+/*
+ * Write at <offset>, or at the current position if <offset> is -1.
+ */
+ssize_t
+hc_pwrite(struct HostConf *hc, int fd, const void *buf, size_t bytes,
+	  off_t offset)
+{
+    hctransaction_t trans;
+    struct HCHead *head;
+    struct HCLeaf *item;
+    int *fdp;
+    int r;
+
+    if (NotForRealOpt)
+	return(bytes);
+
+    if (hc == NULL || hc->host == NULL) {
+	if (offset >= 0)
+	    return(pwrite(fd, buf, bytes, offset));
+	return(write(fd, buf, bytes));
+    }
+    if (offset >= 0 && hc->version < HCPROTO_VERSION_RANGES) {
+	errno = EOPNOTSUPP;
+	return(-1);
+    }
+
+    fdp = hcc_get_descriptor(hc, fd, HC_DESC_FD);
+    if (fdp) {
+	r = 0;
+	while (bytes) {
+	    size_t limit = getiolimit(&hc->trans);
+	    int n = (bytes > limit) ? limit : bytes;
+	    int x = 0;
+
+	    trans = hcc_start_command(hc, HC_WRITE);
+	    hcc_leaf_int32(trans, LC_DESCRIPTOR, fd);
+	    if (offset >= 0)
+		hcc_leaf_int64(trans, LC_OFFSET, offset + r);
+	    hcc_leaf_data_ref(trans, LC_DATA, buf, n);
+	    if ((head = hcc_finish_command(trans)) == NULL)
+		return(-1);
+	    if (head->error)
+		return(-1);
+	    FOR_EACH_ITEM(item, trans, head) {
+		if (item->leafid == LC_BYTES)
+		    x = HCC_INT32(item);
+	    }
+	    if (x < 0 || x > n)
+		return(-1);
+	    r += x;
+	    buf = (const char *)buf + x;
+	    bytes -= x;
+	    if (x < n)
+		break;
 	}
-	flags |= O_RDONLY;
+	return(r);
+    } else {
+	return(-1);
     }
+}
 
-#ifdef O_LARGEFILE
-    flags |= O_LARGEFILE;
-#endif
-    if ((fd = open(path, flags, mode)) < 0)
-	return(-1);
-    fdp = malloc(sizeof(int));
-    *fdp = fd;
-    desc = hcc_alloc_descriptor(trans->hc, fdp, HC_DESC_FD);
-    hcc_leaf_int32(trans, LC_DESCRIPTOR, desc);
+static int
+rc_write(hctransaction_t trans, struct HCHead *head)
+{
+    struct HCLeaf *item;
+    int *fdp = NULL;
+    void *buf = NULL;
+    off_t offset = -1;
+    int n = -1;
+
+    FOR_EACH_ITEM(item, trans, head) {
+	switch(item->leafid) {
+	case LC_DESCRIPTOR:
+	    fdp = hcc_get_descriptor(trans->hc, HCC_INT32(item), HC_DESC_FD);
+	    break;
+	case LC_OFFSET:
+	    offset = HCC_INT64(item);
+	    break;
+	case LC_DATA:
+	    buf = HCC_BINARYDATA(item);
+	    n = item->bytes - sizeof(*item);
+	    break;
+	}
+    }
+    if (ReadOnlyOpt) {
+	head->error = EACCES;
+	return (0);
+    }
+    if (fdp == NULL)
+	return(-2);
+    if (n < 0 || n > getiolimit(trans))
+	return(-2);
+    if (offset >= 0)
+	n = pwrite(*fdp, buf, n, offset);
+    else
+	n = write(*fdp, buf, n);
+    if (n < 0)
+	return (-1);
+    hcc_leaf_int32(trans, LC_BYTES, n);
     return(0);
 }
 
 /*
- * CLOSE
+ * REMOVE
+ *
+ * NOTE: This function returns -errno if an error occured.
  */
 int
-hc_close(struct HostConf *hc, int fd)
+hc_remove(struct HostConf *hc, const char *path)
 {
     hctransaction_t trans;
     struct HCHead *head;
-    int *fdp;
+    int res;
 
-    if (NotForRealOpt && fd == 0x7FFFFFFF)
+    if (NotForRealOpt)
 	return(0);
-    if (hc == NULL || hc->host == NULL)
-	return(close(fd));
+    if (hc == NULL || hc->host == NULL) {
+	res = remove(path);
+	if (res < 0)
+		res = -errno;
+	return(res);
+    }
 
-    if (fd == 1 && hc->version >= 4) {	/* using HC_READFILE */
-	head = (void *)hc->trans.rbuf;
-	/* skip any remaining items if the file is closed prematurely */
-	while (hcc_nextchaineditem(hc, head) != NULL)
-	    /*nothing*/ ;
-	if (hc->trans.state == HCT_FAIL || head->error)
-	    return (-1);
+    trans = hcc_start_command(hc, HC_REMOVE);
+    hcc_leaf_string(trans, LC_PATH1, path);
+    if ((head = hcc_finish_command(trans)) == NULL)
+	return(-EIO);
+    if (head->error)
+	return(-(int)head->error);
+    return(0);
+}
+
+static int
+rc_remove(hctransaction_t trans, struct HCHead *head)
+{
+    struct HCLeaf *item;
+    const char *path = NULL;
+
+    FOR_EACH_ITEM(item, trans, head) {
+	if (item->leafid == LC_PATH1)
+	    path = HCC_STRING(item);
+    }
+    if (path == NULL)
+	return(-2);
+    if (ReadOnlyOpt) {
+	head->error = EACCES;
 	return (0);
     }
+    return(remove(path));
+}
 
-    fdp = hcc_get_descriptor(hc, fd, HC_DESC_FD);
-    if (fdp) {
-	free(fdp);
-	hcc_set_descriptor(hc, fd, NULL, HC_DESC_FD);
+/*
+ * MKDIR
+ */
+int
+hc_mkdir(struct HostConf *hc, const char *path, mode_t mode)
+{
+    hctransaction_t trans;
+    struct HCHead *head;
 
-	trans = hcc_start_command(hc, HC_CLOSE);
-	hcc_leaf_int32(trans, LC_DESCRIPTOR, fd);
-	if ((head = hcc_finish_command(trans)) == NULL)
-	    return(-1);
-	if (head->error)
-	    return(-1);
+    if (NotForRealOpt)
 	return(0);
-    } else {
+    if (hc == NULL || hc->host == NULL)
+	return(mkdir(path, mode));
+
+    trans = hcc_start_command(hc, HC_MKDIR);
+    hcc_leaf_string(trans, LC_PATH1, path);
+    hcc_leaf_int32(trans, LC_MODE, mode);
+    if ((head = hcc_finish_command(trans)) == NULL)
 	return(-1);
-    }
+    if (head->error)
+	return(-1);
+    return(0);
 }
 
 static int
-rc_close(hctransaction_t trans, struct HCHead *head)
+rc_mkdir(hctransaction_t trans, struct HCHead *head)
 {
     struct HCLeaf *item;
-    int *fdp = NULL;
-    int fd;
-    int desc = -1;
+    const char *path = NULL;
+    mode_t mode = 0777;
 
     FOR_EACH_ITEM(item, trans, head) {
-	if (item->leafid == LC_DESCRIPTOR)
-	    desc = HCC_INT32(item);
+	switch(item->leafid) {
+	case LC_PATH1:
+	    path = HCC_STRING(item);
+	    break;
+	case LC_MODE:
+	    mode = HCC_INT32(item);
+	    break;
+	}
     }
-    if (desc < 0)
+    if (ReadOnlyOpt) {
+	head->error = EACCES;
+	return (0);
+    }
+    if (path == NULL)
 	return(-2);
-    if ((fdp = hcc_get_descriptor(trans->hc, desc, HC_DESC_FD)) == NULL)
+    return(mkdir(path, mode));
+}
+
+/*
+ * RMDIR
+ */
+int
+hc_rmdir(struct HostConf *hc, const char *path)
+{
+    hctransaction_t trans;
+    struct HCHead *head;
+
+    if (NotForRealOpt)
+	return(0);
+    if (hc == NULL || hc->host == NULL)
+	return(rmdir(path));
+
+    trans = hcc_start_command(hc, HC_RMDIR);
+    hcc_leaf_string(trans, LC_PATH1, path);
+    if ((head = hcc_finish_command(trans)) == NULL)
+	return(-1);
+    if (head->error)
+	return(-1);
+    return(0);
+}
+
+static int
+rc_rmdir(hctransaction_t trans, struct HCHead *head)
+{
+    struct HCLeaf *item;
+    const char *path = NULL;
+
+    FOR_EACH_ITEM(item, trans, head) {
+	if (item->leafid == LC_PATH1)
+	    path = HCC_STRING(item);
+    }
+    if (ReadOnlyOpt) {
+	head->error = EACCES;
+	return (0);
+    }
+    if (path == NULL)
 	return(-2);
-    fd = *fdp;
-    free(fdp);
-    hcc_set_descriptor(trans->hc, desc, NULL, HC_DESC_FD);
-    return(close(fd));
+    return(rmdir(path));
+}
+
+/*
+ * RMTREE
+ *
+ * Remove a whole subtree in a single transaction.  The slave walks the
+ * tree itself and streams back one record (mode, errno, path) per entry
+ * it failed to remove, or per entry it removed if the client asked for
+ * verbose output.  The final packet carries the number of items removed.
+ *
+ * Returns the number of items removed, or -1 if the remote does not
+ * support the command (errno EOPNOTSUPP) or the transaction failed.
+ */
+int
+hc_rmtree(struct HostConf *hc, const char *path, dev_t devNo,
+	  void (*report)(const char *path, mode_t mode, int error))
+{
+    hctransaction_t trans;
+    struct HCHead *head;
+    struct HCLeaf *item;
+    mode_t mode = 0;
+    int error = 0;
+    int count = 0;
+
+    if (hc == NULL || hc->host == NULL ||
+	hc->version < HCPROTO_VERSION_RMTREE) {
+	errno = EOPNOTSUPP;
+	return(-1);
+    }
+
+    trans = hcc_start_command(hc, HC_RMTREE);
+    hcc_leaf_string(trans, LC_PATH1, path);
+    if (devNo != (dev_t)-1)
+	hcc_leaf_int32(trans, LC_DEV, devNo);
+    hcc_leaf_int32(trans, LC_VERBOSE, VerboseOpt);
+    if ((head = hcc_finish_command(trans)) == NULL)
+	return(-1);
+    while ((item = hcc_nextchaineditem(hc, head)) != NULL) {
+	switch(item->leafid) {
+	case LC_MODE:
+	    mode = HCC_INT32(item);
+	    break;
+	case LC_ERRNO:
+	    error = HCC_INT32(item);
+	    break;
+	case LC_PATH1:	/* this must be the last item of a record */
+	    report(HCC_STRING(item), mode, error);
+	    mode = 0;
+	    error = 0;
+	    break;
+	case LC_COUNT:
+	    count = HCC_INT32(item);
+	    break;
+	}
+    }
+    if (hc->trans.state == HCT_FAIL)
+	return(-1);
+    if (head->error) {
+	errno = head->error;
+	return(-1);
+    }
+    return(count);
 }
 
-static int
-getiolimit(void)
+struct rmtree_info {
+    hctransaction_t trans;
+    struct HCHead *head;
+    int32_t dev;		/* device boundary (as sent by LC_DEV) */
+    int verbose;
+    int count;			/* items removed */
+    int failed;			/* lost the connection */
+};
+
+static void
+rmtree_report(struct rmtree_info *info, const char *path, mode_t mode,
+	      int error)
 {
-    return(32768);
+    if (info->failed || (error == 0 && info->verbose == 0))
+	return;
+    if (!hcc_check_space(info->trans, info->head, 3,
+			 2 * sizeof(int32_t) + strlen(path) + 1)) {
+	info->failed = 1;
+	return;
+    }
+    hcc_leaf_int32(info->trans, LC_MODE, mode);
+    hcc_leaf_int32(info->trans, LC_ERRNO, error);
+    hcc_leaf_string(info->trans, LC_PATH1, path);
 }
 
 /*
- * READ
+ * Remove <path>, recursing into it if it is a directory.
+ *
+ * Each directory is read completely and closed again before its
+ * children are visited, so only one descriptor is open at a time
+ * however deep the tree is.
+ *
+ * Entries on another device are left alone, which makes the removal
+ * of their parent directory fail, just like RemoveRecur() does.
  */
-ssize_t
-hc_read(struct HostConf *hc, int fd, void *buf, size_t bytes)
+static void
+rmtree_entry(struct rmtree_info *info, const char *path, struct stat *st)
 {
-    hctransaction_t trans;
-    struct HCHead *head;
-    struct HCLeaf *item;
-    int *fdp;
-    int offset;
-    int r = 0;
-    int x = 0;
+    int r;
 
-    if (hc == NULL || hc->host == NULL)
-	return(read(fd, buf, bytes));
+    if (S_ISDIR(st->st_mode)) {
+	struct dirent *den;
+	struct stat cst;
+	char **names = NULL;
+	int count = 0;
+	int max = 0;
+	DIR *dir;
+	int fd;
+	int i;
 
-    if (fd == 1 && hc->version >= 4) {	/* using HC_READFILE */
-	head = (void *)hc->trans.rbuf;
-	while (bytes) {
-	    if ((offset = head->magic) != 0) {
-		item = hcc_currentchaineditem(hc, head);
-	    } else {
-		item = hcc_nextchaineditem(hc, head);
-	    }
-	    if (item == NULL) {
-		if (hc->trans.state == HCT_FAIL)
-			r = -1;
-		return (r);
+	/*
+	 * Collect the names before removing anything, removing entries
+	 * while reading the directory is not well defined.
+	 */
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd < 0 || (dir = fdopendir(fd)) == NULL) {
+	    if (fd >= 0) {
+		r = errno;
+		close(fd);
+		errno = r;
 	    }
-	    if (item->leafid != LC_DATA)
-		return (-1);
-	    x = item->bytes - sizeof(*item) - offset;
-	    if (x > (int)bytes) {
-		x = (int)bytes;
-		head->magic += x;  /* leave bytes in the buffer */
+	    rmtree_report(info, path, st->st_mode, errno);
+	    return;
+	}
+	while ((den = readdir(dir)) != NULL) {
+	    if (den->d_name[0] == '.' && (den->d_name[1] == '\0' ||
+		    (den->d_name[1] == '.' && den->d_name[2] == '\0')))
+		continue;	/* skip "." and ".." */
+	    if (count == max) {
+		max = max ? max * 2 : 64;
+		names = realloc(names, max * sizeof(char *));
+		if (names == NULL)
+		    fatal("out of memory");
 	    }
-	    else
-		head->magic = 0;  /* all bytes used up */
-	    memcpy(buf, (char *)HCC_BINARYDATA(item) + offset, x);
-	    buf = (char *)buf + x;
-	    bytes -= (size_t)x;
-	    r += x;
+	    names[count++] = strdup(den->d_name);
 	}
-	return (r);
-    }
-
-    fdp = hcc_get_descriptor(hc, fd, HC_DESC_FD);
-    if (fdp) {
-	while (bytes) {
-	    size_t limit = getiolimit();
-	    int n = (bytes > limit) ? limit : bytes;
-
-	    trans = hcc_start_command(hc, HC_READ);
-	    hcc_leaf_int32(trans, LC_DESCRIPTOR, fd);
-	    hcc_leaf_int32(trans, LC_BYTES, n);
-	    if ((head = hcc_finish_command(trans)) == NULL)
-		return(-1);
-	    if (head->error)
-		return(-1);
-	    FOR_EACH_ITEM(item, trans, head) {
-		if (item->leafid == LC_DATA) {
-		    x = item->bytes - sizeof(*item);
-		    if (x > (int)bytes)
-			x = (int)bytes;
-		    memcpy(buf, HCC_BINARYDATA(item), x);
-		    buf = (char *)buf + x;
-		    bytes -= (size_t)x;
-		    r += x;
-		}
+	closedir(dir);
+	for (i = 0; i < count; ++i) {
+	    char *cpath;
+
+	    cpath = mprintf("%s/%s", path, names[i]);
+	    if (!info->failed && lstat(cpath, &cst) == 0 &&
+		(int32_t)cst.st_dev == info->dev) {
+		rmtree_entry(info, cpath, &cst);
 	    }
-	    if (x < n)
-		break;
+	    free(cpath);
+	    free(names[i]);
 	}
-	return(r);
+	free(names);
+	if (info->failed)
+	    return;
+	r = rmdir(path);
+#ifdef _ST_FLAGS_PRESENT_
+	if (r < 0 && errno == EPERM) {
+	    chflags(path, 0);
+	    r = rmdir(path);
+	}
+#endif
     } else {
-	return(-1);
+	r = unlink(path);
+#ifdef _ST_FLAGS_PRESENT_
+	if (r < 0 && errno == EPERM) {
+	    lchflags(path, 0);
+	    r = unlink(path);
+	}
+#endif
     }
+    if (r == 0)
+	++info->count;
+    rmtree_report(info, path, st->st_mode, (r < 0) ? errno : 0);
 }
 
 static int
-rc_read(hctransaction_t trans, struct HCHead *head)
+rc_rmtree(hctransaction_t trans, struct HCHead *head)
 {
     struct HCLeaf *item;
-    int *fdp = NULL;
-    char buf[32768];
-    int bytes = -1;
-    int n;
+    struct rmtree_info info;
+    const char *path = NULL;
+    struct stat st;
+    int devset = 0;
 
+    memset(&info, 0, sizeof(info));
     FOR_EACH_ITEM(item, trans, head) {
 	switch(item->leafid) {
-	case LC_DESCRIPTOR:
-	    fdp = hcc_get_descriptor(trans->hc, HCC_INT32(item), HC_DESC_FD);
+	case LC_PATH1:
+	    path = HCC_STRING(item);
 	    break;
-	case LC_BYTES:
-	    bytes = HCC_INT32(item);
+	case LC_DEV:
+	    info.dev = HCC_INT32(item);
+	    devset = 1;
+	    break;
+	case LC_VERBOSE:
+	    info.verbose = HCC_INT32(item);
 	    break;
 	}
     }
-    if (fdp == NULL)
-	return(-2);
-    if (bytes < 0 || bytes > 32768)
+    if (ReadOnlyOpt) {
+	head->error = EACCES;
+	return (0);
+    }
+    if (path == NULL)
 	return(-2);
-    n = read(*fdp, buf, bytes);
-    if (n < 0)
+    if (lstat(path, &st) < 0)
 	return(-1);
-    hcc_leaf_data(trans, LC_DATA, buf, n);
+    if (devset == 0)
+	info.dev = st.st_dev;
+    info.trans = trans;
+    info.head = head;
+    if ((int32_t)st.st_dev == info.dev)
+	rmtree_entry(&info, path, &st);
+    if (info.failed)
+	return(-1);
+    if (!hcc_check_space(trans, head, 1, sizeof(int32_t)))
+	return(-1);
+    hcc_leaf_int32(trans, LC_COUNT, info.count);
     return(0);
 }
 
 /*
- * READFILE
+ * CHOWN
+ *
+ * Almost silently ignore chowns that fail if we are not root.
  */
+int
+hc_chown(struct HostConf *hc, const char *path, uid_t owner, gid_t group)
+{
+    hctransaction_t trans;
+    struct HCHead *head;
+    int rc;
+
+    if (NotForRealOpt)
+	return(0);
+    if (!DstRootPrivs)
+	owner = -1;
+
+    if (hc == NULL || hc->host == NULL) {
+	rc = chown(path, owner, group);
+	if (rc < 0)
+	    rc = silentwarning(&chown_warning, "file ownership may differ\n");
+	return(rc);
+    }
+
+    trans = hcc_start_command(hc, HC_CHOWN);
+    hcc_leaf_string(trans, LC_PATH1, path);
+    hcc_leaf_int32(trans, LC_UID, owner);
+    hcc_leaf_int32(trans, LC_GID, group);
+    if ((head = hcc_finish_command(trans)) == NULL)
+	return(-1);
+    if (head->error)
+	return(-1);
+    return(0);
+}
+
 static int
-rc_readfile(hctransaction_t trans, struct HCHead *head)
+rc_chown(hctransaction_t trans, struct HCHead *head)
 {
     struct HCLeaf *item;
     const char *path = NULL;
-    char buf[32768];
-    int n;
-    int fd;
+    uid_t uid = (uid_t)-1;
+    gid_t gid = (gid_t)-1;
+    int rc;
 
     FOR_EACH_ITEM(item, trans, head) {
-	if (item->leafid == LC_PATH1)
+	switch(item->leafid) {
+	case LC_PATH1:
 	    path = HCC_STRING(item);
-    }
-    if (path == NULL)
-	return (-2);
-    if ((fd = open(path, O_RDONLY)) < 0)
-	return(-1);
-    while ((n = read(fd, buf, 32768)) >= 0) {
-	if (!hcc_check_space(trans, head, 1, n)) {
-	    close(fd);
-	    return (-1);
+	    break;
+	case LC_UID:
+	    uid = HCC_INT32(item);
+	    break;
+	case LC_GID:
+	    gid = HCC_INT32(item);
+	    break;
 	}
-	hcc_leaf_data(trans, LC_DATA, buf, n);
-	if (n == 0)
-		break;
     }
-    if (n < 0) {
-	close(fd);
-	return (-1);
+    if (ReadOnlyOpt) {
+	head->error = EACCES;
+	return (0);
     }
-    return (close(fd));
+    if (path == NULL)
+	return(-2);
+    rc = chown(path, uid, gid);
+    if (rc < 0)
+	rc = silentwarning(&chown_warning, "file ownership may differ\n");
+    return(rc);
 }
 
 /*
- * WRITE
+ * LCHOWN
  */
-ssize_t
-hc_write(struct HostConf *hc, int fd, const void *buf, size_t bytes)
+int
+hc_lchown(struct HostConf *hc, const char *path, uid_t owner, gid_t group)
 {
     hctransaction_t trans;
     struct HCHead *head;
-    struct HCLeaf *item;
-    int *fdp;
-    int r;
+    int rc;
 
     if (NotForRealOpt)
-	return(bytes);
-
-    if (hc == NULL || hc->host == NULL)
-	return(write(fd, buf, bytes));
+	return(0);
+    if (!DstRootPrivs)
+	owner = -1;
 
-    fdp = hcc_get_descriptor(hc, fd, HC_DESC_FD);
-    if (fdp) {
-	r = 0;
-	while (bytes) {
-	    size_t limit = getiolimit();
-	    int n = (bytes > limit) ? limit : bytes;
-	    int x = 0;
+    if (hc == NULL || hc->host == NULL) {
+	rc = lchown(path, owner, group);
+	if (rc < 0)
+	    rc = silentwarning(&chown_warning, "file ownership may differ\n");
+	return(rc);
+    }
 
-	    trans = hcc_start_command(hc, HC_WRITE);
-	    hcc_leaf_int32(trans, LC_DESCRIPTOR, fd);
-	    hcc_leaf_data(trans, LC_DATA, buf, n);
-	    if ((head = hcc_finish_command(trans)) == NULL)
-		return(-1);
-	    if (head->error)
-		return(-1);
-	    FOR_EACH_ITEM(item, trans, head) {
-		if (item->leafid == LC_BYTES)
-		    x = HCC_INT32(item);
-	    }
-	    if (x < 0 || x > n)
-		return(-1);
-	    r += x;
-	    buf = (const char *)buf + x;
-	    bytes -= x;
-	    if (x < n)
-		break;
-	}
-	return(r);
-    } else {
+    trans = hcc_start_command(hc, HC_LCHOWN);
+    hcc_leaf_string(trans, LC_PATH1, path);
+    hcc_leaf_int32(trans, LC_UID, owner);
+    hcc_leaf_int32(trans, LC_GID, group);
+    if ((head = hcc_finish_command(trans)) == NULL)
 	return(-1);
-    }
+    if (head->error)
+	return(-1);
+    return(0);
 }
 
 static int
-rc_write(hctransaction_t trans, struct HCHead *head)
+rc_lchown(hctransaction_t trans, struct HCHead *head)
 {
     struct HCLeaf *item;
-    int *fdp = NULL;
-    void *buf = NULL;
-    int n = -1;
+    const char *path = NULL;
+    uid_t uid = (uid_t)-1;
+    gid_t gid = (gid_t)-1;
+    int rc;
 
     FOR_EACH_ITEM(item, trans, head) {
-	switch(item->leafid) {
-	case LC_DESCRIPTOR:
-	    fdp = hcc_get_descriptor(trans->hc, HCC_INT32(item), HC_DESC_FD);
+	switch(item->leafid) {
+	case LC_PATH1:
+	    path = HCC_STRING(item);
 	    break;
-	case LC_DATA:
-	    buf = HCC_BINARYDATA(item);
-	    n = item->bytes - sizeof(*item);
+	case LC_UID:
+	    uid = HCC_INT32(item);
+	    break;
+	case LC_GID:
+	    gid = HCC_INT32(item);
 	    break;
 	}
     }
@@ -1102,83 +3063,112 @@ rc_write(hctransaction_t trans, struct HCHead *head)
 	head->error = EACCES;
 	return (0);
     }
-    if (fdp == NULL)
-	return(-2);
-    if (n < 0 || n > 32768)
+    if (path == NULL)
 	return(-2);
-    n = write(*fdp, buf, n);
-    if (n < 0)
-	return (-1);
-    hcc_leaf_int32(trans, LC_BYTES, n);
-    return(0);
+    rc = lchown(path, uid, gid);
+    if (rc < 0)
+	rc = silentwarning(&chown_warning, "file ownership may differ\n");
+    return(rc);
 }
 
 /*
- * REMOVE
- *
- * NOTE: This function returns -errno if an error occured.
+ * CHMOD
  */
 int
-hc_remove(struct HostConf *hc, const char *path)
+hc_chmod(struct HostConf *hc, const char *path, mode_t mode)
 {
     hctransaction_t trans;
     struct HCHead *head;
-    int res;
 
     if (NotForRealOpt)
 	return(0);
-    if (hc == NULL || hc->host == NULL) {
-	res = remove(path);
-	if (res < 0)
-		res = -errno;
-	return(res);
-    }
+    if (hc == NULL || hc->host == NULL)
+	return(chmod(path, mode));
 
-    trans = hcc_start_command(hc, HC_REMOVE);
+    trans = hcc_start_command(hc, HC_CHMOD);
     hcc_leaf_string(trans, LC_PATH1, path);
+    hcc_leaf_int32(trans, LC_MODE, mode);
     if ((head = hcc_finish_command(trans)) == NULL)
-	return(-EIO);
+	return(-1);
     if (head->error)
-	return(-(int)head->error);
+	return(-1);
+    return(0);
+}
+
+int
+hc_lchmod(struct HostConf *hc, const char *path, mode_t mode)
+{
+    hctransaction_t trans;
+    struct HCHead *head;
+
+    if (NotForRealOpt)
+	return(0);
+    if (hc == NULL || hc->host == NULL)
+	return(lchmod(path, mode));
+
+    trans = hcc_start_command(hc, HC_LCHMOD);
+    hcc_leaf_string(trans, LC_PATH1, path);
+    hcc_leaf_int32(trans, LC_MODE, mode);
+    if ((head = hcc_finish_command(trans)) == NULL)
+	return(-1);
+    if (head->error)
+	return(-1);
     return(0);
 }
 
 static int
-rc_remove(hctransaction_t trans, struct HCHead *head)
+rc_chmod(hctransaction_t trans, struct HCHead *head)
 {
     struct HCLeaf *item;
     const char *path = NULL;
+    mode_t mode = 0666;
 
     FOR_EACH_ITEM(item, trans, head) {
-	if (item->leafid == LC_PATH1)
+	switch(item->leafid) {
+	case LC_PATH1:
 	    path = HCC_STRING(item);
+	    break;
+	case LC_MODE:
+	    mode = HCC_INT32(item);
+	    break;
+	}
     }
-    if (path == NULL)
-	return(-2);
     if (ReadOnlyOpt) {
 	head->error = EACCES;
 	return (0);
     }
-    return(remove(path));
+    if (path == NULL)
+	return(-2);
+    if (head->cmd == HC_LCHMOD)
+	    return(lchmod(path, mode));
+    else
+	    return(chmod(path, mode));
 }
 
 /*
- * MKDIR
+ * MKNOD
  */
 int
-hc_mkdir(struct HostConf *hc, const char *path, mode_t mode)
+hc_mknod(struct HostConf *hc, const char *path, mode_t mode, dev_t rdev)
 {
     hctransaction_t trans;
     struct HCHead *head;
 
     if (NotForRealOpt)
 	return(0);
+    if (!DstRootPrivs) {
+	/* mknod() requires root privs, so don't bother. */
+	errno = EPERM;
+	return (-1);
+    }
+
     if (hc == NULL || hc->host == NULL)
-	return(mkdir(path, mode));
+	return(mknod(path, mode, rdev));
 
-    trans = hcc_start_command(hc, HC_MKDIR);
+    trans = hcc_start_command(hc, HC_MKNOD);
     hcc_leaf_string(trans, LC_PATH1, path);
     hcc_leaf_int32(trans, LC_MODE, mode);
+    hcc_leaf_int32(trans, LC_RDEV, rdev);
     if ((head = hcc_finish_command(trans)) == NULL)
 	return(-1);
     if (head->error)
@@ -1187,11 +3177,12 @@ hc_mkdir(struct HostConf *hc, const char *path, mode_t mode)
 }
 
 static int
-rc_mkdir(hctransaction_t trans, struct HCHead *head)
+rc_mknod(hctransaction_t trans, struct HCHead *head)
 {
     struct HCLeaf *item;
     const char *path = NULL;
-    mode_t mode = 0777;
+    mode_t mode = 0666;
+    dev_t rdev = 0;
 
     FOR_EACH_ITEM(item, trans, head) {
 	switch(item->leafid) {
@@ -1201,6 +3192,9 @@ rc_mkdir(hctransaction_t trans, struct HCHead *head)
 	case LC_MODE:
 	    mode = HCC_INT32(item);
 	    break;
+	case LC_RDEV:
+	    rdev = HCC_INT32(item);
+	    break;
 	}
     }
     if (ReadOnlyOpt) {
@@ -1209,14 +3203,14 @@ rc_mkdir(hctransaction_t trans, struct HCHead *head)
     }
     if (path == NULL)
 	return(-2);
-    return(mkdir(path, mode));
+    return(mknod(path, mode, rdev));
 }
 
 /*
- * RMDIR
+ * LINK
  */
 int
-hc_rmdir(struct HostConf *hc, const char *path)
+hc_link(struct HostConf *hc, const char *name1, const char *name2)
 {
     hctransaction_t trans;
     struct HCHead *head;
@@ -1224,10 +3218,11 @@ hc_rmdir(struct HostConf *hc, const char *path)
     if (NotForRealOpt)
 	return(0);
     if (hc == NULL || hc->host == NULL)
-	return(rmdir(path));
+	return(link(name1, name2));
 
-    trans = hcc_start_command(hc, HC_RMDIR);
-    hcc_leaf_string(trans, LC_PATH1, path);
+    trans = hcc_start_command(hc, HC_LINK);
+    hcc_leaf_string(trans, LC_PATH1, name1);
+    hcc_leaf_string(trans, LC_PATH2, name2);
     if ((head = hcc_finish_command(trans)) == NULL)
 	return(-1);
     if (head->error)
@@ -1236,31 +3231,37 @@ hc_rmdir(struct HostConf *hc, const char *path)
 }
 
 static int
-rc_rmdir(hctransaction_t trans, struct HCHead *head)
+rc_link(hctransaction_t trans, struct HCHead *head)
 {
     struct HCLeaf *item;
-    const char *path = NULL;
+    const char *name1 = NULL;
+    const char *name2 = NULL;
 
     FOR_EACH_ITEM(item, trans, head) {
-	if (item->leafid == LC_PATH1)
-	    path = HCC_STRING(item);
+	switch(item->leafid) {
+	case LC_PATH1:
+	    name1 = HCC_STRING(item);
+	    break;
+	case LC_PATH2:
+	    name2 = HCC_STRING(item);
+	    break;
+	}
     }
     if (ReadOnlyOpt) {
 	head->error = EACCES;
-	return (0);
+	return (-0);
     }
-    if (path == NULL)
+    if (name1 == NULL || name2 == NULL)
 	return(-2);
-    return(rmdir(path));
+    return(link(name1, name2));
 }
 
+#ifdef _ST_FLAGS_PRESENT_
 /*
- * CHOWN
- *
- * Almost silently ignore chowns that fail if we are not root.
+ * CHFLAGS
  */
 int
-hc_chown(struct HostConf *hc, const char *path, uid_t owner, gid_t group)
+hc_chflags(struct HostConf *hc, const char *path, u_long flags)
 {
     hctransaction_t trans;
     struct HCHead *head;
@@ -1269,19 +3270,45 @@ hc_chown(struct HostConf *hc, const char *path, uid_t owner, gid_t group)
     if (NotForRealOpt)
 	return(0);
     if (!DstRootPrivs)
-	owner = -1;
+	flags &= UF_SETTABLE;
 
     if (hc == NULL || hc->host == NULL) {
-	rc = chown(path, owner, group);
-	if (rc < 0)
-	    rc = silentwarning(&chown_warning, "file ownership may differ\n");
-	return(rc);
+	if ((rc = chflags(path, flags)) < 0)
+	    rc = silentwarning(&chflags_warning, "file flags may differ\n");
+	return (rc);
     }
 
-    trans = hcc_start_command(hc, HC_CHOWN);
+    trans = hcc_start_command(hc, HC_CHFLAGS);
     hcc_leaf_string(trans, LC_PATH1, path);
-    hcc_leaf_int32(trans, LC_UID, owner);
-    hcc_leaf_int32(trans, LC_GID, group);
+    hcc_leaf_int64(trans, LC_FILEFLAGS, flags);
+    if ((head = hcc_finish_command(trans)) == NULL)
+	return(-1);
+    if (head->error)
+	return(-1);
+    return(0);
+}
+
+int
+hc_lchflags(struct HostConf *hc, const char *path, u_long flags)
+{
+    hctransaction_t trans;
+    struct HCHead *head;
+    int rc;
+
+    if (NotForRealOpt)
+	return(0);
+    if (!DstRootPrivs)
+	flags &= UF_SETTABLE;
+
+    if (hc == NULL || hc->host == NULL) {
+	if ((rc = lchflags(path, flags)) < 0)
+	    rc = silentwarning(&chflags_warning, "file flags may differ\n");
+	return (rc);
+    }
+
+    trans = hcc_start_command(hc, HC_LCHFLAGS);
+    hcc_leaf_string(trans, LC_PATH1, path);
+    hcc_leaf_int64(trans, LC_FILEFLAGS, flags);
     if ((head = hcc_finish_command(trans)) == NULL)
 	return(-1);
     if (head->error)
@@ -1290,12 +3317,11 @@ hc_chown(struct HostConf *hc, const char *path, uid_t owner, gid_t group)
 }
 
 static int
-rc_chown(hctransaction_t trans, struct HCHead *head)
+rc_chflags(hctransaction_t trans, struct HCHead *head)
 {
     struct HCLeaf *item;
     const char *path = NULL;
-    uid_t uid = (uid_t)-1;
-    gid_t gid = (gid_t)-1;
+    u_long flags = 0;
     int rc;
 
     FOR_EACH_ITEM(item, trans, head) {
@@ -1303,11 +3329,8 @@ rc_chown(hctransaction_t trans, struct HCHead *head)
 	case LC_PATH1:
 	    path = HCC_STRING(item);
 	    break;
-	case LC_UID:
-	    uid = HCC_INT32(item);
-	    break;
-	case LC_GID:
-	    gid = HCC_INT32(item);
+	case LC_FILEFLAGS:
+	    flags = (u_long)HCC_INT64(item);
 	    break;
 	}
     }
@@ -1317,219 +3340,375 @@ rc_chown(hctransaction_t trans, struct HCHead *head)
     }
     if (path == NULL)
 	return(-2);
-    rc = chown(path, uid, gid);
+    if (head->cmd == HC_LCHFLAGS)
+	rc = lchflags(path, flags);
+    else
+	rc = chflags(path, flags);
     if (rc < 0)
-	rc = silentwarning(&chown_warning, "file ownership may differ\n");
+	rc = silentwarning(&chflags_warning, "file flags may differ\n");
     return(rc);
 }
 
+#endif
+
 /*
- * LCHOWN
+ * READLINK
  */
 int
-hc_lchown(struct HostConf *hc, const char *path, uid_t owner, gid_t group)
+hc_readlink(struct HostConf *hc, const char *path, char *buf, int bufsiz)
 {
     hctransaction_t trans;
     struct HCHead *head;
-    int rc;
-
-    if (NotForRealOpt)
-	return(0);
-    if (!DstRootPrivs)
-	owner = -1;
+    struct HCLeaf *item;
+    int r;
 
-    if (hc == NULL || hc->host == NULL) {
-	rc = lchown(path, owner, group);
-	if (rc < 0)
-	    rc = silentwarning(&chown_warning, "file ownership may differ\n");
-	return(rc);
-    }
+    if (hc == NULL || hc->host == NULL)
+	return(readlink(path, buf, bufsiz));
 
-    trans = hcc_start_command(hc, HC_LCHOWN);
+    trans = hcc_start_command(hc, HC_READLINK);
     hcc_leaf_string(trans, LC_PATH1, path);
-    hcc_leaf_int32(trans, LC_UID, owner);
-    hcc_leaf_int32(trans, LC_GID, group);
     if ((head = hcc_finish_command(trans)) == NULL)
 	return(-1);
     if (head->error)
 	return(-1);
-    return(0);
+
+    r = 0;
+    FOR_EACH_ITEM(item, trans, head) {
+	if (item->leafid == LC_DATA) {
+	    r = item->bytes - sizeof(*item);
+	    if (r < 0)
+		r = 0;
+	    if (r > bufsiz)
+		r = bufsiz;
+	    memcpy(buf, HCC_BINARYDATA(item), r);
+	}
+    }
+    return(r);
 }
 
 static int
-rc_lchown(hctransaction_t trans, struct HCHead *head)
+rc_readlink(hctransaction_t trans, struct HCHead *head)
 {
     struct HCLeaf *item;
     const char *path = NULL;
-    uid_t uid = (uid_t)-1;
-    gid_t gid = (gid_t)-1;
-    int rc;
+    char buf[1024];
+    int r;
 
     FOR_EACH_ITEM(item, trans, head) {
-	switch(item->leafid) {
-	case LC_PATH1:
+	if (item->leafid == LC_PATH1)
 	    path = HCC_STRING(item);
-	    break;
-	case LC_UID:
-	    uid = HCC_INT32(item);
-	    break;
-	case LC_GID:
-	    gid = HCC_INT32(item);
-	    break;
-	}
-    }
-    if (ReadOnlyOpt) {
-	head->error = EACCES;
-	return (0);
     }
     if (path == NULL)
 	return(-2);
-    rc = lchown(path, uid, gid);
-    if (rc < 0)
-	rc = silentwarning(&chown_warning, "file ownership may differ\n");
-    return(rc);
+    r = readlink(path, buf, sizeof(buf));
+    if (r < 0)
+	return(-1);
+    hcc_leaf_data(trans, LC_DATA, buf, r);
+    return(0);
 }
 
 /*
- * CHMOD
+ * DIGEST - the SHA-256 digest of a file's contents, in hex digits.
+ * <buf> must have room for HC_DIGESTLEN + 1 bytes.
+ *
+ * A slave computes it on its side, so the contents need not travel.
+ * An older slave has to send them.
  */
-int
-hc_chmod(struct HostConf *hc, const char *path, mode_t mode)
+static int
+digest_fd(struct HostConf *hc, int fd, char *buf)
 {
-    hctransaction_t trans;
-    struct HCHead *head;
-
-    if (NotForRealOpt)
-	return(0);
-    if (hc == NULL || hc->host == NULL)
-	return(chmod(path, mode));
-
-    trans = hcc_start_command(hc, HC_CHMOD);
-    hcc_leaf_string(trans, LC_PATH1, path);
-    hcc_leaf_int32(trans, LC_MODE, mode);
-    if ((head = hcc_finish_command(trans)) == NULL)
-	return(-1);
-    if (head->error)
-	return(-1);
-    return(0);
+    static const char hex[] = "0123456789abcdef";
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int i;
+    unsigned int len;
+    EVP_MD_CTX *ctx;
+    char *iobuf;
+    ssize_t n;
+
+    if ((iobuf = malloc(HC_BUFSIZE)) == NULL)
+	fatal("out of memory");
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    ctx = EVP_MD_CTX_new();
+#else
+    ctx = EVP_MD_CTX_create();
+#endif
+    if (ctx == NULL || !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
+	n = -1;
+	errno = ENOMEM;
+	goto done;
+    }
+    while ((n = hc_read(hc, fd, iobuf, HC_BUFSIZE)) > 0) {
+	if (!EVP_DigestUpdate(ctx, iobuf, n)) {
+	    n = -1;
+	    errno = EIO;
+	    break;
+	}
+    }
+    if (n == 0 && EVP_DigestFinal_ex(ctx, digest, &len)) {
+	for (i = 0; i < len && i * 2 < HC_DIGESTLEN; ++i) {
+	    buf[i * 2] = hex[digest[i] >> 4];
+	    buf[i * 2 + 1] = hex[digest[i] & 0x0f];
+	}
+	buf[i * 2] = 0;
+    } else if (n == 0) {
+	n = -1;
+	errno = EIO;
+    }
+done:
+    if (ctx != NULL) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	EVP_MD_CTX_free(ctx);
+#else
+	EVP_MD_CTX_destroy(ctx);
+#endif
+    }
+    free(iobuf);
+    return(n < 0 ? -1 : 0);
 }
 
 int
-hc_lchmod(struct HostConf *hc, const char *path, mode_t mode)
+hc_digest(struct HostConf *hc, const char *path, char *buf)
 {
     hctransaction_t trans;
     struct HCHead *head;
+    struct HCLeaf *item;
+    int fd;
+    int r;
 
-    if (NotForRealOpt)
-	return(0);
-    if (hc == NULL || hc->host == NULL)
-	return(lchmod(path, mode));
+    if (hc == NULL || hc->host == NULL || hc->version < HCPROTO_VERSION_DIGEST) {
+	if ((fd = hc_open(hc, path, O_RDONLY, 0)) < 0)
+	    return(-1);
+	r = digest_fd(hc, fd, buf);
+	hc_close(hc, fd);
+	return(r);
+    }
 
-    trans = hcc_start_command(hc, HC_LCHMOD);
+    trans = hcc_start_command(hc, HC_DIGEST);
     hcc_leaf_string(trans, LC_PATH1, path);
-    hcc_leaf_int32(trans, LC_MODE, mode);
     if ((head = hcc_finish_command(trans)) == NULL)
 	return(-1);
     if (head->error)
 	return(-1);
-    return(0);
+
+    r = -1;
+    FOR_EACH_ITEM(item, trans, head) {
+	if (item->leafid == LC_DIGEST &&
+	    strlen(HCC_STRING(item)) == HC_DIGESTLEN) {
+	    strcpy(buf, HCC_STRING(item));
+	    r = 0;
+	}
+    }
+    if (r < 0)
+	errno = EINVAL;
+    return(r);
 }
 
+/*
+ * Digests of up to <count> consecutive blocks of <blksize> bytes from
+ * <offset> on, HC_BLOCKSUMLEN bytes each, so two files can be compared
+ * block by block without moving their contents.  The last block of the
+ * file may be short.  Returns the number of blocks digested, fewer than
+ * <count> at the end of the file.
+ */
 static int
-rc_chmod(hctransaction_t trans, struct HCHead *head)
+blockdigest_fd(int fd, off_t offset, int blksize, int count,
+	       unsigned char *buf)
 {
-    struct HCLeaf *item;
-    const char *path = NULL;
-    mode_t mode = 0666;
-
-    FOR_EACH_ITEM(item, trans, head) {
-	switch(item->leafid) {
-	case LC_PATH1:
-	    path = HCC_STRING(item);
+    unsigned int len;
+    EVP_MD_CTX *ctx;
+    char *iobuf;
+    ssize_t n = 0;
+    int i;
+
+    if ((iobuf = malloc(blksize)) == NULL)
+	fatal("out of memory");
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    ctx = EVP_MD_CTX_new();
+#else
+    ctx = EVP_MD_CTX_create();
+#endif
+    if (ctx == NULL) {
+	n = -1;
+	errno = ENOMEM;
+	count = 0;
+    }
+    for (i = 0; i < count; ++i) {
+	if ((n = pread(fd, iobuf, blksize, offset + (off_t)i * blksize)) <= 0)
 	    break;
-	case LC_MODE:
-	    mode = HCC_INT32(item);
+	if (!EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) ||
+	    !EVP_DigestUpdate(ctx, iobuf, n) ||
+	    !EVP_DigestFinal_ex(ctx, buf + i * HC_BLOCKSUMLEN, &len)) {
+	    n = -1;
+	    errno = EIO;
 	    break;
 	}
     }
-    if (ReadOnlyOpt) {
-	head->error = EACCES;
-	return (0);
+    if (ctx != NULL) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	EVP_MD_CTX_free(ctx);
+#else
+	EVP_MD_CTX_destroy(ctx);
+#endif
     }
-    if (path == NULL)
-	return(-2);
-    if (head->cmd == HC_LCHMOD)
-	    return(lchmod(path, mode));
-    else
-	    return(chmod(path, mode));
+    free(iobuf);
+    return(n < 0 ? -1 : i);
 }
 
-/*
- * MKNOD
- */
 int
-hc_mknod(struct HostConf *hc, const char *path, mode_t mode, dev_t rdev)
+hc_blockdigests(struct HostConf *hc, const char *path, off_t offset,
+		int blksize, int count, unsigned char *buf)
 {
     hctransaction_t trans;
     struct HCHead *head;
+    struct HCLeaf *item;
+    int fd;
+    int r;
 
-    if (NotForRealOpt)
-	return(0);
-    if (!DstRootPrivs) {
-	/* mknod() requires root privs, so don't bother. */
-	errno = EPERM;
-	return (-1);
+    if (hc == NULL || hc->host == NULL) {
+	if ((fd = open(path, O_RDONLY)) < 0)
+	    return(-1);
+	r = blockdigest_fd(fd, offset, blksize, count, buf);
+	close(fd);
+	return(r);
+    }
+    if (hc->version < HCPROTO_VERSION_CLONE || count > HC_MAXBLOCKSUMS) {
+	errno = EOPNOTSUPP;
+	return(-1);
     }
 
-    if (hc == NULL || hc->host == NULL)
-	return(mknod(path, mode, rdev));
-
-    trans = hcc_start_command(hc, HC_MKNOD);
+    trans = hcc_start_command(hc, HC_DIGEST);
     hcc_leaf_string(trans, LC_PATH1, path);
-    hcc_leaf_int32(trans, LC_MODE, mode);
-    hcc_leaf_int32(trans, LC_RDEV, rdev);
+    hcc_leaf_int64(trans, LC_OFFSET, offset);
+    hcc_leaf_int32(trans, LC_BYTES, blksize);
+    hcc_leaf_int32(trans, LC_COUNT, count);
     if ((head = hcc_finish_command(trans)) == NULL)
 	return(-1);
     if (head->error)
 	return(-1);
-    return(0);
+
+    r = -1;
+    FOR_EACH_ITEM(item, trans, head) {
+	if (item->leafid == LC_DATA) {
+	    r = (item->bytes - sizeof(*item)) / HC_BLOCKSUMLEN;
+	    if (r > count)
+		r = count;
+	    memcpy(buf, HCC_BINARYDATA(item), r * HC_BLOCKSUMLEN);
+	}
+    }
+    if (r < 0)
+	errno = EINVAL;
+    return(r);
 }
 
 static int
-rc_mknod(hctransaction_t trans, struct HCHead *head)
+rc_digest(hctransaction_t trans, struct HCHead *head)
 {
     struct HCLeaf *item;
     const char *path = NULL;
-    mode_t mode = 0666;
-    dev_t rdev = 0;
+    char buf[HC_DIGESTLEN + 1];
+    unsigned char *sums;
+    off_t offset = 0;
+    int blksize = 0;
+    int count = 0;
+    int fd;
+    int r;
 
     FOR_EACH_ITEM(item, trans, head) {
 	switch(item->leafid) {
 	case LC_PATH1:
 	    path = HCC_STRING(item);
 	    break;
-	case LC_MODE:
-	    mode = HCC_INT32(item);
+	case LC_OFFSET:
+	    offset = HCC_INT64(item);
 	    break;
-	case LC_RDEV:
-	    rdev = HCC_INT32(item);
+	case LC_BYTES:
+	    blksize = HCC_INT32(item);
+	    break;
+	case LC_COUNT:
+	    count = HCC_INT32(item);
 	    break;
 	}
     }
-    if (ReadOnlyOpt) {
-	head->error = EACCES;
-	return (0);
-    }
     if (path == NULL)
 	return(-2);
-    return(mknod(path, mode, rdev));
+    if (blksize < 0 || blksize > HC_MAXBUFSIZE ||
+	count < 0 || count > HC_MAXBLOCKSUMS || offset < 0)
+	return(-2);
+    if ((fd = open(path, O_RDONLY)) < 0)
+	return(-1);
+    if (blksize > 0) {
+	/* block digests (hc_blockdigests) */
+	if ((sums = malloc(count * HC_BLOCKSUMLEN + 1)) == NULL)
+	    fatal("out of memory");
+	r = blockdigest_fd(fd, offset, blksize, count, sums);
+	close(fd);
+	if (r >= 0)
+	    hcc_leaf_data(trans, LC_DATA, sums, r * HC_BLOCKSUMLEN);
+	free(sums);
+	return(r < 0 ? -1 : 0);
+    }
+    r = digest_fd(NULL, fd, buf);
+    close(fd);
+    if (r < 0)
+	return(-1);
+    hcc_leaf_string(trans, LC_DIGEST, buf);
+    return(0);
 }
 
 /*
- * LINK
+ * CLONE - create <to> sharing the blocks of <from> where the filesystem
+ * supports it (FICLONE), else as a copy made on the same host, and cut
+ * or extend it to <size> bytes.  The contents never travel.
  */
+static int
+clone_file(const char *from, const char *to, off_t size)
+{
+    char *iobuf;
+    ssize_t n;
+    int error = 0;
+    int fd1;
+    int fd2;
+    int r = -1;
+
+    if ((fd1 = open(from, O_RDONLY)) < 0)
+	return(-1);
+    if ((fd2 = open(to, O_WRONLY|O_CREAT|O_EXCL, 0600)) < 0) {
+	error = errno;
+	close(fd1);
+	errno = error;
+	return(-1);
+    }
+#ifdef FICLONE
+    r = ioctl(fd2, FICLONE, fd1);
+#endif
+    if (r < 0) {
+	if ((iobuf = malloc(HC_MAXBUFSIZE)) == NULL)
+	    fatal("out of memory");
+	while ((n = read(fd1, iobuf, HC_MAXBUFSIZE)) > 0) {
+	    if (write(fd2, iobuf, n) != n) {
+		n = -1;
+		break;
+	    }
+	}
+	if (n < 0)
+	    error = errno ? errno : EIO;
+	free(iobuf);
+    }
+    if (error == 0 && ftruncate(fd2, size) < 0)
+	error = errno;
+    close(fd1);
+    if (close(fd2) < 0 && error == 0)
+	error = errno;
+    if (error) {
+	unlink(to);
+	errno = error;
+	return(-1);
+    }
+    return(0);
+}
+
 int
-hc_link(struct HostConf *hc, const char *name1, const char *name2)
+hc_clone(struct HostConf *hc, const char *from, const char *to, off_t size)
 {
     hctransaction_t trans;
     struct HCHead *head;
@@ -1537,11 +3716,16 @@ hc_link(struct HostConf *hc, const char *name1, const char *name2)
     if (NotForRealOpt)
 	return(0);
     if (hc == NULL || hc->host == NULL)
-	return(link(name1, name2));
+	return(clone_file(from, to, size));
+    if (hc->version < HCPROTO_VERSION_CLONE) {
+	errno = EOPNOTSUPP;
+	return(-1);
+    }
 
-    trans = hcc_start_command(hc, HC_LINK);
-    hcc_leaf_string(trans, LC_PATH1, name1);
-    hcc_leaf_string(trans, LC_PATH2, name2);
+    trans = hcc_start_command(hc, HC_CLONE);
+    hcc_leaf_string(trans, LC_PATH1, from);
+    hcc_leaf_string(trans, LC_PATH2, to);
+    hcc_leaf_int64(trans, LC_FILESIZE, size);
     if ((head = hcc_finish_command(trans)) == NULL)
 	return(-1);
     if (head->error)
@@ -1550,179 +3734,389 @@ hc_link(struct HostConf *hc, const char *name1, const char *name2)
 }
 
 static int
-rc_link(hctransaction_t trans, struct HCHead *head)
+rc_clone(hctransaction_t trans, struct HCHead *head)
 {
     struct HCLeaf *item;
-    const char *name1 = NULL;
-    const char *name2 = NULL;
+    const char *from = NULL;
+    const char *to = NULL;
+    off_t size = -1;
 
     FOR_EACH_ITEM(item, trans, head) {
 	switch(item->leafid) {
 	case LC_PATH1:
-	    name1 = HCC_STRING(item);
+	    from = HCC_STRING(item);
 	    break;
 	case LC_PATH2:
-	    name2 = HCC_STRING(item);
+	    to = HCC_STRING(item);
+	    break;
+	case LC_FILESIZE:
+	    size = HCC_INT64(item);
 	    break;
 	}
     }
     if (ReadOnlyOpt) {
 	head->error = EACCES;
-	return (-0);
+	return (0);
     }
-    if (name1 == NULL || name2 == NULL)
+    if (from == NULL || to == NULL || size < 0)
 	return(-2);
-    return(link(name1, name2));
+    return(clone_file(from, to, size));
 }
 
-#ifdef _ST_FLAGS_PRESENT_
 /*
- * CHFLAGS
+ * TREEDIGEST - digests of whole subtrees, so two trees can be compared
+ * (-t) without listing them.  The digest of an entry covers its type and
+ * mode, the size and mtime or contents of a file, the target of a
+ * symlink, and for a directory the names and digests of its entries in
+ * name order, see TREE_* for the variants.  Directories on another
+ * filesystem than <top> count as empty, as cpdup does not descend into
+ * them.
+ *
+ * Directory digests are kept for the rest of the session, the trees are
+ * not expected to change while they are being compared.
  */
-int
-hc_chflags(struct HostConf *hc, const char *path, u_long flags)
-{
-    hctransaction_t trans;
-    struct HCHead *head;
-    int rc;
+#define TREE_HSIZE	16384
+
+struct TreeEnt {
+    struct TreeEnt *te_Next;
+    dev_t	te_Dev;
+    int		te_Flags;
+    unsigned char te_Digest[HC_BLOCKSUMLEN];
+    char	te_Path[];
+};
 
-    if (NotForRealOpt)
-	return(0);
-    if (!DstRootPrivs)
-	flags &= UF_SETTABLE;
+static struct TreeEnt *TreeHash[TREE_HSIZE];
+static pthread_mutex_t TreeLock = PTHREAD_MUTEX_INITIALIZER;
 
-    if (hc == NULL || hc->host == NULL) {
-	if ((rc = chflags(path, flags)) < 0)
-	    rc = silentwarning(&chflags_warning, "file flags may differ\n");
-	return (rc);
-    }
+static int tree_digest(const char *path, int flags, dev_t dev,
+	unsigned char *md);
 
-    trans = hcc_start_command(hc, HC_CHFLAGS);
-    hcc_leaf_string(trans, LC_PATH1, path);
-    hcc_leaf_int64(trans, LC_FILEFLAGS, flags);
-    if ((head = hcc_finish_command(trans)) == NULL)
-	return(-1);
-    if (head->error)
-	return(-1);
-    return(0);
+static struct TreeEnt **
+tree_lookup(const char *path, int flags, dev_t dev)
+{
+    struct TreeEnt **tep;
+    unsigned int hv = 0;
+    const char *p;
+
+    for (p = path; *p; ++p)
+	hv = (hv << 5) ^ (hv >> 27) ^ (unsigned char)*p;
+    for (tep = &TreeHash[hv % TREE_HSIZE]; *tep; tep = &(*tep)->te_Next) {
+	if ((*tep)->te_Flags == flags && (*tep)->te_Dev == dev &&
+	    strcmp((*tep)->te_Path, path) == 0)
+	    break;
+    }
+    return(tep);
 }
 
-int
-hc_lchflags(struct HostConf *hc, const char *path, u_long flags)
+static int
+tree_namecmp(const void *p1, const void *p2)
 {
-    hctransaction_t trans;
-    struct HCHead *head;
-    int rc;
+    return(strcmp(*(char * const *)p1, *(char * const *)p2));
+}
 
-    if (NotForRealOpt)
+/*
+ * Digest of the entries of directory <path>.
+ */
+static int
+tree_dirdigest(EVP_MD_CTX *ctx, const char *path, int flags, dev_t dev,
+	       unsigned char *md)
+{
+    struct TreeEnt **tep;
+    struct TreeEnt *te;
+    struct dirent *den;
+    unsigned char cmd[EVP_MAX_MD_SIZE];
+    unsigned int len;
+    char **names = NULL;
+    char *cpath;
+    DIR *dir;
+    int count = 0;
+    int max = 0;
+    int i;
+
+    pthread_mutex_lock(&TreeLock);
+    te = *tree_lookup(path, flags, dev);
+    if (te != NULL)
+	memcpy(md, te->te_Digest, HC_BLOCKSUMLEN);
+    pthread_mutex_unlock(&TreeLock);
+    if (te != NULL)
 	return(0);
-    if (!DstRootPrivs)
-	flags &= UF_SETTABLE;
-
-    if (hc == NULL || hc->host == NULL) {
-	if ((rc = lchflags(path, flags)) < 0)
-	    rc = silentwarning(&chflags_warning, "file flags may differ\n");
-	return (rc);
-    }
 
-    trans = hcc_start_command(hc, HC_LCHFLAGS);
-    hcc_leaf_string(trans, LC_PATH1, path);
-    hcc_leaf_int64(trans, LC_FILEFLAGS, flags);
-    if ((head = hcc_finish_command(trans)) == NULL)
+    if ((dir = opendir(path)) == NULL)
 	return(-1);
-    if (head->error)
+    while ((den = readdir(dir)) != NULL) {
+	if (strcmp(den->d_name, ".") == 0 || strcmp(den->d_name, "..") == 0)
+	    continue;
+	if (count == max) {
+	    max = max ? max * 2 : 64;
+	    if ((names = realloc(names, max * sizeof(*names))) == NULL)
+		fatal("out of memory");
+	}
+	if ((names[count++] = strdup(den->d_name)) == NULL)
+	    fatal("out of memory");
+    }
+    closedir(dir);
+    qsort(names, count, sizeof(*names), tree_namecmp);
+
+    /* the entries' digests, then ours from them */
+    if ((cpath = malloc(strlen(path) + NAME_MAX + 2)) == NULL)
+	fatal("out of memory");
+    if (!EVP_DigestInit_ex(ctx, EVP_sha256(), NULL)) {
+	count = -1;
+	goto done;
+    }
+    for (i = 0; i < count; ++i) {
+	sprintf(cpath, "%s/%s", path, names[i]);
+	if (tree_digest(cpath, flags, dev, cmd) < 0) {
+	    if (errno == ENOENT)
+		continue;	/* went away */
+	    count = -1;
+	    goto done;
+	}
+	if (!EVP_DigestUpdate(ctx, names[i], strlen(names[i]) + 1) ||
+	    !EVP_DigestUpdate(ctx, cmd, HC_BLOCKSUMLEN)) {
+	    count = -1;
+	    goto done;
+	}
+    }
+    if (!EVP_DigestFinal_ex(ctx, md, &len))
+	count = -1;
+done:
+    free(cpath);
+    for (i = 0; i < count; ++i)
+	free(names[i]);
+    free(names);
+    if (count < 0) {
+	errno = EIO;
 	return(-1);
+    }
+
+    if ((te = malloc(sizeof(*te) + strlen(path) + 1)) == NULL)
+	fatal("out of memory");
+    te->te_Dev = dev;
+    te->te_Flags = flags;
+    memcpy(te->te_Digest, md, HC_BLOCKSUMLEN);
+    strcpy(te->te_Path, path);
+    pthread_mutex_lock(&TreeLock);
+    tep = tree_lookup(path, flags, dev);
+    if (*tep == NULL) {
+	te->te_Next = NULL;
+	*tep = te;
+    } else {
+	free(te);
+    }
+    pthread_mutex_unlock(&TreeLock);
     return(0);
 }
 
+/*
+ * Digest of the entry <path>, HC_BLOCKSUMLEN bytes.
+ */
 static int
-rc_chflags(hctransaction_t trans, struct HCHead *head)
+tree_digest(const char *path, int flags, dev_t dev, unsigned char *md)
 {
-    struct HCLeaf *item;
-    const char *path = NULL;
-    u_long flags = 0;
-    int rc;
+    unsigned char dmd[EVP_MAX_MD_SIZE];
+    char rec[PATH_MAX + 128];
+    char hex[HC_DIGESTLEN + 1];
+    unsigned int len;
+    EVP_MD_CTX *ctx;
+    struct stat st;
+    ssize_t k;
+    ssize_t n;
+    int fd;
+    int r = -1;
 
-    FOR_EACH_ITEM(item, trans, head) {
-	switch(item->leafid) {
-	case LC_PATH1:
-	    path = HCC_STRING(item);
-	    break;
-	case LC_FILEFLAGS:
-	    flags = (u_long)HCC_INT64(item);
-	    break;
+    if (lstat(path, &st) < 0)
+	return(-1);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    ctx = EVP_MD_CTX_new();
+#else
+    ctx = EVP_MD_CTX_create();
+#endif
+    if (ctx == NULL) {
+	errno = ENOMEM;
+	return(-1);
+    }
+
+    /*
+     * Symlinks are only compared by their target, their mode and mtime
+     * are not kept everywhere.
+     */
+    if (S_ISLNK(st.st_mode)) {
+	n = snprintf(rec, sizeof(rec), "l ");
+	if ((k = readlink(path, rec + n, sizeof(rec) - n - 1)) < 0)
+	    goto done;
+	n += k;
+    } else {
+	n = snprintf(rec, sizeof(rec), "%c %o",
+		     S_ISDIR(st.st_mode) ? 'd' : S_ISREG(st.st_mode) ? 'f' :
+		     S_ISCHR(st.st_mode) ? 'c' : S_ISBLK(st.st_mode) ? 'b' :
+		     S_ISFIFO(st.st_mode) ? 'p' : 's',
+		     (unsigned int)(st.st_mode & 07777));
+	if (flags & TREE_OWNER) {
+	    n += snprintf(rec + n, sizeof(rec) - n, " %u %u",
+			  (unsigned int)st.st_uid, (unsigned int)st.st_gid);
+	}
+	if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode)) {
+	    n += snprintf(rec + n, sizeof(rec) - n, " %jx",
+			  (uintmax_t)st.st_rdev);
+	}
+	if (S_ISREG(st.st_mode)) {
+	    n += snprintf(rec + n, sizeof(rec) - n, " %jd",
+			  (intmax_t)st.st_size);
+	    if ((flags & TREE_NOMTIME) == 0) {
+		n += snprintf(rec + n, sizeof(rec) - n, " %jd",
+			      (intmax_t)st.st_mtime);
+	    }
+	    if (flags & TREE_CONTENTS) {
+		if ((fd = open(path, O_RDONLY)) < 0)
+		    goto done;
+		k = digest_fd(NULL, fd, hex);
+		close(fd);
+		if (k < 0)
+		    goto done;
+		n += snprintf(rec + n, sizeof(rec) - n, " %s", hex);
+	    }
 	}
     }
-    if (ReadOnlyOpt) {
-	head->error = EACCES;
-	return (0);
+    if (S_ISDIR(st.st_mode) && st.st_dev == dev) {
+	if (tree_dirdigest(ctx, path, flags, dev, dmd) < 0)
+	    goto done;
+    } else {
+	memset(dmd, 0, HC_BLOCKSUMLEN);
     }
-    if (path == NULL)
-	return(-2);
-    if (head->cmd == HC_LCHFLAGS)
-	rc = lchflags(path, flags);
-    else
-	rc = chflags(path, flags);
-    if (rc < 0)
-	rc = silentwarning(&chflags_warning, "file flags may differ\n");
-    return(rc);
-}
-
+    if (EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) &&
+	EVP_DigestUpdate(ctx, rec, n) &&
+	EVP_DigestUpdate(ctx, dmd, HC_BLOCKSUMLEN) &&
+	EVP_DigestFinal_ex(ctx, md, &len)) {
+	r = 0;
+    } else {
+	errno = EIO;
+    }
+done:
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    EVP_MD_CTX_free(ctx);
+#else
+    EVP_MD_CTX_destroy(ctx);
 #endif
+    return(r);
+}
 
 /*
- * READLINK
+ * Digest of each of <paths> under <top> in hex, or TREE_ERROR if the
+ * entry or anything under it cannot be read.
  */
+static void
+tree_digests(const char *top, const char **paths, int count, int flags,
+	     char (*digests)[HC_DIGESTLEN + 1])
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char md[EVP_MAX_MD_SIZE];
+    struct stat st;
+    int i;
+    int j;
+
+    if (lstat(top, &st) < 0)
+	st.st_dev = (dev_t)-1;
+    for (i = 0; i < count; ++i) {
+	if (tree_digest(paths[i], flags, st.st_dev, md) < 0) {
+	    snprintf(digests[i], HC_DIGESTLEN + 1, "%s", TREE_ERROR);
+	    continue;
+	}
+	for (j = 0; j < HC_BLOCKSUMLEN; ++j) {
+	    digests[i][j * 2] = hex[md[j] >> 4];
+	    digests[i][j * 2 + 1] = hex[md[j] & 0x0f];
+	}
+	digests[i][j * 2] = 0;
+    }
+}
+
 int
-hc_readlink(struct HostConf *hc, const char *path, char *buf, int bufsiz)
+hc_treedigest(struct HostConf *hc, const char *top, const char **paths,
+	      int count, int flags, char (*digests)[HC_DIGESTLEN + 1])
 {
     hctransaction_t trans;
     struct HCHead *head;
     struct HCLeaf *item;
-    int r;
-
-    if (hc == NULL || hc->host == NULL)
-	return(readlink(path, buf, bufsiz));
+    size_t bytes;
+    int done;
+    int i;
+    int n;
 
-    trans = hcc_start_command(hc, HC_READLINK);
-    hcc_leaf_string(trans, LC_PATH1, path);
-    if ((head = hcc_finish_command(trans)) == NULL)
-	return(-1);
-    if (head->error)
+    if (hc == NULL || hc->host == NULL) {
+	tree_digests(top, paths, count, flags, digests);
+	return(0);
+    }
+    if (hc->version < HCPROTO_VERSION_TREE) {
+	errno = EOPNOTSUPP;
 	return(-1);
+    }
 
-    r = 0;
-    FOR_EACH_ITEM(item, trans, head) {
-	if (item->leafid == LC_DATA) {
-	    r = item->bytes - sizeof(*item);
-	    if (r < 0)
-		r = 0;
-	    if (r > bufsiz)
-		r = bufsiz;
-	    memcpy(buf, HCC_BINARYDATA(item), r);
+    /* as many paths per request as fit */
+    for (done = 0; done < count; done += n) {
+	trans = hcc_start_command(hc, HC_TREEDIGEST);
+	hcc_leaf_string(trans, LC_PATH2, top);
+	hcc_leaf_int32(trans, LC_TREEFLAGS, flags);
+	bytes = strlen(top);
+	for (n = 0; done + n < count && n < HC_BUFSIZE / 256; ++n) {
+	    bytes += strlen(paths[done + n]) + 16;
+	    if (n > 0 && bytes > HC_BUFSIZE / 2)
+		break;
+	    hcc_leaf_string(trans, LC_PATH1, paths[done + n]);
+	}
+	if ((head = hcc_finish_command(trans)) == NULL)
+	    return(-1);
+	if (head->error)
+	    return(-1);
+	i = 0;
+	FOR_EACH_ITEM(item, trans, head) {
+	    if (item->leafid == LC_DIGEST && i < n) {
+		snprintf(digests[done + i], HC_DIGESTLEN + 1, "%s",
+			 HCC_STRING(item));
+		++i;
+	    }
+	}
+	if (i != n) {
+	    errno = EINVAL;
+	    return(-1);
 	}
     }
-    return(r);
+    return(0);
 }
 
 static int
-rc_readlink(hctransaction_t trans, struct HCHead *head)
+rc_treedigest(hctransaction_t trans, struct HCHead *head)
 {
     struct HCLeaf *item;
-    const char *path = NULL;
-    char buf[1024];
-    int r;
+    const char *top = NULL;
+    const char *paths[HC_BUFSIZE / 256];
+    char (*digests)[HC_DIGESTLEN + 1];
+    int flags = 0;
+    int count = 0;
+    int i;
 
     FOR_EACH_ITEM(item, trans, head) {
-	if (item->leafid == LC_PATH1)
-	    path = HCC_STRING(item);
+	switch(item->leafid) {
+	case LC_PATH1:
+	    if (count == HC_BUFSIZE / 256)
+		return(-2);
+	    paths[count++] = HCC_STRING(item);
+	    break;
+	case LC_PATH2:
+	    top = HCC_STRING(item);
+	    break;
+	case LC_TREEFLAGS:
+	    flags = HCC_INT32(item);
+	    break;
+	}
     }
-    if (path == NULL)
+    if (top == NULL)
 	return(-2);
-    r = readlink(path, buf, sizeof(buf));
-    if (r < 0)
-	return(-1);
-    hcc_leaf_data(trans, LC_DATA, buf, r);
+    if ((digests = malloc((count + 1) * sizeof(*digests))) == NULL)
+	fatal("out of memory");
+    tree_digests(top, paths, count, flags, digests);
+    for (i = 0; i < count; ++i)
+	hcc_leaf_string(trans, LC_DIGEST, digests[i]);
+    free(digests);
     return(0);
 }
 
@@ -2117,3 +4511,423 @@ rc_getgroups(hctransaction_t trans, struct HCHead *head __unused)
 
     return (0);
 }
+
+/*
+ * PUTFILES
+ *
+ * Small files for a remote target are queued with hc_putfile() and sent
+ * in batches.  The slave creates, fills, chowns, chmods, utimes and if
+ * requested renames each of them, and answers with one LC_ERRNO per
+ * file.  That replaces about eight round trips per file with a share of
+ * one.
+ *
+ * Hardlinks to existing files (-H) are queued with hc_putlink() and
+ * sent the same way, with LC_LINK naming the file to link to in place of
+ * the contents.  Their report has <bytes> -1.
+ */
+struct HCPutFile {
+    struct HCPutFile *next;
+    char	*path;		/* file to create */
+    char	*dpath;		/* rename it to this, or NULL */
+    char	*target;	/* hardlink this instead, or NULL */
+    mode_t	mode;
+    uid_t	uid;
+    gid_t	gid;
+    int		setuid;
+    int		setgid;
+    int64_t	mtime;
+    int32_t	mtimensec;
+    int		bytes;		/* followed by the contents */
+};
+
+struct HCPutFiles {
+    struct HCPutFile *first;
+    struct HCPutFile **lastp;
+    int		count;
+    int		bytes;		/* size of the command so far */
+};
+
+#define PUTFILE_LIMIT	32768	/* largest file batched */
+
+static int
+putfile_leaf(const char *str)
+{
+    return(sizeof(struct HCLeaf) + HCC_ALIGN(strlen(str) + 1));
+}
+
+/*
+ * Return the largest file which may be passed to hc_putfile(), or 0 if
+ * <hc> does not do HC_PUTFILES.
+ */
+int
+hc_putfile_max(struct HostConf *hc)
+{
+    if (hc == NULL || hc->host == NULL ||
+	hc->version < HCPROTO_VERSION_PUTFILES)
+	return(0);
+    if (hc->trans.bufsize / 4 < PUTFILE_LIMIT)
+	return(hc->trans.bufsize / 4);
+    return(PUTFILE_LIMIT);
+}
+
+/*
+ * Queue a file, sending the batch first if it would not fit.  <dpath>
+ * is NULL if <path> is the final name.  <report> is called for every
+ * file once the slave answered, returns the number of failed files of
+ * a batch sent now.
+ */
+int
+hc_putfile(struct HostConf *hc, const char *path, const char *dpath,
+	   const struct stat *st, int setuid, int setgid,
+	   const void *data, int bytes,
+	   void (*report)(const char *path, int bytes, int error))
+{
+    struct HCPutFiles *batch;
+    struct HCPutFile *pf;
+    int size;
+    int r = 0;
+
+    assert(bytes <= hc_putfile_max(hc));
+    if ((batch = hc->putfiles) == NULL) {
+	if ((batch = calloc(1, sizeof(*batch))) == NULL)
+	    fatal("out of memory");
+	batch->lastp = &batch->first;
+	batch->bytes = sizeof(struct HCHead);
+	hc->putfiles = batch;
+    }
+
+    /* PATH1, PATH2, MODE, UID, GID, MTIME, MTIMENSEC, DATA */
+    size = putfile_leaf(path) + (dpath ? putfile_leaf(dpath) : 0) +
+	   6 * (sizeof(struct HCLeaf) + sizeof(int64_t)) +
+	   sizeof(struct HCLeaf) + HCC_ALIGN(bytes);
+    if (batch->bytes + size >= hc->trans.bufsize)
+	r = hc_putfiles_flush(hc, report);
+
+    if ((pf = malloc(sizeof(*pf) + bytes)) == NULL)
+	fatal("out of memory");
+    pf->next = NULL;
+    pf->path = strdup(path);
+    pf->dpath = dpath ? strdup(dpath) : NULL;
+    pf->target = NULL;
+    pf->mode = st->st_mode & 07777;
+    pf->uid = st->st_uid;
+    pf->gid = st->st_gid;
+    pf->setuid = setuid;
+    pf->setgid = setgid;
+    pf->mtime = st->st_mtime;
+#if defined(st_mtime)
+    /* same resolution as hc_utimes() */
+    pf->mtimensec = st->st_mtim.tv_nsec / 1000 * 1000;
+#else
+    pf->mtimensec = 0;
+#endif
+    pf->bytes = bytes;
+    memcpy(pf + 1, data, bytes);
+    *batch->lastp = pf;
+    batch->lastp = &pf->next;
+    ++batch->count;
+    batch->bytes += size;
+    return(r);
+}
+
+/*
+ * Queue a hardlink of <target> as <path>, like hc_putfile().  Returns -1
+ * if <hc> does not do this.
+ */
+int
+hc_putlink(struct HostConf *hc, const char *path, const char *dpath,
+	   const char *target,
+	   void (*report)(const char *path, int bytes, int error))
+{
+    struct HCPutFiles *batch;
+    struct HCPutFile *pf;
+    int size;
+    int r = 0;
+
+    if (hc == NULL || hc->host == NULL ||
+	hc->version < HCPROTO_VERSION_PUTLINK)
+	return(-1);
+    if ((batch = hc->putfiles) == NULL) {
+	if ((batch = calloc(1, sizeof(*batch))) == NULL)
+	    fatal("out of memory");
+	batch->lastp = &batch->first;
+	batch->bytes = sizeof(struct HCHead);
+	hc->putfiles = batch;
+    }
+
+    /* PATH1, PATH2, LINK */
+    size = putfile_leaf(path) + (dpath ? putfile_leaf(dpath) : 0) +
+	   putfile_leaf(target);
+    if (batch->bytes + size >= hc->trans.bufsize)
+	r = hc_putfiles_flush(hc, report);
+
+    if ((pf = calloc(1, sizeof(*pf))) == NULL)
+	fatal("out of memory");
+    pf->path = strdup(path);
+    pf->dpath = dpath ? strdup(dpath) : NULL;
+    pf->target = strdup(target);
+    pf->bytes = -1;
+    *batch->lastp = pf;
+    batch->lastp = &pf->next;
+    ++batch->count;
+    batch->bytes += size;
+    return(r);
+}
+
+/*
+ * Send the queued files.  Returns the number of files which failed.
+ */
+int
+hc_putfiles_flush(struct HostConf *hc,
+		  void (*report)(const char *path, int bytes, int error))
+{
+    struct HCPutFiles *batch = hc->putfiles;
+    struct HCPutFile *pf;
+    hctransaction_t trans;
+    struct HCHead *head;
+    struct HCLeaf *item;
+    int failed = 0;
+    int error;
+
+    if (batch == NULL || batch->first == NULL)
+	return(0);
+
+    trans = hcc_start_command(hc, HC_PUTFILES);
+    for (pf = batch->first; pf != NULL; pf = pf->next) {
+	hcc_leaf_string(trans, LC_PATH1, pf->path);
+	if (pf->dpath)
+	    hcc_leaf_string(trans, LC_PATH2, pf->dpath);
+	if (pf->target) {
+	    /* ends the entry like the contents */
+	    hcc_leaf_string(trans, LC_LINK, pf->target);
+	    continue;
+	}
+	hcc_leaf_int32(trans, LC_MODE, pf->mode);
+	if (pf->setuid)
+	    hcc_leaf_int32(trans, LC_UID, pf->uid);
+	if (pf->setgid)
+	    hcc_leaf_int32(trans, LC_GID, pf->gid);
+	hcc_leaf_int64(trans, LC_MTIME, pf->mtime);
+	hcc_leaf_int32(trans, LC_MTIMENSEC, pf->mtimensec);
+	/* the contents must be the last item of a file */
+	hcc_leaf_data(trans, LC_DATA, pf + 1, pf->bytes);
+    }
+
+    /*
+     * Pair the status vector with the queue.  Files without a status
+     * (lost connection, error) failed.
+     */
+    pf = batch->first;
+    if ((head = hcc_finish_command(trans)) != NULL && head->error == 0) {
+	while (pf != NULL && (item = hcc_nextchaineditem(hc, head)) != NULL) {
+	    if (item->leafid != LC_ERRNO)
+		continue;
+	    error = HCC_INT32(item);
+	    report(pf->dpath ? pf->dpath : pf->path, pf->bytes, error);
+	    if (error)
+		++failed;
+	    pf = pf->next;
+	}
+    }
+    error = (head && head->error) ? head->error : EIO;
+    for (; pf != NULL; pf = pf->next) {
+	report(pf->dpath ? pf->dpath : pf->path, pf->bytes, error);
+	++failed;
+    }
+
+    while ((pf = batch->first) != NULL) {
+	batch->first = pf->next;
+	free(pf->path);
+	if (pf->dpath)
+	    free(pf->dpath);
+	if (pf->target)
+	    free(pf->target);
+	free(pf);
+    }
+    batch->lastp = &batch->first;
+    batch->count = 0;
+    batch->bytes = sizeof(struct HCHead);
+    return(failed);
+}
+
+/*
+ * Create one file for rc_putfiles(), returns 0 or an errno.
+ */
+static int
+putfile(const char *path, const char *dpath, mode_t mode, uid_t uid,
+	gid_t gid, struct timeval *tv, const void *data, int bytes)
+{
+    ssize_t n;
+    int error = 0;
+    int fd;
+
+    if ((fd = open(path, O_WRONLY|O_CREAT|O_EXCL, 0600)) < 0) {
+	/* leftover of an interrupted run */
+	remove(path);
+	if ((fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_TRUNC, 0600)) < 0)
+	    return(errno);
+    }
+    if ((n = write(fd, data, bytes)) != bytes)
+	error = (n < 0) ? errno : EIO;
+    if (error == 0) {
+	if (uid != (uid_t)-1 || gid != (gid_t)-1) {
+	    if (fchown(fd, uid, gid) < 0) {
+		/* ignored, like failed chowns of hc_chown() */
+	    }
+	}
+	fchmod(fd, mode);
+    }
+    if (close(fd) < 0 && error == 0)
+	error = errno;
+    if (error == 0) {
+	utimes(path, tv);
+	if (dpath && rename(path, dpath) < 0)
+	    error = errno;
+    }
+    if (error)
+	remove(path);
+    return(error);
+}
+
+/*
+ * Hardlink <target> as <path> for rc_putfiles(), returns 0 or an errno.
+ * If <target> has too many links already, <path> becomes a copy of it.
+ */
+static int
+putlink(const char *target, const char *path, const char *dpath)
+{
+    struct timeval tv[2];
+    struct stat st;
+    char *buf;
+    ssize_t n;
+    int error = 0;
+    int fd1;
+    int fd2;
+
+    if (link(target, path) == 0)
+	goto linked;
+    if (errno == EEXIST) {
+	/* leftover of an interrupted run */
+	remove(path);
+	if (link(target, path) == 0)
+	    goto linked;
+    }
+    if (errno != EMLINK)
+	return(errno);
+
+    if ((fd1 = open(target, O_RDONLY)) < 0)
+	return(errno);
+    if (fstat(fd1, &st) < 0 ||
+	(fd2 = open(path, O_WRONLY|O_CREAT|O_EXCL, 0600)) < 0) {
+	error = errno;
+	close(fd1);
+	return(error);
+    }
+    buf = malloc(HC_BUFSIZE);
+    while ((n = read(fd1, buf, HC_BUFSIZE)) > 0) {
+	if (write(fd2, buf, n) != n) {
+	    n = -1;
+	    break;
+	}
+    }
+    if (n < 0)
+	error = EIO;
+    free(buf);
+    close(fd1);
+    if (error == 0) {
+	if (fchown(fd2, st.st_uid, st.st_gid) < 0) {
+	    /* ignored, like failed chowns of hc_chown() */
+	}
+	fchmod(fd2, st.st_mode & 07777);
+    }
+    if (close(fd2) < 0 && error == 0)
+	error = errno;
+    if (error) {
+	remove(path);
+	return(error);
+    }
+    memset(tv, 0, sizeof(tv));
+    tv[0].tv_sec = st.st_atime;
+    tv[1].tv_sec = st.st_mtime;
+#if defined(st_mtime)
+    tv[0].tv_usec = st.st_atim.tv_nsec / 1000;
+    tv[1].tv_usec = st.st_mtim.tv_nsec / 1000;
+#endif
+    utimes(path, tv);
+linked:
+    if (dpath && rename(path, dpath) < 0) {
+	error = errno;
+	remove(path);
+    }
+    return(error);
+}
+
+static int
+rc_putfiles(hctransaction_t trans, struct HCHead *head)
+{
+    struct HCLeaf *item;
+    struct timeval tv[2];
+    const char *path = NULL;
+    const char *dpath = NULL;
+    mode_t mode = 0600;
+    uid_t uid = (uid_t)-1;
+    gid_t gid = (gid_t)-1;
+    int error;
+
+    if (ReadOnlyOpt) {
+	head->error = EACCES;
+	return (0);
+    }
+    memset(tv, 0, sizeof(tv));
+    FOR_EACH_ITEM(item, trans, head) {
+	switch(item->leafid) {
+	case LC_PATH1:
+	    path = HCC_STRING(item);
+	    break;
+	case LC_PATH2:
+	    dpath = HCC_STRING(item);
+	    break;
+	case LC_MODE:
+	    mode = HCC_INT32(item);
+	    break;
+	case LC_UID:
+	    uid = HCC_INT32(item);
+	    break;
+	case LC_GID:
+	    gid = HCC_INT32(item);
+	    break;
+	case LC_MTIME:
+	    tv[1].tv_sec = HCC_INT64(item);
+	    break;
+	case LC_MTIMENSEC:
+	    tv[1].tv_usec = HCC_INT32(item) / 1000;
+	    break;
+	case LC_DATA:
+	    if (path == NULL)
+		return(-2);
+	    tv[0] = tv[1];
+	    error = putfile(path, dpath, mode, uid, gid, tv,
+			    HCC_BINARYDATA(item),
+			    item->bytes - sizeof(*item));
+	    if (!hcc_check_space(trans, head, 1, sizeof(int32_t)))
+		return(-1);
+	    hcc_leaf_int32(trans, LC_ERRNO, error);
+	    path = dpath = NULL;
+	    mode = 0600;
+	    uid = (uid_t)-1;
+	    gid = (gid_t)-1;
+	    memset(tv, 0, sizeof(tv));
+	    break;
+	case LC_LINK:
+	    if (path == NULL)
+		return(-2);
+	    error = putlink(HCC_STRING(item), path, dpath);
+	    if (!hcc_check_space(trans, head, 1, sizeof(int32_t)))
+		return(-1);
+	    hcc_leaf_int32(trans, LC_ERRNO, error);
+	    path = dpath = NULL;
+	    break;
+	}
+    }
+    return(0);
+}
@@ -34,9 +34,19 @@
 #ifndef _HCPROTO_H_
 #define _HCPROTO_H_
 
-#define HCPROTO_VERSION		6
+#define HCPROTO_VERSION		16
 #define HCPROTO_VERSION_COMPAT	2
 #define HCPROTO_VERSION_LUCC	6	/* lutimes, lchflags, lchmod */
+#define HCPROTO_VERSION_RMTREE	7	/* slave-side subtree removal */
+#define HCPROTO_VERSION_SCANTREE 8	/* recursive tree listing */
+#define HCPROTO_VERSION_PACKSTAT 9	/* packed stat records */
+#define HCPROTO_VERSION_PUTFILES 10	/* batched small file creation */
+#define HCPROTO_VERSION_INLINE	11	/* small file contents in listings */
+#define HCPROTO_VERSION_RANGES	12	/* byte ranges in READFILE and WRITE */
+#define HCPROTO_VERSION_DIGEST	13	/* file digests */
+#define HCPROTO_VERSION_PUTLINK	14	/* hardlinks in PUTFILES */
+#define HCPROTO_VERSION_CLONE	15	/* clones and block digests */
+#define HCPROTO_VERSION_TREE	16	/* subtree digests */
 
 #define HC_HELLO	0x0001
 
@@ -70,6 +80,12 @@
 #define HC_LUTIMES	0x002B
 #define HC_LCHFLAGS	0x002C
 #define HC_LCHMOD	0x002D
+#define HC_RMTREE	0x002E
+#define HC_SCANTREE	0x002F
+#define HC_PUTFILES	0x0030
+#define HC_DIGEST	0x0031
+#define HC_CLONE	0x0032
+#define HC_TREEDIGEST	0x0033
 
 #define LC_HELLOSTR	(0x0001|LCF_STRING)
 #define LC_PATH1	(0x0010|LCF_STRING)
@@ -101,6 +117,18 @@
 #define LC_ATIMENSEC	(0x002A|LCF_INT32)
 #define LC_MTIMENSEC	(0x002B|LCF_INT32)
 #define LC_CTIMENSEC	(0x002C|LCF_INT32)
+#define LC_ERRNO	(0x002D|LCF_INT32)
+#define LC_VERBOSE	(0x002E|LCF_INT32)
+#define LC_DIRBASE	(0x002F|LCF_BINARY)
+#define LC_STATREC	(0x0030|LCF_BINARY)
+#define LC_DIRENT	(0x0031|LCF_BINARY)
+#define LC_BUFSIZE	(0x0032|LCF_INT32)
+#define LC_INLINE	(0x0034|LCF_INT32)
+#define LC_OFFSET	(0x0035|LCF_INT64)
+#define LC_LENGTH	(0x0036|LCF_INT64)
+#define LC_DIGEST	(0x0037|LCF_STRING)
+#define LC_LINK		(0x0038|LCF_STRING)
+#define LC_TREEFLAGS	(0x0039|LCF_INT32)
 
 #define XO_NATIVEMASK	3		/* passed through directly */
 #define XO_CREAT	0x00010000
@@ -109,6 +137,16 @@
 
 #define HC_DESC_DIR	1
 #define HC_DESC_FD	2
+#define HC_DESC_INLINE	3	/* client side, see hc_open() */
+
+#define HC_DIGESTLEN	64	/* SHA-256 in hex digits */
+#define HC_BLOCKSUMLEN	32	/* SHA-256 of a block, binary */
+#define HC_MAXBLOCKSUMS	(HC_BUFSIZE / 2 / HC_BLOCKSUMLEN) /* per reply */
+
+#define TREE_OWNER	0x0001	/* subtree digests cover uid and gid */
+#define TREE_CONTENTS	0x0002	/* ... the contents of files */
+#define TREE_NOMTIME	0x0004	/* ... but not their mtime */
+#define TREE_ERROR	"-"	/* digest of an entry which cannot be read */
 
 #ifndef NAME_MAX
 #  ifdef MAXNAMLEN
@@ -120,24 +158,38 @@
 
 struct HCDirEntry {
 	char d_name[NAME_MAX + 1];
+	ino_t d_ino;			/* local directories only */
 };
 
 int hc_connect(struct HostConf *hc, int readonly);
+void hc_disconnect(struct HostConf *hc);
 void hc_slave(int fdin, int fdout);
+void hc_listen(const char *port);
 
 int hc_hello(struct HostConf *hc);
+int hc_scantree(struct HostConf *hc);
+int hc_prefetch_start(struct HostConf *hc, int ahead);
+void hc_prefetch_begin(struct HostConf *hc);
+void hc_prefetch(struct HostConf *hc, const char *path, off_t size);
+void hc_prefetch_drop(struct HostConf *hc, const char *path);
 int hc_stat(struct HostConf *hc, const char *path, struct stat *st);
 int hc_lstat(struct HostConf *hc, const char *path, struct stat *st);
 DIR *hc_opendir(struct HostConf *hc, const char *path);
 struct HCDirEntry *hc_readdir(struct HostConf *hc, DIR *dir, struct stat **statpp);
 int hc_closedir(struct HostConf *hc, DIR *dir);
 int hc_open(struct HostConf *hc, const char *path, int flags, mode_t mode);
+int hc_openrange(struct HostConf *hc, const char *path, off_t offset,
+	off_t length);
 int hc_close(struct HostConf *hc, int fd);
 ssize_t hc_read(struct HostConf *hc, int fd, void *buf, size_t bytes);
 ssize_t hc_write(struct HostConf *hc, int fd, const void *buf, size_t bytes);
+ssize_t hc_pwrite(struct HostConf *hc, int fd, const void *buf, size_t bytes,
+	off_t offset);
 int hc_remove(struct HostConf *hc, const char *path);
 int hc_mkdir(struct HostConf *hc, const char *path, mode_t mode);
 int hc_rmdir(struct HostConf *hc, const char *path);
+int hc_rmtree(struct HostConf *hc, const char *path, dev_t devNo,
+	void (*report)(const char *path, mode_t mode, int error));
 int hc_chown(struct HostConf *hc, const char *path, uid_t owner, gid_t group);
 int hc_lchown(struct HostConf *hc, const char *path, uid_t owner, gid_t group);
 int hc_chmod(struct HostConf *hc, const char *path, mode_t mode);
@@ -147,6 +199,13 @@ int hc_link(struct HostConf *hc, const char *name1, const char *name2);
 int hc_chflags(struct HostConf *hc, const char *path, u_long flags);
 int hc_lchflags(struct HostConf *hc, const char *path, u_long flags);
 int hc_readlink(struct HostConf *hc, const char *path, char *buf, int bufsiz);
+int hc_digest(struct HostConf *hc, const char *path, char *buf);
+int hc_blockdigests(struct HostConf *hc, const char *path, off_t offset,
+	int blksize, int count, unsigned char *buf);
+int hc_clone(struct HostConf *hc, const char *from, const char *to,
+	off_t size);
+int hc_treedigest(struct HostConf *hc, const char *top, const char **paths,
+	int count, int flags, char (*digests)[HC_DIGESTLEN + 1]);
 mode_t hc_umask(struct HostConf *hc, mode_t numask);
 int hc_symlink(struct HostConf *hc, const char *name1, const char *name2);
 int hc_rename(struct HostConf *hc, const char *name1, const char *name2);
@@ -154,5 +213,15 @@ int hc_utimes(struct HostConf *hc, const char *path, const struct timeval *times
 int hc_lutimes(struct HostConf *hc, const char *path, const struct timeval *times);
 uid_t hc_geteuid(struct HostConf *hc);
 int hc_getgroups(struct HostConf *hc, gid_t **gidlist);
+int hc_putfile_max(struct HostConf *hc);
+int hc_putfile(struct HostConf *hc, const char *path, const char *dpath,
+	const struct stat *st, int setuid, int setgid,
+	const void *data, int bytes,
+	void (*report)(const char *path, int bytes, int error));
+int hc_putlink(struct HostConf *hc, const char *path, const char *dpath,
+	const char *target,
+	void (*report)(const char *path, int bytes, int error));
+int hc_putfiles_flush(struct HostConf *hc,
+	void (*report)(const char *path, int bytes, int error));
 
 #endif /* !_HCPROTO_H_ */
@@ -0,0 +1,297 @@
+/*-
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ * Copyright (c) 1997-2010 by Matthew Dillon, Dima Ruban, and Oliver Fromme.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ * 3. Neither the name of The DragonFly Project nor the names of its
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific, prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * This module implements the shared memory transport (-T shm).
+ *
+ * cpdup and a forked slave exchange the HC byte stream through two
+ * single-producer/single-consumer rings in an anonymous shared mapping,
+ * one for commands and one for replies, instead of through a pipe.
+ * A process which finds the ring it waits on empty (or full) spins for
+ * a moment, then sleeps on a wakeup pipe until the other side writes
+ * a byte to it.  Waiting for data and waiting for room use different
+ * pipes, so a wakeup for one can never be taken for the other.  The
+ * pipes also tell us when the other side went away.
+ */
+
+#include "cpdup.h"
+#include "hclink.h"
+
+#include <sys/mman.h>
+
+#define HC_RINGSIZE	(4 * 1024 * 1024)	/* must be a power of 2 */
+#define HC_SPINS	1000
+
+struct HCRing {
+    uint64_t	head;		/* bytes written, producer only */
+    char	pad1[56];
+    uint64_t	tail;		/* bytes read, consumer only */
+    char	pad2[56];
+    int		rwait;		/* consumer is asleep */
+    int		wwait;		/* producer is asleep */
+    char	pad3[56];
+    char	data[HC_RINGSIZE];
+};
+
+struct HCShm {
+    struct HCRing *in;
+    struct HCRing *out;
+    int		rwakefd;	/* we sleep on these for data ... */
+    int		wwakefd;	/* ... or for room */
+    int		rpeerfd;	/* wake the other side's reader ... */
+    int		wpeerfd;	/* ... or writer */
+    int		pipes[4][2];	/* wakeup pipes, -1 once closed */
+};
+
+/* pipes[] */
+#define SHM_CREAD	0	/* cpdup waits for replies */
+#define SHM_CWRITE	1	/* cpdup waits for room for commands */
+#define SHM_SREAD	2	/* the slave waits for commands */
+#define SHM_SWRITE	3	/* the slave waits for room for replies */
+
+/*
+ * Map the rings and create the wakeup pipes.  Must be called before
+ * forking the slave, then both sides pick their ends with hcc_shm_side().
+ */
+struct HCShm *
+hcc_shm_create(void)
+{
+    struct HCShm *shm;
+    struct HCRing *rings;
+    int i;
+
+    rings = mmap(NULL, 2 * sizeof(struct HCRing), PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_ANON, -1, 0);
+    if (rings == MAP_FAILED)
+	return(NULL);
+    if ((shm = calloc(1, sizeof(*shm))) == NULL)
+	fatal("out of memory");
+    for (i = 0; i < 4; ++i) {
+	if (pipe(shm->pipes[i]) < 0) {
+	    while (--i >= 0) {
+		close(shm->pipes[i][0]);
+		close(shm->pipes[i][1]);
+	    }
+	    munmap(rings, 2 * sizeof(struct HCRing));
+	    free(shm);
+	    return(NULL);
+	}
+    }
+    /* rings[0] carries commands, rings[1] replies */
+    shm->in = rings;
+    shm->out = rings + 1;
+    return(shm);
+}
+
+void
+hcc_shm_side(struct HCShm *shm, int slave)
+{
+    struct HCRing *cmds = shm->in;
+    struct HCRing *replies = shm->out;
+    int mine[2];
+    int peers[2];
+    int i;
+
+    if (slave) {
+	shm->in = cmds;
+	shm->out = replies;
+	mine[0] = SHM_SREAD;
+	mine[1] = SHM_SWRITE;
+	peers[0] = SHM_CREAD;
+	peers[1] = SHM_CWRITE;
+    } else {
+	shm->in = replies;
+	shm->out = cmds;
+	mine[0] = SHM_CREAD;
+	mine[1] = SHM_CWRITE;
+	peers[0] = SHM_SREAD;
+	peers[1] = SHM_SWRITE;
+    }
+    shm->rwakefd = shm->pipes[mine[0]][0];
+    shm->wwakefd = shm->pipes[mine[1]][0];
+    shm->rpeerfd = shm->pipes[peers[0]][1];
+    shm->wpeerfd = shm->pipes[peers[1]][1];
+    for (i = 0; i < 2; ++i) {
+	close(shm->pipes[mine[i]][1]);
+	close(shm->pipes[peers[i]][0]);
+	shm->pipes[mine[i]][1] = -1;
+	shm->pipes[peers[i]][0] = -1;
+	/* a full pipe already holds a wakeup */
+	fcntl(shm->pipes[peers[i]][1], F_SETFL,
+	      fcntl(shm->pipes[peers[i]][1], F_GETFL) | O_NONBLOCK);
+    }
+}
+
+/*
+ * Unmap the rings and close our ends of the wakeup pipes, which tells
+ * the other side we went away.
+ */
+void
+hcc_shm_destroy(struct HCShm *shm)
+{
+    int i;
+
+    munmap((shm->in < shm->out) ? shm->in : shm->out,
+	   2 * sizeof(struct HCRing));
+    for (i = 0; i < 4; ++i) {
+	if (shm->pipes[i][0] >= 0)
+	    close(shm->pipes[i][0]);
+	if (shm->pipes[i][1] >= 0)
+	    close(shm->pipes[i][1]);
+    }
+    free(shm);
+}
+
+/*
+ * Wait until *pos moves away from <old>.  *flag tells the other side to
+ * wake us after moving it.  Setting the flag and then checking *pos,
+ * while the other side moves *pos and then checks the flag, guarantees
+ * that one of the two sees the other.
+ *
+ * Returns 0, or -1 with errno EPIPE if the other side went away.
+ */
+static int
+shm_wait(int wakefd, uint64_t *pos, uint64_t old, int *flag)
+{
+    char c;
+    int i;
+
+    for (i = 0; i < HC_SPINS; ++i) {
+	if (__atomic_load_n(pos, __ATOMIC_ACQUIRE) != old)
+	    return(0);
+    }
+    for (;;) {
+	__atomic_store_n(flag, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(pos, __ATOMIC_SEQ_CST) != old) {
+	    __atomic_store_n(flag, 0, __ATOMIC_SEQ_CST);
+	    return(0);
+	}
+	switch(read(wakefd, &c, 1)) {
+	case 0:
+	    errno = EPIPE;
+	    return(-1);
+	case -1:
+	    if (errno != EINTR)
+		return(-1);
+	    break;
+	}
+    }
+}
+
+static void
+shm_wake(int peerfd, int *flag)
+{
+    if (__atomic_exchange_n(flag, 0, __ATOMIC_SEQ_CST)) {
+	if (write(peerfd, "", 1) < 0) {
+	    /* EAGAIN: the pipe is full of wakeups already */
+	}
+    }
+}
+
+/*
+ * Like read(2): returns what is available, up to <bytes>, waiting for
+ * at least one byte.  Returns 0 if the other side went away.
+ */
+ssize_t
+hcc_shm_read(struct HCShm *shm, void *buf, size_t bytes)
+{
+    struct HCRing *r = shm->in;
+    uint64_t tail = r->tail;
+    uint64_t head;
+    size_t off;
+    size_t n;
+    size_t x;
+
+    while ((head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) == tail) {
+	if (shm_wait(shm->rwakefd, &r->head, tail, &r->rwait) < 0)
+	    return(errno == EPIPE ? 0 : -1);
+    }
+    n = head - tail;
+    if (n > bytes)
+	n = bytes;
+    off = tail & (HC_RINGSIZE - 1);
+    x = (n > HC_RINGSIZE - off) ? HC_RINGSIZE - off : n;
+    memcpy(buf, r->data + off, x);
+    memcpy((char *)buf + x, r->data, n - x);
+    __atomic_store_n(&r->tail, tail + n, __ATOMIC_SEQ_CST);
+    shm_wake(shm->wpeerfd, &r->wwait);
+    return(n);
+}
+
+/*
+ * Write all of <bytes>, waiting for room as needed.
+ */
+ssize_t
+hcc_shm_write(struct HCShm *shm, const void *buf, size_t bytes)
+{
+    struct HCRing *r = shm->out;
+    uint64_t head = r->head;
+    uint64_t tail;
+    size_t done = 0;
+    size_t off;
+    size_t n;
+    size_t x;
+
+    while (done < bytes) {
+	while ((tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) +
+	       HC_RINGSIZE == head) {
+	    if (shm_wait(shm->wwakefd, &r->tail, tail, &r->wwait) < 0)
+		return(-1);
+	}
+	n = HC_RINGSIZE - (head - tail);
+	if (n > bytes - done)
+	    n = bytes - done;
+	off = head & (HC_RINGSIZE - 1);
+	x = (n > HC_RINGSIZE - off) ? HC_RINGSIZE - off : n;
+	memcpy(r->data + off, (const char *)buf + done, x);
+	memcpy(r->data, (const char *)buf + done + x, n - x);
+	head += n;
+	done += n;
+	__atomic_store_n(&r->head, head, __ATOMIC_SEQ_CST);
+	shm_wake(shm->rpeerfd, &r->rwait);
+    }
+    return(done);
+}
+
+ssize_t
+hcc_shm_writev(struct HCShm *shm, const struct iovec *iov, int count)
+{
+    ssize_t done = 0;
+    int i;
+
+    for (i = 0; i < count; ++i) {
+	if (hcc_shm_write(shm, iov[i].iov_base, iov[i].iov_len) < 0)
+	    return(-1);
+	done += iov[i].iov_len;
+    }
+    return(done);
+}
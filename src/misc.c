@@ -157,17 +157,28 @@ fatal(const char *ctl, ...)
     va_list va;
 
     if (ctl == NULL) {
-	puts("usage: cpdup [options] src dest");
+	puts("usage: cpdup [options] src dest [dest ...]");
 	puts("\n"
 	     "options:\n"
+	     "    -a          append to target files if their source only\n"
+	     "                grew at the end\n"
+	     "    -A n        read up to n files ahead from a remote source\n"
+	     "    -B n        merge directories of more than n entries\n"
+	     "                through sorted temporary files\n"
 	     "    -C          request compressed ssh link if remote operation\n"
+	     "    -c          with -H, clone large changed files from path\n"
+	     "                and rewrite only the blocks that differ\n"
+	     "    -D store    keep file contents once in store, named after\n"
+	     "                their digest, and hardlink the target to them\n"
 	     "    -d          print directories being traversed\n"
+	     "    -e plan     make the changes written to plan by -w\n"
 	     "    -f          force update even if files look the same\n"
 	     "    -F<ssh_opt> add <ssh_opt> to options passed to ssh\n"
 	     "    -h          show this help\n"
 	     "    -H path     hardlink from path to target instead of copying\n"
 	     "    -I          display performance summary\n"
 	     "    -i0         do NOT confirm when removing something\n"
+	     "    -J file     keep a journal to resume an interrupted copy\n"
 	     "    -j0         do not try to recreate CHR or BLK devices\n"
 	     "    -l          force line-buffered stdout/stderr"
 	);
@@ -180,21 +191,37 @@ fatal(const char *ctl, ...)
 	);
 #endif
 	puts("    -n          do not make any real changes to the target\n"
+	     "    -O          copy a local source in the order of its\n"
+	     "                physical layout on the disk\n"
 	     "    -o          do not remove any files, just overwrite/add\n"
+	     "    -P          stream the remote source tree over a second\n"
+	     "                connection ahead of the copy\n"
+	     "    -p n        copy files of 64MB or more in n parallel lanes\n"
 	     "    -q          quiet operation\n"
+	     "    -r file     move renamed files on the target instead of\n"
+	     "                copying them, using the manifest in file\n"
 	     "    -R          read-only slave mode for ssh remotes\n"
 	     "                source to target, if source matches path.\n"
 	     "    -S          slave mode\n"
 	     "    -s0         disable safeties - allow files to overwrite directories\n"
+	     "    -T how      reach remote hosts via ssh (default), local\n"
+	     "                (forked slave), shm (forked slave, shared\n"
+	     "                memory) or tcp[:port] (trusted networks)\n"
+	     "    -t          compare the trees by digests instead of\n"
+	     "                copying, print the entries which differ\n"
 	     "    -u          use unbuffered output for -v[vv]\n"
 	     "    -v[vv]      verbose level (-vv is typical)\n"
 	     "    -V          verify file contents even if they appear\n"
 	     "                to be the same.\n"
 	     "    -VV         same as -V but ignore mtime entirely\n"
+	     "    -w plan     write the changes to make to plan instead\n"
+	     "                of making them, print their totals\n"
 	     "    -x          use .cpignore as exclusion file\n"
 	     "    -X file     specify exclusion file (can match full source\n"
 	     "                path if the exclusion file is specified via\n"
 	     "                an absolute path.\n"
+	     "    -Z size     list remote source files up to size bytes\n"
+	     "                together with their contents\n"
 	     "\n"
 	     "Version " VERSION " by " AUTHORS "\n"
 	);